@@ -28,7 +28,11 @@
 #include "threshold-impl.hpp"
 #include "passthrough-impl.hpp"
 #include "pktgen-impl.hpp"
+#if MLX_AXI4_WIDTH_BITS == 256
 #include "memcached-ik.hpp"
+#endif
+
+#include <ntl/tests/memory_model.hpp>
 
 #include <boost/preprocessor/iteration/local.hpp>
 
@@ -122,8 +126,10 @@ namespace emulation {
                 func = passthrough_top;
             else if (ikernel_str == "pktgen")
                 func = pktgen_top;
+#if MLX_AXI4_WIDTH_BITS == 256
             else if (ikernel_str == "memcached")
                 func = memcached_top;
+#endif
             else
                 throw std::exception();
 
@@ -184,8 +190,13 @@ namespace emulation {
     static size_t num_ikernels = 0;
     static gateway_wrapper n2h_flow_table_gateway(cfg.n2h.common.flow_table_gateway),
                            h2n_flow_table_gateway(cfg.h2n.common.flow_table_gateway),
-                           n2h_custom_ring_gateway(cfg.n2h.custom_ring_gateway);
+                           n2h_custom_ring_gateway(cfg.n2h.custom_ring_gateway),
+                           n2h_crossbar_gateway(cfg.n2h.common.crossbar_gateway),
+                           h2n_crossbar_gateway(cfg.h2n.common.crossbar_gateway);
     static tc_ports h2n_tc, n2h_tc;
+    static hls_ik::memory_t n2h_ft_mem, h2n_ft_mem;
+    /* Host memory backing the DRAM flow tables */
+    static ntl::tests::memory_model<DDR_INTERFACE_WIDTH> n2h_ft_dram, h2n_ft_dram;
 
     static std::vector<ikernel_wrapper> init_ikernels()
     {
@@ -212,8 +223,11 @@ namespace emulation {
 #define BOOST_PP_LOCAL_LIMITS (0, NUM_IKERNELS - 1)
 %:include BOOST_PP_LOCAL_ITERATE()
             ,
-            h2n_tc, h2n_tc, n2h_tc, n2h_tc
+            h2n_tc, h2n_tc, n2h_tc, n2h_tc,
+            n2h_ft_mem, h2n_ft_mem
         );
+        n2h_ft_dram.mem(n2h_ft_mem);
+        h2n_ft_dram.mem(h2n_ft_mem);
         for (auto& ik : ikernels)
             ik.step();
     }
@@ -232,6 +246,10 @@ namespace emulation {
             return h2n_flow_table_gateway.reg_access(address - 0x418, value, read);
         } else if (address >= 0x78 && address <= 0x94) {
             return n2h_custom_ring_gateway.reg_access(address - 0x78, value, read);
+        } else if (address >= 0x98 && address <= 0xb4) {
+            return n2h_crossbar_gateway.reg_access(address - 0x98, value, read);
+        } else if (address >= 0x478 && address <= 0x494) {
+            return h2n_crossbar_gateway.reg_access(address - 0x478, value, read);
         }
 
         switch (address) {
@@ -241,6 +259,18 @@ namespace emulation {
         case 0x410:
             var_access(cfg.h2n.common.enable, value, read);
             break;
+        case 0x40:
+            var_access(cfg.n2h.common.checksum_validate, value, read);
+            break;
+        case 0x440:
+            var_access(cfg.h2n.common.checksum_validate, value, read);
+            break;
+        case 0x48:
+            var_access(cfg.n2h.common.udp_checksum, value, read);
+            break;
+        case 0x448:
+            var_access(cfg.h2n.common.udp_checksum, value, read);
+            break;
 	case 0x800:
 	    var_access(stats.flow_table_size, value, read);
             break;
@@ -264,9 +294,9 @@ namespace emulation {
     {
         std::lock_guard<std::mutex> lock(emulation_interface_mutex);
 
-        for (size_t i = 0; i < pkt->len; i += 32) {
+        for (size_t i = 0; i < pkt->len; i += MLX_AXI4_WIDTH_BYTES) {
             hls_ik::axi_data flit;
-            const uint8_t cur_len = std::min(pkt->len - i, 32ul);
+            const uint8_t cur_len = std::min(pkt->len - i, size_t(MLX_AXI4_WIDTH_BYTES));
 
             flit.set_data(pkt->data + i, cur_len);
             flit.last = i + cur_len == pkt->len;
@@ -281,7 +311,7 @@ namespace emulation {
     }
 
     struct packet_buffer {
-        char data[2048]; // TODO
+        char data[MAX_PACKET_WORDS * MLX_AXI4_WIDTH_BYTES];
         packet pkt;
         mlx::stream& out;
 
@@ -300,7 +330,7 @@ namespace emulation {
             while (!out.empty()) {
                 hls_ik::axi_data flit = out.read();
 
-                if (pkt.len < sizeof(data) - 32)
+                if (pkt.len + MLX_AXI4_WIDTH_BYTES <= sizeof(data))
                     pkt.len += flit.get_data(data + pkt.len);
                 if (flit.last) {
                     ret_pkt = new packet(pkt);
@@ -317,72 +347,6 @@ namespace emulation {
     static packet_buffer net_pkt_buffer(Net, sbu2prt_nw),
                          host_pkt_buffer(Host, sbu2prt_cx);
 
-    static uint32_t ntohl(uint32_t const net) {
-        uint8_t data[4] = {};
-        memcpy(&data, &net, sizeof(data));
-
-        return ((uint32_t) data[3] << 0)
-               | ((uint32_t) data[2] << 8)
-               | ((uint32_t) data[1] << 16)
-               | ((uint32_t) data[0] << 24);
-    }
-
-    static uint16_t htons(uint16_t n) {
-        return ((((unsigned short)(n) & 0xFF)) << 8) | (((unsigned short)(n) & 0xFF00) >> 8);
-    }
-
-    static uint16_t ip_checksum(void* vdata,size_t length) {
-        // Cast the data pointer to one that can be indexed.
-        char* data=(char*)vdata;
-
-        // Initialise the accumulator.
-        uint64_t acc=0xffff;
-
-        // Handle any partial block at the start of the data.
-        unsigned int offset=((uintptr_t)data)&3;
-        if (offset) {
-            size_t count=4-offset;
-            if (count>length) count=length;
-            uint32_t word=0;
-            memcpy(offset+(char*)&word,data,count);
-            acc+=ntohl(word);
-            data+=count;
-            length-=count;
-        }
-
-        // Handle any complete 32-bit blocks.
-        char* data_end=data+(length&~3);
-        while (data!=data_end) {
-            uint32_t word;
-            memcpy(&word,data,4);
-            acc+=ntohl(word);
-            data+=4;
-        }
-        length&=3;
-
-        // Handle any partial block at the end of the data.
-        if (length) {
-            uint32_t word=0;
-            memcpy(&word,data,length);
-            acc+=ntohl(word);
-        }
-
-        // Handle deferred carries.
-        acc=(acc&0xffffffff)+(acc>>32);
-        while (acc>>16) {
-            acc=(acc&0xffff)+(acc>>16);
-        }
-
-        // If the data began at an odd byte address
-        // then reverse the byte order to compensate.
-        if (offset&1) {
-            acc=((acc&0xff00)>>8)|((acc&0x00ff)<<8);
-        }
-
-        // Return the checksum in network byte order.
-        return htons(~acc);
-    }
-
     packet* get_packet()
     {
         packet* ret = net_pkt_buffer.get_packet();
@@ -390,14 +354,6 @@ namespace emulation {
             ret = host_pkt_buffer.get_packet();
         }
 
-        if (!ret) return ret;
-
-        if (ret->len < 26) return ret;
-        if ((*(uint16_t*)(ret->data+12)) != 8) return ret;
-
-        std::memset(ret->data + 24, 0, 2);
-        uint16_t csum = ip_checksum(ret->data + 14, 20);
-        std::memcpy(ret->data + 24, (void*)&csum, sizeof(uint16_t));
         return ret;
     }
 
@@ -25,6 +25,7 @@
 
 #include "cms-impl.hpp"
 #include "hls_helper.h"
+#include <mlx.h>
 #include <iostream>
 
 #include <ntl/produce.hpp>
@@ -98,7 +99,7 @@ void cms::net_ingress(hls_ik::pipeline_ports& p) {
 	    if (!p.data_input.empty() && !_values_stream.full()) {
 
 		axi_data d = p.data_input.read();
-		value v = d.data(255-14*8, 256 - value::width-14*8);
+		value v = d.data(MLX_AXI4_WIDTH_BITS - 1 - 14 * 8, MLX_AXI4_WIDTH_BITS - value::width - 14 * 8);
 		_values_stream.write(v);
 
 		_state = d.last ? METADATA : OTHER_WORDS;
@@ -28,6 +28,9 @@
 
 using namespace hls_ik;
 
+/* The token parser assumes 32-byte words. */
+static_assert(MLX_AXI4_WIDTH_BITS == 256, "coap supports only a 256-bit data path");
+
 // jwt implementation is based on libjwt
 // HMAC SHA256 implementation is based on avr-crypto-lib
 
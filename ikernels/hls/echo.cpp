@@ -25,6 +25,7 @@
 
 #include "echo-impl.hpp"
 #include "hls_helper.h"
+#include <mlx.h>
 #include <tuple>
 
 #include <ntl/produce.hpp>
@@ -65,11 +66,11 @@ void echo::echo_pipeline(hls_ik::ports& p, hls_ik::tc_ikernel_data_counts& tc) {
                 first = false;
 
                 if (respond_to_sockperf) {
-                    short flags = d.data(255 - 8 * 8, 256 - 10 * 8);
+                    short flags = d.data(MLX_AXI4_WIDTH_BITS - 1 - 8 * 8, MLX_AXI4_WIDTH_BITS - 10 * 8);
                     bool pong_request = flags & 2;
                     // Turn off client bit on the response packet
                     flags &= ~1;
-                    d.data(255 - 8 * 8, 256 - 10 * 8) = flags;
+                    d.data(MLX_AXI4_WIDTH_BITS - 1 - 8 * 8, MLX_AXI4_WIDTH_BITS - 10 * 8) = flags;
 
                     respond = pong_request;
                 } else {
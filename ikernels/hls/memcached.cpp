@@ -2,6 +2,9 @@
 
 using namespace hls_ik;
 
+/* The request parser and response generator assume 32-byte words. */
+static_assert(MLX_AXI4_WIDTH_BITS == 256, "memcached supports only a 256-bit data path");
+
 int memcached_cache_contexts::rpc(int address, int *v, ikernel_id_t ikernel_id, bool read)
 {
 #pragma HLS inline
@@ -28,6 +28,7 @@
 #include "pktgen.hpp"
 
 #include <ikernel.hpp>
+#include <mlx.h>
 #include <gateway.hpp>
 #include <ntl/context_manager.hpp>
 #include <ntl/scheduler.hpp>
@@ -84,7 +85,7 @@ private:
     /** Quota for the data plane to use before context switch */
     uint32_t quota;
     /** Size of the data array (in elements) */
-    static const int data_size = 2048 / 32;
+    static const int data_size = 2048 / MLX_AXI4_WIDTH_BYTES;
     /** An array that holds the packet payload to duplicate */
     hls_ik::axi_data data[1 << LOG_NUM_IKERNELS][data_size];
     /** Context manager class to access per ikernel context */
@@ -89,7 +89,7 @@ void pktgen::check_quantum_complete(hls_ik::pipeline_ports& p,
 {
 #pragma HLS inline
     if (context.data_length <= quota && context.cur_packet &&
-        can_transmit(tc, context.metadata.ikernel_id, 0, context.data_length << 5, NET)) {
+        can_transmit(tc, context.metadata.ikernel_id, 0, context.data_length << MLX_AXI4_OFFSET_BITS, NET)) {
         data_offset = 0;
         state = DUPLICATE;
     } else {
@@ -52,6 +52,7 @@ namespace {
         nica_config c;
         nica_stats s;
         tc_ports h2n_tc, n2h_tc;
+        hls_ik::memory_t n2h_ft_mem, h2n_ft_mem;
 
         hls::stream<coap_sha_request> first_pass_sha_unit_input_stream;
         hls::stream<coap_sha_response> first_pass_sha_unit_output_stream;
@@ -62,7 +63,8 @@ namespace {
 
         void top() {
             ::nica(nwp2sbu, sbu2nwp, cxp2sbu, sbu2cxp,
-                   &c, &s, events, p, h2n_tc, h2n_tc, n2h_tc, n2h_tc);
+                   &c, &s, events, p, h2n_tc, h2n_tc, n2h_tc, n2h_tc,
+                   n2h_ft_mem, h2n_ft_mem);
 
             GetParam()(p, id, gateway, tc, first_pass_sha_unit_input_stream, first_pass_sha_unit_output_stream,
                        second_pass_sha_unit_input_stream, second_pass_sha_unit_output_stream);
@@ -36,6 +36,7 @@ namespace {
         nica_config c;
         nica_stats s;
         tc_ports h2n_tc, n2h_tc;
+        hls_ik::memory_t n2h_ft_mem, h2n_ft_mem;
 
         echo_test() : ikernel_test(15), udp_tb::testbench(), c(), s()
         {}
@@ -45,7 +46,8 @@ namespace {
             ::nica(nwp2sbu, sbu2nwp, cxp2sbu, sbu2cxp,
                    &c, &s, events,
                    BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, ports),
-                   h2n_tc, h2n_tc, n2h_tc, n2h_tc);
+                   h2n_tc, h2n_tc, n2h_tc, n2h_tc,
+                   n2h_ft_mem, h2n_ft_mem);
             echo_top(p, id, gateway, tc);
         }
 
@@ -26,6 +26,7 @@
 #include "threshold.hpp"
 #include "threshold-impl.hpp"
 #include "hls_helper.h"
+#include <mlx.h>
 
 #include <algorithm>
 using std::min;
@@ -136,7 +137,8 @@ void threshold::egress()
         egress_state = STREAM;
 
         if (egress_last_decision.ring_id != 0) {
-            d = axi_data((egress_last_decision.v, ap_uint<256 - value::width>()), 0xf0000000, true);
+            d = axi_data((egress_last_decision.v, ap_uint<MLX_AXI4_WIDTH_BITS - value::width>()),
+                         axi_data::keep_bytes(4), true);
             _data_egress_to_filter.write(d);
         }
         break;
@@ -165,8 +167,7 @@ void threshold::parser()
             return;
 
         d = data_dup_to_parser.read();
-        value v = d.data(255-14*8, 256 - value::width-14*8);
-//        std::cout << "value: " << d.data(255-14*8, 256 - value::width-14*8) << "\n";
+        value v = d.data(MLX_AXI4_WIDTH_BITS - 1 - 14 * 8, MLX_AXI4_WIDTH_BITS - value::width - 14 * 8);
         parsed.write(v);
         break;
     }
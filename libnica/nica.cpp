@@ -34,6 +34,7 @@
 #include <sys/socket.h>
 #include "nica.h"
 #include "nicamgr.h"
+#include <algorithm>
 #include <cerrno>
 #include <string>
 #include <mutex>
@@ -176,15 +177,17 @@ int ik_destroy(ikernel* ik)
 	return 0;
 }
 
-static int send_fd(stream_protocol::socket& sock, int fd)
+static int send_fds(stream_protocol::socket& sock, const int *fds, unsigned count)
 {
 	/* From: https://linux.die.net/man/3/cmsg */
 	struct msghdr msg;
 	struct cmsghdr *cmsg;
-	int myfds[1] = { fd }; /* Contains the file descriptors to pass. */
-	char buf[CMSG_SPACE(sizeof myfds)];  /* ancillary data buffer */
+	size_t fds_size = count * sizeof(*fds);
+	char buf[CMSG_SPACE(sizeof(int) * NICA_IK_ATTACH_BATCH_MAX)];  /* ancillary data buffer */
 	int *fdptr;
 
+	assert(count <= NICA_IK_ATTACH_BATCH_MAX);
+
 	memset(&msg, 0, sizeof(msg));
 	/* For SOCK_STREAM, a minimum of one byte message is needed */
 	char msg_buf[1] = {};
@@ -193,14 +196,14 @@ static int send_fd(stream_protocol::socket& sock, int fd)
 	msg.msg_iovlen = 1;
 
 	msg.msg_control = buf;
-	msg.msg_controllen = sizeof buf;
+	msg.msg_controllen = CMSG_SPACE(fds_size);
 	cmsg = CMSG_FIRSTHDR(&msg);
 	cmsg->cmsg_level = SOL_SOCKET;
 	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(myfds));
+	cmsg->cmsg_len = CMSG_LEN(fds_size);
 	/* Initialize the payload: */
 	fdptr = (int *) CMSG_DATA(cmsg);
-	memcpy(fdptr, myfds, sizeof(myfds));
+	memcpy(fdptr, fds, fds_size);
 	/* Sum of the length of all control messages in the buffer: */
 	msg.msg_controllen = cmsg->cmsg_len;
 
@@ -209,6 +212,11 @@ static int send_fd(stream_protocol::socket& sock, int fd)
 	return 0;
 }
 
+static int send_fd(stream_protocol::socket& sock, int fd)
+{
+	return send_fds(sock, &fd, 1);
+}
+
 int ik_attach(int socket, ikernel* ik, uint32_t *h2n_flow_id, uint32_t *n2h_flow_id)
 {
 	nica_req_ik_attach req = { ik->handle };
@@ -238,6 +246,76 @@ int ik_attach(int socket, ikernel* ik, uint32_t *h2n_flow_id, uint32_t *n2h_flow
 	return 0;
 }
 
+int ik_attach_batch(const int *sockets, unsigned count, ikernel* ik,
+		    uint32_t *h2n_flow_ids, uint32_t *n2h_flow_ids)
+{
+	int attached = 0;
+
+	for (unsigned start = 0; start < count; start += NICA_IK_ATTACH_BATCH_MAX) {
+		unsigned chunk = std::min(count - start, unsigned(NICA_IK_ATTACH_BATCH_MAX));
+		nica_req_ik_attach_batch req = { ik->handle, chunk };
+		nica_resp_ik_attach_batch resp;
+
+		int ret = g_state().call(NICA_IK_ATTACH_BATCH, req, resp, [&] (stream_protocol::socket& sock) {
+			using boost::asio::buffer;
+
+			nicamgr_header hdr;
+			read(sock, buffer(&hdr, sizeof(hdr)));
+			assert(NICA_IK_ATTACH_BATCH == hdr.opcode);
+			assert(4 == hdr.length); // empty struct with 4-byte reserved field
+			uint32_t reserved;
+			read(sock, buffer(&reserved, sizeof(reserved)));
+			if (hdr.status)
+				return int(hdr.status);
+			return send_fds(sock, sockets + start, chunk);
+		});
+
+		if (ret < 0)
+			return ret;
+
+		if (h2n_flow_ids)
+			memcpy(h2n_flow_ids + start, resp.h2n_flow_id, chunk * sizeof(uint32_t));
+		if (n2h_flow_ids)
+			memcpy(n2h_flow_ids + start, resp.n2h_flow_id, chunk * sizeof(uint32_t));
+		attached += resp.attached;
+	}
+
+	return attached;
+}
+
+int ik_flow_counters(ikernel* ik, const uint32_t *h2n_flow_ids,
+		     const uint32_t *n2h_flow_ids, unsigned count, int clear,
+		     struct ik_flow_counter *h2n, struct ik_flow_counter *n2h)
+{
+	static_assert(sizeof(ik_flow_counter) == sizeof(nica_flow_counter),
+		      "flow counter layout mismatch");
+
+	if (count && (!h2n_flow_ids || !n2h_flow_ids)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (unsigned start = 0; start < count; start += NICA_IK_FLOW_COUNTERS_MAX) {
+		unsigned chunk = std::min(count - start, unsigned(NICA_IK_FLOW_COUNTERS_MAX));
+		nica_req_ik_flow_counters req = { ik->handle, chunk, uint32_t(!!clear) };
+		nica_resp_ik_flow_counters resp;
+
+		memcpy(req.h2n_flow_id, h2n_flow_ids + start, chunk * sizeof(uint32_t));
+		memcpy(req.n2h_flow_id, n2h_flow_ids + start, chunk * sizeof(uint32_t));
+
+		int ret = g_state().call(NICA_IK_FLOW_COUNTERS, req, resp);
+		if (ret < 0)
+			return ret;
+
+		if (h2n)
+			memcpy(h2n + start, resp.h2n, chunk * sizeof(*h2n));
+		if (n2h)
+			memcpy(n2h + start, resp.n2h, chunk * sizeof(*n2h));
+	}
+
+	return 0;
+}
+
 int ik_detach(int socket, ikernel* ik)
 {
 	nica_req_ik_attach req = { ik->handle };
@@ -248,6 +326,16 @@ int ik_detach(int socket, ikernel* ik)
 	});
 }
 
+int nica_flow_table_clear(const char* netdev)
+{
+	nica_req_flow_table_clear req;
+	nica_resp_flow_table_clear resp;
+
+	strncpy(req.netdev, netdev, sizeof(req.netdev));
+
+	return g_state().call(NICA_FLOW_TABLE_CLEAR, req, resp);
+}
+
 static int ik_rpc(ikernel* ik, int address, int *value, bool write)
 {
 	nica_req_ik_rpc req = {
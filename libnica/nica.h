@@ -68,8 +68,33 @@ int ik_destroy(ikernel* ik);
  * h2n_flow_id and n2h_flow_id contain the flow ID for the host-to-net flow table
  * and net-to-host flow table respectively. */
 int ik_attach(int socket, ikernel* ik, uint32_t *h2n_flow_id, uint32_t *n2h_flow_id);
+/* Attach count sockets to the ikernel, installing their flows in batches.
+ * Returns the number of sockets attached, or -1 for error. The per-socket
+ * flow IDs are returned in h2n_flow_ids and n2h_flow_ids (if not NULL), with
+ * zero flow IDs for sockets that could not be attached. */
+int ik_attach_batch(const int *sockets, unsigned count, ikernel* ik,
+		    uint32_t *h2n_flow_ids, uint32_t *n2h_flow_ids);
 int ik_detach(int socket, ikernel* ik);
 
+struct ik_flow_counter {
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+/* Read the packet and byte counters of count flows, given by the flow IDs
+ * returned from ik_attach. Both flow ID arrays are required; the h2n and n2h
+ * outputs may be NULL. Flows in the DRAM flow table, and flows that do not
+ * belong to the ikernel, read as zero. If clear is set the counters are reset
+ * after reading. Returns 0 for success, -1 for error with errno set. */
+int ik_flow_counters(ikernel* ik, const uint32_t *h2n_flow_ids,
+		     const uint32_t *n2h_flow_ids, unsigned count, int clear,
+		     struct ik_flow_counter *h2n, struct ik_flow_counter *n2h);
+
+/* Remove all flows attached to ikernels on the given netdev, of all
+ * clients. The hardware clears its flow tables in a single command. Returns
+ * 0 for success. */
+int nica_flow_table_clear(const char* netdev);
+
 /* Accessor functions for the ikernel register space */
 int ik_write(ikernel* ik, int address, int value);
 int ik_read(ikernel* ik, int address, int* value);
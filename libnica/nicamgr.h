@@ -48,6 +48,9 @@ enum nicamgr_opcode {
 	NICA_CR_DESTROY,
 	NICA_CR_UPDATE_CREDITS,
 	NICA_IK_CREATE_ATTRS,
+	NICA_IK_ATTACH_BATCH,
+	NICA_IK_FLOW_COUNTERS,
+	NICA_FLOW_TABLE_CLEAR,
 };
 
 enum {
@@ -94,6 +97,53 @@ struct nica_resp_ik_attach {
 	uint32_t n2h_flow_id;
 };
 
+/* Maximal number of sockets in a single NICA_IK_ATTACH_BATCH request */
+#define NICA_IK_ATTACH_BATCH_MAX 64
+
+struct nica_req_ik_attach_batch {
+	uint32_t ik;
+	uint32_t count;
+	/* Send the socket file descriptors over SCM_RIGHTS */
+};
+
+struct nica_resp_ik_attach_batch {
+	/* Number of sockets successfully attached */
+	uint32_t attached;
+	/* Per-socket flow IDs, zero for sockets that failed */
+	uint32_t h2n_flow_id[NICA_IK_ATTACH_BATCH_MAX];
+	uint32_t n2h_flow_id[NICA_IK_ATTACH_BATCH_MAX];
+};
+
+/* Maximal number of flows in a single NICA_IK_FLOW_COUNTERS request */
+#define NICA_IK_FLOW_COUNTERS_MAX 64
+
+struct nica_req_ik_flow_counters {
+	uint32_t ik;
+	uint32_t count;
+	/* Reset the counters after reading them */
+	uint32_t clear;
+	uint32_t h2n_flow_id[NICA_IK_FLOW_COUNTERS_MAX];
+	uint32_t n2h_flow_id[NICA_IK_FLOW_COUNTERS_MAX];
+};
+
+struct nica_flow_counter {
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+struct nica_resp_ik_flow_counters {
+	struct nica_flow_counter h2n[NICA_IK_FLOW_COUNTERS_MAX];
+	struct nica_flow_counter n2h[NICA_IK_FLOW_COUNTERS_MAX];
+};
+
+struct nica_req_flow_table_clear {
+	char netdev[IFNAMSIZ];
+};
+
+struct nica_resp_flow_table_clear {
+	uint32_t reserved;
+};
+
 struct nica_req_ik_detach {
 	uint32_t ik;
 	/* Send the socket file descriptor over SCM_RIGHTS */
@@ -16,6 +16,7 @@ from abc import ABC, abstractmethod
 from time import clock
 
 TIMEOUT=5 # seconds
+CYCLE_NS = 5.185 # NICA clock period
 
 class Gateway(object):
     '''Wrap a hardware RPC gateway.'''
@@ -32,12 +33,17 @@ class Gateway(object):
     cmd_write = 1 << 30
     cmd_go = 1 << 31
 
-    def write(self, address, value, ikernel_id=None, delay=None):
-        '''Write a value to the gateway.'''
+    def write(self, address, value, ikernel_id=None, delay=None, posted=False):
+        '''Write a value to the gateway. Posted writes do not wait for the
+        command to complete, and are only suitable for registers that the
+        hardware handles in a single gateway cycle.'''
         if ikernel_id is not None:
             self.nica.axi_write(self.ikernel_id, ikernel_id, delay=delay)
         self.nica.axi_write(self.data_i, value, delay=10)
         self.nica.axi_write(self.cmd, address | self.cmd_write | self.cmd_go, delay=self.cmd_delay)
+        if posted:
+            self.nica.axi_write(self.cmd, 0, delay=self.cmd_delay)
+            return
         start = clock()
         while clock() - start <= TIMEOUT:
             ret = self.nica.axi_read(self.done, delay=self.done_delay)
@@ -51,11 +57,17 @@ class Gateway(object):
             if clock() - start > TIMEOUT:
                 raise TimeoutError()
 
-    def read(self, address, ikernel_id=None, delay=None):
-        '''Read a value from the gateway.'''
+    def read(self, address, ikernel_id=None, delay=None, posted=False):
+        '''Read a value from the gateway. Posted reads do not wait for the
+        command to complete, and may return a stale value, so they are only
+        suitable for registers whose values identify themselves.'''
         if ikernel_id is not None:
             self.nica.axi_write(self.ikernel_id, ikernel_id, delay=delay)
         self.nica.axi_write(self.cmd, address | self.cmd_go, delay=10)
+        if posted:
+            ret = self.nica.axi_read(self.data_o, delay=self.cmd_delay)
+            self.nica.axi_write(self.cmd, 0, delay=self.cmd_delay)
+            return ret
         start = clock()
         while clock() - start <= TIMEOUT:
             ret = self.nica.axi_read(self.done, delay=self.done_delay)
@@ -75,11 +87,20 @@ class Arbiter(Gateway):
     '''Control the NICA packet scheduler.'''
 
     ARBITER_NUM_TC = 0
+    ARBITER_DRR_BYTES = 1
+    ARBITER_WATCHDOG_TIMEOUT = 2
+    ARBITER_WATCHDOG_FAULTED = 3
     ARBITER_SCHEDULER = 0x10
-    ARBITER_SCHEDULER_STRIDE = 0x2
+    ARBITER_SCHEDULER_STRIDE = 0x8
 
     SCHEDULER_DRR_QUANTUM = 0
     SCHEDULER_DRR_DEFICIT = 1
+    ARBITER_SCHED_PRIORITY = 2
+    ARBITER_SCHED_RATE_CAP = 3
+    ARBITER_RATE_CAP_TICK = 2 ** 10
+    ARBITER_SHAPER_RATE = 4
+    ARBITER_SHAPER_BURST = 5
+    ARBITER_SHAPER_TICK = 2 ** 10
 
     def __init__(self, nica, base, done_delay=100, cmd_delay=25):
         super(Arbiter, self).__init__(nica, base, done_delay, cmd_delay)
@@ -90,13 +111,96 @@ class Arbiter(Gateway):
                self.SCHEDULER_DRR_QUANTUM
 
     def set_quantum(self, traffic_class, quantum, delay=None):
-        """Speed will be quantum / (sum of all quanta)"""
+        """Speed will be quantum / (sum of all quanta). The quantum is in
+        flits, or in bytes after set_drr_bytes(True)."""
         self.write(self.quantum_address(traffic_class), quantum, delay=delay)
 
+    def set_drr_bytes(self, enable, delay=None):
+        '''Charge packets their exact length in bytes instead of whole flits'''
+        self.write(self.ARBITER_DRR_BYTES, int(enable), delay=delay)
+
     def get_quantum(self, traffic_class, delay=None):
         '''Return the current quantum'''
         return self.read(self.quantum_address(traffic_class), delay=delay)
 
+    def set_priority(self, traffic_class, priority=True, rate_cap=0, delay=None):
+        '''Move a TC to the strict priority tier, or back to DRR. rate_cap
+        limits a priority TC to the given number of bytes per
+        ARBITER_RATE_CAP_TICK cycles; zero means no cap.'''
+        base = self.ARBITER_SCHEDULER + traffic_class * self.ARBITER_SCHEDULER_STRIDE
+        self.write(base + self.ARBITER_SCHED_RATE_CAP, rate_cap, delay=delay)
+        self.write(base + self.ARBITER_SCHED_PRIORITY, int(priority), delay=10)
+
+    def set_watchdog(self, timeout, delay=None):
+        '''Truncate packets whose ikernel stalls for timeout cycles, and
+        fault their TC. Zero disables the watchdog.'''
+        self.write(self.ARBITER_WATCHDOG_TIMEOUT, timeout, delay=delay)
+
+    def faulted(self, delay=None):
+        '''Return a bitmap of the TCs faulted by the watchdog'''
+        return self.read(self.ARBITER_WATCHDOG_FAULTED, delay=delay)
+
+    def clear_faults(self, bitmap, delay=None):
+        '''Resume scheduling the faulted TCs in bitmap. Reset their ikernels
+        first.'''
+        self.write(self.ARBITER_WATCHDOG_FAULTED, bitmap, delay=delay)
+
+    def set_shaper(self, traffic_class, rate, burst, delay=None):
+        '''Shape a TC to rate bytes per second, with bursts of up to burst
+        bytes. A zero rate disables the shaper.'''
+        per_tick = int(round(rate * CYCLE_NS * 1e-9 * self.ARBITER_SHAPER_TICK))
+        if rate and not 0 < per_tick < 2 ** 32:
+            raise ValueError('Shaper rate out of range: %d' % rate)
+        if rate and not 0 < burst < 2 ** 32:
+            raise ValueError('Shaper burst out of range: %d' % burst)
+        base = self.ARBITER_SCHEDULER + traffic_class * self.ARBITER_SCHEDULER_STRIDE
+        # The hardware rejects a zero burst while the rate is set
+        if rate:
+            self.write(base + self.ARBITER_SHAPER_BURST, burst, delay=delay)
+            self.write(base + self.ARBITER_SHAPER_RATE, per_tick, delay=10)
+        else:
+            self.write(base + self.ARBITER_SHAPER_RATE, 0, delay=delay)
+            self.write(base + self.ARBITER_SHAPER_BURST, burst, delay=10)
+
+class Crossbar(Gateway):
+    '''Control the replica groups of the ikernel crossbar.'''
+
+    XBAR_NUM_GROUPS = 0
+    XBAR_DROP_ON_FULL = 1
+    XBAR_GROUP_BASE = 0x10
+    XBAR_GROUP_STRIDE = 0x2
+
+    XBAR_GROUP_ENGINES = 0
+    XBAR_GROUP_HASH = 1
+
+    XBAR_HASH_5TUPLE = 0
+    XBAR_HASH_PAYLOAD = 1
+
+    def __init__(self, nica, base, done_delay=100, cmd_delay=25):
+        super(Crossbar, self).__init__(nica, base, done_delay, cmd_delay)
+
+    def set_drop_on_full(self, enable, delay=None):
+        '''Drop packets to an ikernel whose queue is full instead of waiting
+        for it, so that a slow ikernel does not hold back the others.'''
+        self.write(self.XBAR_DROP_ON_FULL, int(enable), delay=delay)
+
+    def group_address(self, group):
+        '''Calculate gateway offset of the registers of a given group'''
+        return self.XBAR_GROUP_BASE + group * self.XBAR_GROUP_STRIDE
+
+    def set_replica_group(self, group, first, count, payload_offset=None,
+                          payload_bytes=0, delay=None):
+        '''Spread packets to the group over engines first .. first + count - 1,
+        by a hash of their 5-tuple, or of payload_bytes bytes of their payload
+        starting at payload_offset.'''
+        if payload_offset is None:
+            hash_cmd = self.XBAR_HASH_5TUPLE
+        else:
+            hash_cmd = self.XBAR_HASH_PAYLOAD | payload_offset << 8 | payload_bytes << 16
+        self.write(self.group_address(group) + self.XBAR_GROUP_HASH, hash_cmd, delay=delay)
+        self.write(self.group_address(group) + self.XBAR_GROUP_ENGINES,
+                   first | count << 8, delay=delay)
+
 class MMU(object):
     BASE = 0x9000
 
@@ -125,6 +229,8 @@ class NICA(ABC):
         self.n2h_arbiter = Arbiter(self, 0x58)
         self.h2n_arbiter = Arbiter(self, 0x458)
         self.custom_ring = CustomRing(self, 0x78)
+        self.n2h_crossbar = Crossbar(self, 0x98)
+        self.h2n_crossbar = Crossbar(self, 0x478)
         self.mmu = MMU(self)
         self.axi_cache = {}
 
@@ -176,6 +282,17 @@ class NICA(ABC):
         self.axi_write(0x010, 0, delay=10)
         self.axi_write(0x410, 0, delay=10)
 
+    def enable_udp_checksum(self, enable=True):
+        '''Compute UDP checksums for IPv4 packets generated by ikernels.
+        IPv6 packets always get one.'''
+        self.axi_write(0x048, int(enable), delay=10)
+        self.axi_write(0x448, int(enable), delay=10)
+
+    def enable_checksum_validation(self, enable=True):
+        '''Drop packets steered to ikernels with wrong IP or UDP checksums.'''
+        self.axi_write(0x040, int(enable), delay=10)
+        self.axi_write(0x440, int(enable), delay=10)
+
     def update_credits(self, ring, max_msn, reset=False, delay=None):
         '''Update the given ring's credits.'''
         cmd = ring | max_msn << 7 | reset << 23
@@ -214,6 +331,21 @@ def inet_aton(ip_addr):
     '''Convert an IP address string to an int.'''
     return int.from_bytes(ip_address(ip_addr).packed, byteorder='big', signed=False)
 
+def fold_addr(ip_addr, combine=lambda a, b: a ^ b):
+    '''Fold an IP address string to the 32 bits the flow table matches. IPv6
+    addresses are folded by XOR-ing their words, and masks by OR-ing them.'''
+    addr = inet_aton(ip_addr)
+    folded = 0
+    while True:
+        folded = combine(folded, addr & 0xffffffff)
+        addr >>= 32
+        if not addr:
+            return folded
+
+def is_ipv6(ip_addr):
+    '''Whether an IP address string is an IPv6 address.'''
+    return ip_address(ip_addr).version == 6
+
 class CustomRing(Gateway):
     '''Control the custom ring hardware interface.'''
     CR_DST_MAC_LO = 0
@@ -277,24 +409,88 @@ class FlowTable(Gateway):
     '''Control the flow table hardware interface.'''
     # actions
     FT_PASSTHROUGH = 0
+    FT_DROP = 1
     FT_IKERNEL = 2
+    FT_REPLICA_GROUP = 3
 
     # registers
     FT_FIELDS = 0x0
     FT_ADD_FLOW = 1
     FT_DELETE_FLOW = 2
+    FT_CLEAR = 3
+    FT_SET_RULE = 6
+    FT_BATCH_RESET = 8
+    FT_BATCH_ADD = 9
+    FT_BATCH_DELETE = 0xa
+    FT_BATCH_DATA = 0xb
+    FT_BATCH_RESULT = 0xc
+    FT_BATCH_TAGGED_RESULT = 0xd
     FT_KEY_SADDR = 0x10
     FT_KEY_DADDR = 0x11
     FT_KEY_SPORT = 0x12
     FT_KEY_DPORT = 0x13
+    FT_MASK_SADDR = 0x14
+    FT_MASK_DADDR = 0x15
+    FT_MASK_SPORT = 0x16
+    FT_MASK_DPORT = 0x17
     FT_RESULT_ACTION = 0x18
     FT_RESULT_IKERNEL = 0x19
     FT_RESULT_IKERNEL_ID = 0x1a
+    FT_RULE_PRIORITY = 0x1b
+    FT_KEY_VM_ID = 0x1c
+    FT_MASK_VM_ID = 0x1d
+    FT_KEY_VLAN_ID = 0x1e
+    FT_MASK_VLAN_ID = 0x1f
+    FT_VALID = 0x20
+    FT_KEY_IPV6 = 0x21
+    FT_MASK_IPV6 = 0x22
+    FT_KEY_SADDR_HIGH = 0x23
+    FT_KEY_DADDR_HIGH = 0x26
+    FT_L2_LOG_SIZE = 0x30
+    FT_L2_BASE = 0x31
+    FT_COUNTER_INDEX = 0x40
+    FT_COUNTER_DATA = 0x41
+    FT_COUNTER_CLEAR_ON_READ = 0x42
+    FT_COUNTER_CLEAR_ALL = 0x43
+    FT_AGING_TIMEOUT = 0x50
+    FT_AGING_TICK = 0x51
+    FT_EVICTED = 0x52
+    FT_SHADOW = 0x60
+    FT_COMMIT = 0x61
+    FT_VM_INDEX = 0x70
+    FT_VM_ADDR = 0x71
+    FT_VM_MATCH_SOURCE = 0x72
+    FT_VM_QUOTA = 0x73
+    FT_VM_USED = 0x74
+    FT_VM_DEFAULT = 0x75
+    FT_POLICER_RATE = 0x80
+    FT_POLICER_BURST = 0x81
+    FT_POLICER_EXCEED_ACTION = 0x82
+    FT_SET_POLICER = 0x83
+
+    FLOW_TABLE_SIZE = 1024
+    FT_STASH_SIZE = 4
+    FT_RULE_FLOW_ID_BASE = FLOW_TABLE_SIZE + FT_STASH_SIZE + 1
+    FLOW_TABLE_RULES = 16
+    FT_COUNTERS = FT_RULE_FLOW_ID_BASE + FLOW_TABLE_RULES
+    FT_VMS = 64
+    FT_VM_COUNTER_BASE = FT_COUNTERS
+    FT_BATCH_SIZE = 1024
+    FT_BATCH_ENTRY_WORDS = 4
+    FLOW_ID_WIDTH = 19
+    FT_AGING_MAX_TIMEOUT = 2 ** 15 - 1
+    FT_AGING_DEFAULT_TICK = 2 ** 20
+    FT_POLICER_TICK = 2 ** 10
+    FT_POLICER_MIN_BURST = 1500
 
     def set_flow_table_mask(self, daddr=False, dport=False, saddr=False,
-                            sport=False, delay=None):
+                            sport=False, vm=False, vlan=False, delay=None):
         '''Set the header fields that are included as part of the flow match.'''
         mask = 0
+        if vlan:
+            mask |= 32
+        if vm:
+            mask |= 16
         if saddr:
             mask |= 1
         if daddr:
@@ -306,17 +502,106 @@ class FlowTable(Gateway):
         if mask:
             self.write(self.FT_FIELDS, mask, delay=delay)
 
-    def enter_flow_in_gateway(self, saddr, sport, daddr, dport, delay=None):
+    def set_dram_table(self, log_size, base=0):
+        '''Enable a second-level flow table of 2**log_size DRAM lines
+        starting at the given line. A log_size of zero disables it.'''
+        self.write(self.FT_L2_BASE, base)
+        self.write(self.FT_L2_LOG_SIZE, log_size)
+
+    def set_idle_timeout(self, seconds, delay=None):
+        '''Evict flows that receive no packets for the given number of
+        seconds. Zero disables aging.'''
+        cycles = seconds * 1e9 / CYCLE_NS
+        tick = max(self.FT_AGING_DEFAULT_TICK, int(cycles / self.FT_AGING_MAX_TIMEOUT) + 1)
+        self.write(self.FT_AGING_TICK, tick, delay=delay)
+        timeout = max(1, int(round(cycles / tick))) if seconds else 0
+        self.write(self.FT_AGING_TIMEOUT, timeout, delay=10)
+
+    def read_evicted(self, delay=None):
+        '''Return the flow IDs evicted by the idle timeout since the last
+        call.'''
+        evicted = []
+        while True:
+            flow_id = self.read(self.FT_EVICTED, delay=delay)
+            if not flow_id:
+                return evicted
+            evicted.append(flow_id)
+            delay = 10
+
+    def clear(self, delay=None):
+        '''Remove all flows and wildcard rules from the table.'''
+        self.read(self.FT_CLEAR, delay=delay)
+
+    def set_vm(self, vm, addr, quota=None, match_source=False, delay=None):
+        '''Assign packets to or from (with match_source) the given IP address
+        to a VM, limiting it to quota on-chip flows.'''
+        self.write(self.FT_VM_MATCH_SOURCE, int(match_source), delay=delay)
+        self.write(self.FT_VM_INDEX, vm, delay=10)
+        self.write(self.FT_VM_ADDR, inet_aton(addr), delay=10)
+        if quota is not None:
+            self.write(self.FT_VM_QUOTA, quota, delay=10)
+
+    def set_vm_default(self, vm, action=FT_PASSTHROUGH, ikernel=0, ikernel_id=0, delay=None):
+        '''Set the result of packets of a VM that match no flow or rule.'''
+        self.write(self.FT_RESULT_ACTION, action, delay=delay)
+        self.write(self.FT_RESULT_IKERNEL, ikernel, delay=10)
+        self.write(self.FT_RESULT_IKERNEL_ID, ikernel_id, delay=10)
+        self.write(self.FT_VM_INDEX, vm, delay=10)
+        self.write(self.FT_VM_DEFAULT, 0, delay=10)
+
+    def vm_used(self, vm, delay=None):
+        '''Return the number of on-chip flows the VM holds.'''
+        self.write(self.FT_VM_INDEX, vm, delay=delay)
+        return self.read(self.FT_VM_USED, delay=10)
+
+    def read_vm_counters(self, vms, clear=False, delay=None):
+        '''Read the packet and byte counters of the given VMs.'''
+        self.write(self.FT_COUNTER_CLEAR_ON_READ, int(clear), delay=delay)
+        counters = []
+        for vm in vms:
+            self.write(self.FT_COUNTER_INDEX, self.FT_VM_COUNTER_BASE + vm, delay=10)
+            packets = self.read(self.FT_COUNTER_DATA, delay=10)
+            low = self.read(self.FT_COUNTER_DATA, delay=10)
+            high = self.read(self.FT_COUNTER_DATA, delay=10)
+            counters.append((packets, high << 32 | low))
+        return counters
+
+    def stage(self, delay=None):
+        '''Send the following flow and rule updates to the shadow table,
+        without affecting traffic until commit().'''
+        self.write(self.FT_SHADOW, 1, delay=delay)
+
+    def commit(self, delay=None):
+        '''Atomically switch traffic to the staged flows and rules.'''
+        self.read(self.FT_COMMIT, delay=delay)
+
+    def abort(self, delay=None):
+        '''Drop the updates staged since the last commit and stop staging.'''
+        self.write(self.FT_SHADOW, 0, delay=delay)
+
+    def enter_flow_in_gateway(self, saddr, sport, daddr, dport, vm=0, vlan=0,
+                              delay=None):
         '''Enter a flow in the flow table gateway to be added or deleted.'''
         self.write(self.FT_KEY_SPORT, sport, delay=delay)
         self.write(self.FT_KEY_DPORT, dport, delay=10)
-        self.write(self.FT_KEY_SADDR, inet_aton(saddr), delay=10)
-        self.write(self.FT_KEY_DADDR, inet_aton(daddr), delay=10)
+        self.write(self.FT_KEY_SADDR, fold_addr(saddr), delay=10)
+        self.write(self.FT_KEY_DADDR, fold_addr(daddr), delay=10)
+        self.write(self.FT_KEY_VM_ID, vm, delay=10)
+        self.write(self.FT_KEY_VLAN_ID, vlan, delay=10)
+        self.write(self.FT_KEY_IPV6, int(is_ipv6(saddr)), delay=10)
+        if is_ipv6(saddr):
+            # The flow table checks the address bits the fold loses
+            for base, addr in ((self.FT_KEY_SADDR_HIGH, saddr),
+                               (self.FT_KEY_DADDR_HIGH, daddr)):
+                high = inet_aton(addr) >> 32
+                for word in range(3):
+                    self.write(base + word, (high >> (32 * (2 - word))) & 0xffffffff,
+                               delay=10)
 
     def set_flow(self, saddr, sport, daddr, dport, action=FT_PASSTHROUGH,
-                 ikernel=0, ikernel_id=0, delay=None):
+                 ikernel=0, ikernel_id=0, vm=0, vlan=0, delay=None):
         '''Add a flow with the associated action to the table.'''
-        self.enter_flow_in_gateway(saddr, sport, daddr, dport, delay=delay)
+        self.enter_flow_in_gateway(saddr, sport, daddr, dport, vm, vlan, delay=delay)
 
         self.write(self.FT_RESULT_ACTION, action, delay=10)
         self.write(self.FT_RESULT_IKERNEL, ikernel, delay=10)
@@ -324,12 +609,148 @@ class FlowTable(Gateway):
 
         return self.read(self.FT_ADD_FLOW, delay=10)
 
-    def del_flow(self, saddr, sport, daddr, dport, delay=None):
+    def del_flow(self, saddr, sport, daddr, dport, vm=0, vlan=0, delay=None):
         '''Remove the provided flow from the table.'''
-        self.enter_flow_in_gateway(saddr, sport, daddr, dport, delay=delay)
+        self.enter_flow_in_gateway(saddr, sport, daddr, dport, vm, vlan, delay=delay)
 
         return self.read(self.FT_DELETE_FLOW, delay=10)
 
+    def batch(self, command, flows, delay=None):
+        '''Apply a batched command to a list of (saddr, sport, daddr, dport,
+        action, ikernel, ikernel_id) tuples of IPv4 flows. Returns a list of
+        per-entry results.'''
+        results = []
+        for start in range(0, len(flows), self.FT_BATCH_SIZE):
+            chunk = flows[start:start + self.FT_BATCH_SIZE]
+            # Posted writes may be lost, so check the number of words the
+            # flow table received, and fall back to waiting for each word
+            words = self.batch_data(chunk, posted=True, delay=delay)
+            if words is not None and words != len(chunk) * self.FT_BATCH_ENTRY_WORDS:
+                self.batch_data(chunk, posted=False, delay=delay)
+            self.read(command, delay=10)
+            results += self.batch_results(len(chunk))
+        return results
+
+    def batch_data(self, chunk, posted, delay=None):
+        '''Write the entries of a batch, returning the number of words the
+        flow table received.'''
+        self.write(self.FT_BATCH_RESET, 0, delay=delay)
+        self.write(self.FT_KEY_IPV6, 0, delay=10)
+        for saddr, sport, daddr, dport, action, ikernel, ikernel_id in chunk:
+            self.write(self.FT_BATCH_DATA, inet_aton(saddr), delay=10, posted=posted)
+            self.write(self.FT_BATCH_DATA, inet_aton(daddr), delay=10, posted=posted)
+            self.write(self.FT_BATCH_DATA, sport << 16 | dport, delay=10, posted=posted)
+            self.write(self.FT_BATCH_DATA, action | ikernel << 8 | ikernel_id << 16,
+                       delay=10, posted=posted)
+        return self.read(self.FT_BATCH_DATA, delay=10)
+
+    def batch_results(self, count):
+        '''Read the results of a batch of count entries with posted reads,
+        and read the ones that were missed again, waiting for each.'''
+        tagged = [self.read(self.FT_BATCH_TAGGED_RESULT, delay=10, posted=True)
+                  for _ in range(count)]
+        if None in tagged:
+            # Simulation input generation, where reads return nothing
+            return tagged
+        results = {}
+        for value in tagged:
+            index = (value >> self.FLOW_ID_WIDTH) - 1
+            if 0 <= index < count:
+                results[index] = value & ((1 << self.FLOW_ID_WIDTH) - 1)
+        for index in range(count):
+            if index not in results:
+                self.write(self.FT_BATCH_RESULT, index, delay=10)
+                results[index] = self.read(self.FT_BATCH_RESULT, delay=10)
+        return [results[index] for index in range(count)]
+
+    def set_flows(self, flows, delay=None):
+        '''Add a list of (saddr, sport, daddr, dport, action, ikernel,
+        ikernel_id) flows to the table. Returns the list of flow IDs, with zero
+        for flows that could not be added.'''
+        return self.batch(self.FT_BATCH_ADD, flows, delay=delay)
+
+    def del_flows(self, flows, delay=None):
+        '''Remove a list of (saddr, sport, daddr, dport) flows from the table.
+        Returns a list of per-flow results, zero for failures.'''
+        flows = [flow + (self.FT_PASSTHROUGH, 0, 0) for flow in flows]
+        return self.batch(self.FT_BATCH_DELETE, flows, delay=delay)
+
+    def set_rule(self, index, saddr='0.0.0.0', sport=0, daddr='0.0.0.0', dport=0,
+                 saddr_mask='0.0.0.0', sport_mask=0, daddr_mask='0.0.0.0',
+                 dport_mask=0, vlan=0, vlan_mask=0, priority=0,
+                 action=FT_PASSTHROUGH, ikernel=0, ikernel_id=0, valid=True,
+                 delay=None):
+        '''Set a wildcard rule, matching packets whose fields equal the given
+        ones on the bits set in the masks. Returns the flow ID packets
+        matching the rule receive.'''
+        self.enter_flow_in_gateway(saddr, sport, daddr, dport, vlan=vlan, delay=delay)
+        self.write(self.FT_MASK_SPORT, sport_mask, delay=10)
+        self.write(self.FT_MASK_DPORT, dport_mask, delay=10)
+        saddr_mask = fold_addr(saddr_mask, lambda a, b: a | b)
+        daddr_mask = fold_addr(daddr_mask, lambda a, b: a | b)
+        self.write(self.FT_MASK_SADDR, saddr_mask, delay=10)
+        self.write(self.FT_MASK_DADDR, daddr_mask, delay=10)
+        self.write(self.FT_MASK_VLAN_ID, vlan_mask, delay=10)
+        # Rules on addresses match their family too
+        self.write(self.FT_MASK_IPV6, int(bool(saddr_mask or daddr_mask)), delay=10)
+        self.write(self.FT_RULE_PRIORITY, priority, delay=10)
+
+        self.write(self.FT_RESULT_ACTION, action, delay=10)
+        self.write(self.FT_RESULT_IKERNEL, ikernel, delay=10)
+        self.write(self.FT_RESULT_IKERNEL_ID, ikernel_id, delay=10)
+        self.write(self.FT_VALID, int(valid), delay=10)
+        self.write(self.FT_SET_RULE, index, delay=10)
+
+        return self.FT_RULE_FLOW_ID_BASE + index
+
+    def del_rule(self, index, delay=None):
+        '''Invalidate a wildcard rule.'''
+        self.write(self.FT_VALID, 0, delay=delay)
+        self.write(self.FT_SET_RULE, index, delay=10)
+
+    def read_counters(self, flow_ids, clear=False, delay=None):
+        '''Read the packet and byte counters of the given flow IDs. Returns a
+        list of (packets, bytes) tuples. With clear set, the counters are reset
+        as they are read. Flows without a counter read as zero.'''
+        self.write(self.FT_COUNTER_CLEAR_ON_READ, int(clear), delay=delay)
+        counters = []
+        next_id = None
+        for flow_id in flow_ids:
+            if not 0 < flow_id < self.FT_COUNTERS:
+                # Flows in the DRAM table are not counted
+                counters.append((0, 0))
+                continue
+            # The index advances automatically, so sequential IDs only need
+            # to be selected once.
+            if flow_id != next_id:
+                self.write(self.FT_COUNTER_INDEX, flow_id, delay=10)
+            packets = self.read(self.FT_COUNTER_DATA, delay=10)
+            low = self.read(self.FT_COUNTER_DATA, delay=10)
+            high = self.read(self.FT_COUNTER_DATA, delay=10)
+            counters.append((packets, high << 32 | low))
+            next_id = flow_id + 1
+        return counters
+
+    def clear_counters(self, delay=None):
+        '''Reset all flow counters.'''
+        self.read(self.FT_COUNTER_CLEAR_ALL, delay=delay)
+
+    def set_policer(self, flow_id, rate, burst, exceed_action=FT_DROP, delay=None):
+        '''Police a flow to rate bytes per second with bursts of up to burst
+        bytes. Packets beyond that get exceed_action (FT_DROP or
+        FT_PASSTHROUGH). A zero rate disables the policer. The burst must
+        fit at least one FT_POLICER_MIN_BURST byte packet.'''
+        per_tick = int(round(rate * CYCLE_NS * 1e-9 * self.FT_POLICER_TICK))
+        if rate and not 0 < per_tick < 2 ** 16:
+            raise ValueError('Policer rate out of range: %d' % rate)
+        if rate and burst < self.FT_POLICER_MIN_BURST:
+            raise ValueError('Policer burst below %d bytes: %d' %
+                             (self.FT_POLICER_MIN_BURST, burst))
+        self.write(self.FT_POLICER_RATE, per_tick, delay=delay)
+        self.write(self.FT_POLICER_BURST, burst, delay=10)
+        self.write(self.FT_POLICER_EXCEED_ACTION, exceed_action, delay=10)
+        self.write(self.FT_SET_POLICER, flow_id, delay=10)
+
 def swap32(i):
     '''Swap big-endian to little-endian or vice versa.'''
     return struct.unpack("<I", struct.pack(">I", i))[0]
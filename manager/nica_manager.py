@@ -26,6 +26,10 @@ from util import mac_to_str, str_to_mac, inet_ntoa
 
 from nica import NicaHardware, FlowTable, inet_aton, default_mst_device
 
+# Maximal number of sockets in a single NICA_IK_ATTACH_BATCH request
+NICA_IK_ATTACH_BATCH_MAX = 64
+NICA_IK_FLOW_COUNTERS_MAX = 64
+
 FPGA_MAC = '00:00:00:00:00:01'
 FPGA_IP = '10.0.0.1'
 
@@ -156,6 +160,11 @@ class Netdev(ABC):
         flow = self.bind_local(flow)
         return self.get_ikernel(ikernel_id).attach(flow)
 
+    def ik_attach_batch(self, ikernel_id, flows):
+        '''Associate a list of flows with a given ikernel.'''
+        flows = [self.bind_local(flow) for flow in flows]
+        return self.get_ikernel(ikernel_id).attach_batch(flows)
+
     def ik_detach(self, ikernel_id, flow):
         '''Detach a socket's flow from a given ikernel.'''
         flow = self.bind_local(flow)
@@ -166,11 +175,53 @@ class Netdev(ABC):
         '''Register a flow attachment'''
         pass
 
+    def set_idle_timeout(self, seconds):
+        '''Have the flow tables evict flows idle for the given number of
+        seconds.'''
+        pass
+
+    def expire_flows(self):
+        '''Forget flows the flow tables evicted due to the idle timeout.'''
+        pass
+
+    def clear_flows(self):
+        '''Remove all flows from the flow tables, detaching them from their
+        ikernels.'''
+        raise exception(errno.ENOSYS)
+
+    def attach_batch(self, flows, ikernel):
+        '''Register several flow attachments. Returns a list of (h2n_flow_id,
+        n2h_flow_id) tuples, with zeros for flows that failed.'''
+        flow_ids = []
+        for flow in flows:
+            try:
+                flow_ids.append(tuple(self.attach(flow, ikernel)))
+            except OSError as exc:
+                logging.warning('Attaching flow {} failed: {}'.format(flow, exc))
+                flow_ids.append((0, 0))
+        return flow_ids
+
     @abstractmethod
     def detach(self, flow, ikernel):
         '''Delete a flow attachment'''
         pass
 
+    def ik_flow_counters(self, ikernel_id, h2n_flow_ids, n2h_flow_ids, clear):
+        '''Read the packet and byte counters of an ikernel's flows. Flow IDs
+        that do not belong to the ikernel read as zero.'''
+        ikernel = self.get_ikernel(ikernel_id)
+        owned = [(h2n, n2h) for ik, h2n, n2h in self.flows.values() if ik is ikernel]
+        owned_h2n = set(h2n for h2n, _ in owned)
+        owned_n2h = set(n2h for _, n2h in owned)
+        h2n_flow_ids = [flow_id if flow_id in owned_h2n else 0 for flow_id in h2n_flow_ids]
+        n2h_flow_ids = [flow_id if flow_id in owned_n2h else 0 for flow_id in n2h_flow_ids]
+        return self.flow_counters(h2n_flow_ids, n2h_flow_ids, clear)
+
+    def flow_counters(self, h2n_flow_ids, n2h_flow_ids, clear):
+        '''Read flow counters from the hardware. Returns lists of (packets,
+        bytes) tuples for the h2n and n2h flow tables.'''
+        raise exception(errno.ENOSYS)
+
     def ik_rpc(self, ikernel_id, address, value, write):
         '''Invoke register read or register write RPC call to the underlying ikernel hardware.'''
         ikernel = self.get_ikernel(ikernel_id)
@@ -210,6 +261,9 @@ class NetdevHardware(Netdev):
             daddr=True, dport=True, saddr=False, sport=False)
         self.nica.h2n_flow_table.set_flow_table_mask(
             saddr=True, sport=True, daddr=False, dport=False)
+        # Drop flows left over from a previous run
+        self.nica.n2h_flow_table.clear()
+        self.nica.h2n_flow_table.clear()
 
         self.custom_ring_mac = None
         self.custom_ring_ip = None
@@ -286,8 +340,42 @@ class NetdevHardware(Netdev):
         super(NetdevHardware, self).deallocate_ikernel(ikernel_id)
         self.deallocate_dram(ikernel.base, ikernel.log_dram_size)
 
+    def set_idle_timeout(self, seconds):
+        self.nica.h2n_flow_table.set_idle_timeout(seconds)
+        self.nica.n2h_flow_table.set_idle_timeout(seconds)
+
+    def clear_flows(self):
+        logging.info('Removing all flows')
+        self.nica.h2n_flow_table.clear()
+        self.nica.n2h_flow_table.clear()
+        for ikernel, _, _ in self.flows.values():
+            ikernel.flows.clear()
+        self.flows.clear()
+
+    def expire_flows(self):
+        # Evicted flow IDs may be reused by new flows, so this must run
+        # before every attachment.
+        h2n_evicted = set(self.nica.h2n_flow_table.read_evicted())
+        n2h_evicted = set(self.nica.n2h_flow_table.read_evicted())
+        if not h2n_evicted and not n2h_evicted:
+            return
+
+        expired = [(flow, ikernel, h2n_flow_id in h2n_evicted, n2h_flow_id in n2h_evicted)
+                   for flow, (ikernel, h2n_flow_id, n2h_flow_id) in self.flows.items()
+                   if h2n_flow_id in h2n_evicted or n2h_flow_id in n2h_evicted]
+        for flow, ikernel, h2n_gone, n2h_gone in expired:
+            logging.info('Flow {} expired'.format(flow))
+            # Remove the direction that has not aged out yet
+            if not h2n_gone:
+                self.nica.h2n_flow_table.del_flow(flow[0], flow[1], socket.INADDR_ANY, 0)
+            if not n2h_gone:
+                self.nica.n2h_flow_table.del_flow(socket.INADDR_ANY, 0, flow[0], flow[1])
+            del self.flows[flow]
+            ikernel.flows.discard(flow)
+
     def attach(self, flow, ikernel):
         logging.info('Adding flow {}'.format(flow))
+        self.expire_flows()
         if flow in self.flows.keys():
             logging.warning('flow already taken')
             raise exception(errno.EADDRINUSE)
@@ -309,6 +397,35 @@ class NetdevHardware(Netdev):
         self.flows[flow] = (ikernel, h2n_flow_id, n2h_flow_id)
         return h2n_flow_id, n2h_flow_id
 
+    def attach_batch(self, flows, ikernel):
+        logging.info('Adding {} flows'.format(len(flows)))
+        self.expire_flows()
+        new_flows = [flow for flow in set(flows) if flow not in self.flows.keys()]
+        action = (FlowTable.FT_IKERNEL, ikernel.ikernel_index, ikernel.ikernel_id)
+
+        h2n_keys = [(flow[0], flow[1], 0, socket.INADDR_ANY) for flow in new_flows]
+        n2h_keys = [(0, socket.INADDR_ANY, flow[0], flow[1]) for flow in new_flows]
+        h2n_flow_ids = self.nica.h2n_flow_table.set_flows([key + action for key in h2n_keys])
+        n2h_flow_ids = self.nica.n2h_flow_table.set_flows([key + action for key in n2h_keys])
+
+        # Remove flows that made it into only one of the tables
+        entries = list(zip(new_flows, h2n_keys, n2h_keys, h2n_flow_ids, n2h_flow_ids))
+        h2n_partial = [h2n_key for _, h2n_key, _, h2n, n2h in entries if h2n and not n2h]
+        n2h_partial = [n2h_key for _, _, n2h_key, h2n, n2h in entries if n2h and not h2n]
+        if h2n_partial:
+            self.nica.h2n_flow_table.del_flows(h2n_partial)
+        if n2h_partial:
+            self.nica.n2h_flow_table.del_flows(n2h_partial)
+
+        attached = {}
+        for flow, _, _, h2n_flow_id, n2h_flow_id in entries:
+            if h2n_flow_id and n2h_flow_id:
+                self.flows[flow] = (ikernel, h2n_flow_id, n2h_flow_id)
+                attached[flow] = (h2n_flow_id, n2h_flow_id)
+            else:
+                logging.warning('Failed adding flow {}'.format(flow))
+        return [attached.get(flow, (0, 0)) for flow in flows]
+
     def detach(self, flow, ikernel):
         '''Delete a flow attachment'''
         logging.info('Removing flow {}'.format(flow))
@@ -331,6 +448,11 @@ class NetdevHardware(Netdev):
         if not success:
             raise exception(errno.ENOENT)
 
+    def flow_counters(self, h2n_flow_ids, n2h_flow_ids, clear):
+        h2n = self.nica.h2n_flow_table.read_counters(h2n_flow_ids, clear=clear)
+        n2h = self.nica.n2h_flow_table.read_counters(n2h_flow_ids, clear=clear)
+        return h2n, n2h
+
     def invoke_ikernel_rpc(self, ikernel, address, value, write):
         nica_ikernel = self.nica.ikernels[ikernel.ikernel_index]
         if write:
@@ -535,6 +657,8 @@ def parse_args():
     parser.add_argument('-v', metavar='DEVICE', dest='vdevice', default=VIRTIO_DEVICE,
                         help='virtio-serial device to use (default: {})'.format(VIRTIO_DEVICE))
     parser.add_argument('--tc-map', metavar='VM,TC', dest='tc_map', type=vm_tc, nargs='+')
+    parser.add_argument('--idle-timeout', metavar='SECONDS', dest='idle_timeout', type=float,
+                        default=0, help='Remove flows idle for longer than this (default: never)')
     return parser.parse_args()
 
 def init_nica():
@@ -556,6 +680,8 @@ def init_nica():
         os.system(os.path.join(cur_dir, '../scripts/custom-ring-setup.sh'))
 
     nica.initialize()
+    if args.idle_timeout:
+        nica.set_idle_timeout(args.idle_timeout)
 
     if args.tc_map:
         tc_map = dict(args.tc_map)
@@ -582,6 +708,15 @@ class Ikernel(object):
 
         return flow_ids
 
+    def attach_batch(self, flows):
+        '''Attach a list of flows to this ikernel instance.'''
+        flow_ids = self.netdev.attach_batch(flows, self)
+        for flow, (h2n_flow_id, _) in zip(flows, flow_ids):
+            if h2n_flow_id:
+                self.flows.add(flow)
+
+        return flow_ids
+
     def detach(self, flow):
         '''Detach a flow (IP, port) from this ikernel instance.'''
         if flow not in self.flows:
@@ -743,11 +878,19 @@ class NICAManagerProtocol(NICAManagerProtocolBase):
 
     def receive_fd(self):
         '''Receive a file descriptor over UNIX domain socket using recvmsg.'''
+        fds_list = self.receive_fds(1)
+        if len(fds_list) != 1:
+            logging.error('Expecting a single file descriptor')
+            raise exception(errno.EINVAL)
+
+        return fds_list[0]
+
+    def receive_fds(self, maxfds):
+        '''Receive up to maxfds file descriptors over UNIX domain socket using recvmsg.'''
         # A message to signal we are ready for the fd msg
         self.send_msg(self.cur_hdr[0], EMPTY_STRUCT, EMPTY_TUPLE)
 
         fds = array.array("i")   # Array of ints
-        maxfds = 1
         msglen = 1
         while True:
             try:
@@ -760,12 +903,7 @@ class NICAManagerProtocol(NICAManagerProtocolBase):
             if cmsg_level == socket.SOL_SOCKET and cmsg_type == socket.SCM_RIGHTS:
                 # Append data, ignoring any truncated integers at the end.
                 fds.fromstring(cmsg_data[:len(cmsg_data) - (len(cmsg_data) % fds.itemsize)])
-        fds_list = list(fds)
-        if len(fds_list) != 1:
-            logging.error('Expecting a single file descriptor')
-            raise exception(errno.EINVAL)
-
-        return fds_list[0]
+        return list(fds)
 
     @staticmethod
     def flow_from_fd(sock_fd):
@@ -785,6 +923,54 @@ class NICAManagerProtocol(NICAManagerProtocolBase):
         h2n_flow_id, n2h_flow_id = NICA.ik_attach(ikernel_handle, flow)
         return (0, h2n_flow_id, n2h_flow_id)
 
+    @rpc(10, Struct('II'), Struct('I{0}I{0}I'.format(NICA_IK_ATTACH_BATCH_MAX)))
+    def ik_attach_batch(self, ikernel_handle, count):
+        '''Associate the flows of several sockets with a given ikernel.'''
+        if count > NICA_IK_ATTACH_BATCH_MAX:
+            return (errno.EINVAL,)
+
+        sock_fds = self.receive_fds(count)
+        if len(sock_fds) != count:
+            for sock_fd in sock_fds:
+                os.close(sock_fd)
+            logging.error('Expecting {} file descriptors'.format(count))
+            return (errno.EINVAL,)
+        flows = [self.flow_from_fd(sock_fd) for sock_fd in sock_fds]
+
+        flow_ids = NICA.ik_attach_batch(ikernel_handle, flows)
+        padding = [0] * (NICA_IK_ATTACH_BATCH_MAX - count)
+        h2n_flow_ids = [h2n for h2n, _ in flow_ids] + padding
+        n2h_flow_ids = [n2h for _, n2h in flow_ids] + padding
+        attached = sum(1 for h2n in h2n_flow_ids if h2n)
+        return (0, attached, *h2n_flow_ids, *n2h_flow_ids)
+
+    @rpc(11, Struct('III{0}I{0}I'.format(NICA_IK_FLOW_COUNTERS_MAX)),
+         Struct('{}Q'.format(4 * NICA_IK_FLOW_COUNTERS_MAX)))
+    def ik_flow_counters(self, ikernel_handle, count, clear, *flow_ids):
+        '''Read the packet and byte counters of several flows of an ikernel.'''
+        if count > NICA_IK_FLOW_COUNTERS_MAX:
+            return (errno.EINVAL,)
+
+        h2n_flow_ids = flow_ids[:count]
+        n2h_flow_ids = flow_ids[NICA_IK_FLOW_COUNTERS_MAX:NICA_IK_FLOW_COUNTERS_MAX + count]
+        h2n, n2h = NICA.ik_flow_counters(ikernel_handle, h2n_flow_ids, n2h_flow_ids,
+                                         bool(clear))
+        padding = [(0, 0)] * (NICA_IK_FLOW_COUNTERS_MAX - count)
+        h2n_counters = [value for counter in h2n + padding for value in counter]
+        n2h_counters = [value for counter in n2h + padding for value in counter]
+        return (0, *h2n_counters, *n2h_counters)
+
+    @rpc(12, Struct('16s'))
+    def flow_table_clear(self, netdev):
+        '''Remove all flows of the netdev.'''
+        netdev = netdev.split(b'\x00', 1)[0].decode()
+        if netdev != NICA.ifname:
+            logging.warning('Expecting netdev "{}", not "{}".'.format(NICA.ifname, netdev))
+            return (errno.ENODEV, )
+
+        NICA.clear_flows()
+        return (0, 0)
+
     @rpc(5, Struct('I'), Struct('I'))
     def ik_detach(self, ikernel_handle):
         '''Detach a socket's flow from a given ikernel.'''
@@ -988,6 +1174,15 @@ class NICAManagerHypervisorProtocol(NICAManagerProtocolBase):
         return (0, 0)
 
 NICA_SOCKET_PATH = '/var/run/nica-manager.socket'
+EXPIRE_INTERVAL = 1 # seconds
+
+def expire_flows(loop):
+    '''Periodically drop flows evicted by the hardware idle timeout.'''
+    try:
+        NICA.expire_flows()
+    except TimeoutError as exc:
+        logging.warning('Timeout exception: {}'.format(exc))
+    loop.call_later(EXPIRE_INTERVAL, expire_flows, loop)
 
 def main():
     '''Main entrypoint'''
@@ -1008,6 +1203,7 @@ def main():
     server = loop.run_until_complete(coru)
 
     os.chmod(NICA_SOCKET_PATH, int('0777', base=8))
+    loop.call_soon(expire_flows, loop)
 
     logging.info('Serving on {}'.format(server.sockets[0].getsockname()))
     try:
@@ -46,8 +46,18 @@ public:
     scheduler_t sched;
 
     arbiter() : meta_state(META_IDLE), data_state(DATA_IDLE), last_stream(0), stats(),
-        quota(0)
+        cycle_counter(0), quota(0), drr_bytes(false), priority_ports(0),
+        watchdog_timeout(0), stall_cycles(0), faulted(0), faults_published(0),
+        meta_faulted(0), gateway_faulted(0)
     {
+        for (int i = 0; i < NUM_TC; ++i) {
+            drain_packets[i] = 0;
+            rate_cap[i] = 0;
+            rate_cap_tokens[i] = 0;
+            shaper_rate[i] = 0;
+            shaper_burst[i] = 0;
+            shaper_tokens[i] = 0;
+        }
     }
 
     /* Accept a variable length list of arbiter_input_stream structs */
@@ -65,7 +75,10 @@ public:
     void pick_next_packet(arbiter_stats<NUM_TC>* s,
         hls_ik::gateway_registers& g)
     {
-#pragma HLS pipeline II=3
+#pragma HLS pipeline II=1
+        if (!gateway_faults.empty())
+            gateway_faulted = gateway_faults.read();
+
         /* Inline the gateway here */
 #pragma HLS inline region
         gateway.gateway(g, [=](ap_uint<31> addr, int& data) -> int {
@@ -105,13 +118,22 @@ public:
         scheduler_decision.write(scheduler_cmd{selected_stream, quota});
     }
 
-    void schedule_ports()
+    void schedule_ports(const ntl::maybe<index_t>& requeue)
     {
 #pragma HLS inline
         if (tx_requests.full())
             return;
 
-        if (!empty_metadata(schedule_ports_last) && !interrupt_sent(schedule_ports_last, schedule_ports_last)) {
+        /* A port evicted with packets left goes straight back to the
+         * scheduler. Otherwise scan for ports with new packets. */
+        if (requeue.valid()) {
+            tx_requests.write(requeue.value());
+            interrupt_sent(requeue.value(), requeue.value()) = 1;
+            return;
+        }
+
+        if (!empty_metadata(schedule_ports_last) && !interrupt_sent(schedule_ports_last, schedule_ports_last) &&
+            !priority_ports(schedule_ports_last, schedule_ports_last) && port_eligible(schedule_ports_last)) {
             tx_requests.write(schedule_ports_last);
             interrupt_sent(schedule_ports_last, schedule_ports_last) = 1;
         }
@@ -128,64 +150,93 @@ public:
     void tx_meta(tc_ports& tc, udp::udp_builder_metadata_stream& metadata_out,
                  trace_event events[4])
     {
-#pragma HLS pipeline II=3 enable_flush
+#pragma HLS pipeline II=1 enable_flush
 #pragma HLS array_partition variable=peek_metadata complete
 
 #pragma HLS stream variable=meta_to_data depth=15
         for (int i = 0; i < 4; ++i)
             events[i] = 0;
 
-        schedule_ports();
+        if (!meta_faults.empty())
+            meta_faulted = meta_faults.read();
+
         update_peek(tc);
+        refill_rate_caps();
+        refill_shapers();
 
-        /* State machine */
-        switch (meta_state) {
-        case META_IDLE: {
-            if (scheduler_decision.empty())
-                break;
+        ntl::maybe<index_t> requeue;
+        tx_meta_packet(metadata_out, events, requeue);
+        schedule_ports(requeue);
+    }
 
-            auto decision = scheduler_decision.read();
-            meta_selected_port = decision.port;
-            quota = decision.quantum;
-
-            assert(meta_selected_port < NUM_TC);
-            // Make sure only 0-2 are accessed
-            switch (meta_selected_port) {
-            case 0:
-            case 1:
-            case 2:
-                events[meta_selected_port] = 1;
-                break;
-            default:
-                break;
-            }
+    /* Send up to one packet's metadata per cycle. When the DRR port being
+     * served cannot send, it is evicted and the next port is selected and
+     * sends in the same cycle, so switching ports costs no cycles. */
+    void tx_meta_packet(udp::udp_builder_metadata_stream& metadata_out,
+                        trace_event events[4], ntl::maybe<index_t>& requeue)
+    {
+#pragma HLS inline
+        if (metadata_out.full() || meta_to_data.full())
+            return;
 
-            meta_state = NEW_PACKET;
-            break; /* TODO optimize */
-        }
-        case NEW_PACKET: {
-            if (metadata_out.full() || meta_to_data.full())
-                break;
+        index_t priority_port;
+        bool priority = next_priority_port(&priority_port);
+        uint32_t len;
 
-            uint32_t len;
+        if (meta_state == NEW_PACKET) {
             bool non_empty = peek_stream_packet_length(meta_selected_port, &len);
+            bool eligible = port_eligible(meta_selected_port);
 
-            if (non_empty && len <= quota) {
-                quota -= len; // TODO more accurate packet length
-                assert(!empty_metadata(meta_selected_port));
-                udp::udp_builder_metadata m = read_metadata(meta_selected_port);
-                if (!m.empty_packet())
-                    meta_to_data.write_nb(meta_selected_port);
-                metadata_out.write_nb(m);
-            } else {
-                events[TRACE_ARBITER_EVICTED] = 1;
-                meta_state = META_IDLE;
-                interrupt_sent(meta_selected_port, meta_selected_port) = 0;
-                sched.update_flow(meta_selected_port, non_empty, quota);
+            /* Priority ports preempt the DRR port at packet boundaries, and
+             * a port that runs out of shaper tokens or faults yields */
+            if (non_empty && len <= quota && eligible && !priority) {
+                quota -= len;
+                tx_packet(meta_selected_port, metadata_out);
                 return;
             }
+
+            events[TRACE_ARBITER_EVICTED] = 1;
+            meta_state = META_IDLE;
+            interrupt_sent(meta_selected_port, meta_selected_port) = 0;
+            sched.update_flow(meta_selected_port, non_empty, quota);
+            if (non_empty && eligible && !priority_ports(meta_selected_port, meta_selected_port))
+                requeue = meta_selected_port;
+        }
+
+        /* The rate cap is charged after the fact, so a priority port may
+         * overdraw it by one packet */
+        if (priority) {
+            if (rate_cap[priority_port] != 0)
+                rate_cap_tokens[priority_port] -= int(peek_metadata[priority_port].value().length);
+            tx_packet(priority_port, metadata_out);
+            return;
+        }
+
+        if (scheduler_decision.empty())
+            return;
+
+        auto decision = scheduler_decision.read();
+        meta_selected_port = decision.port;
+        quota = decision.quantum;
+
+        assert(meta_selected_port < NUM_TC);
+        // Make sure only 0-2 are accessed
+        switch (meta_selected_port) {
+        case 0:
+        case 1:
+        case 2:
+            events[meta_selected_port] = 1;
+            break;
+        default:
             break;
         }
+
+        meta_state = NEW_PACKET;
+
+        if (peek_stream_packet_length(meta_selected_port, &len) && len <= quota &&
+            port_eligible(meta_selected_port)) {
+            quota -= len;
+            tx_packet(meta_selected_port, metadata_out);
         }
     }
 
@@ -196,46 +247,81 @@ public:
     {
 #pragma HLS pipeline II=1 enable_flush
 #pragma HLS array_partition variable=stats.tx_port complete
+#pragma HLS array_partition variable=drain_packets complete
+#pragma HLS stream variable=meta_faults depth=2
+#pragma HLS stream variable=gateway_faults depth=2
         /* Update statistics */
         for (int i = 0; i < NUM_TC; ++i)
             s->tx_port[i] = stats.tx_port[i];
         s->out_full = stats.out_full;
+        s->faulted = faulted;
+
+        if (!fault_clears.empty()) {
+            port_bitmap_t clears = fault_clears.read();
+            faulted &= ~clears;
+            for (int i = 0; i < NUM_TC; ++i)
+#pragma HLS unroll
+                if (clears(i, i))
+                    drain_packets[i] = 0;
+        }
 
-        switch (data_state) {
-        case DATA_IDLE: {
+        /* tx_meta and the gateway keep their own copies of the faults */
+        if (faulted != faults_published && !meta_faults.full() && !gateway_faults.full()) {
+            meta_faults.write(faulted);
+            gateway_faults.write(faulted);
+            faults_published = faulted;
+        }
+
+        drain_ports(tc);
+
+        /* Take the next packet in the same cycle as its first word, so
+         * packets leave back to back */
+        if (data_state == DATA_IDLE) {
             if (!meta_to_data.read_nb(data_selected_port))
-                break;
+                return;
 
             data_state = DATA_STREAM;
-            break; /* TODO optimize */
+            stall_cycles = 0;
         }
-        case DATA_STREAM:
-            // TODO close packet if ikernel is misbehaving even in middle of
-            // a packet.
 
-            if (out.full())
-                break;
+        if (out.full())
+            return;
 
-            ap_uint<hls_ik::axi_data::width> raw_word;
+        bool port_faulted = faulted(data_selected_port, data_selected_port);
+        bool valid = false;
+        ap_uint<hls_ik::axi_data::width> raw_word;
+        if (!port_faulted) {
             switch (data_selected_port) {
 #define BOOST_PP_LOCAL_MACRO(i) \
             case i: \
-                if (!(tc.data ## i).read_nb(raw_word)) \
-                    return; \
+                valid = (tc.data ## i).read_nb(raw_word); \
                 break;
 #define BOOST_PP_LOCAL_LIMITS (0, NUM_TC - 1)
 %:include BOOST_PP_LOCAL_ITERATE()
             }
-            out.write_nb(raw_word);
+        }
+
+        auto& p = stats.tx_port[data_selected_port];
+        if (!valid) {
+            /* Close the packet if its ikernel stalled for too long, or
+             * faulted before */
+            if (!port_faulted && (watchdog_timeout == 0 || ++stall_cycles < watchdog_timeout))
+                return;
 
-            auto& p = stats.tx_port[data_selected_port];
+            raw_word = hls_ik::axi_data(0, 0, true);
+            faulted(data_selected_port, data_selected_port) = 1;
+            ++drain_packets[data_selected_port];
+            ++p.truncated;
+        } else {
+            stall_cycles = 0;
             ++p.words;
-            hls_ik::axi_data word = raw_word;
-            if (word.last) {
-                ++p.packets;
-                data_state = DATA_IDLE;
-            }
-            break;
+        }
+        out.write_nb(raw_word);
+
+        hls_ik::axi_data word = raw_word;
+        if (word.last) {
+            ++p.packets;
+            data_state = DATA_IDLE;
         }
     }
 
@@ -243,9 +329,9 @@ public:
     {
         if (address >= ARBITER_SCHEDULER) {
             int offset = address - ARBITER_SCHEDULER;
-            flow_id = offset >> 1;
-            cmd = offset & 1;
-            return true;
+            flow_id = offset / ARBITER_SCHEDULER_STRIDE;
+            cmd = offset % ARBITER_SCHEDULER_STRIDE;
+            return flow_id < NUM_TC;
         }
         return false;
     }
@@ -254,9 +340,50 @@ public:
     {
 #pragma HLS inline
         int flow_id, cmd;
-        if (decode_gateway_address(address, flow_id, cmd))
-            return sched.rpc(cmd, &value, flow_id, false);
+        if (decode_gateway_address(address, flow_id, cmd)) {
+            switch (cmd) {
+            case ARBITER_SCHED_PRIORITY:
+                priority_ports(flow_id, flow_id) = value != 0;
+                return GW_DONE;
+            case ARBITER_SCHED_RATE_CAP:
+                if (value < 0)
+                    return GW_FAIL;
+                rate_cap[flow_id] = value;
+                rate_cap_tokens[flow_id] = value;
+                return GW_DONE;
+            /* A shaper with no burst would never have tokens */
+            case ARBITER_SHAPER_RATE:
+                if (value != 0 && shaper_burst[flow_id] == 0)
+                    return GW_FAIL;
+                shaper_rate[flow_id] = value;
+                return GW_DONE;
+            case ARBITER_SHAPER_BURST:
+                if (value == 0 && shaper_rate[flow_id] != 0)
+                    return GW_FAIL;
+                shaper_burst[flow_id] = value;
+                return GW_DONE;
+            default:
+                if (cmd >= ARBITER_SCHED_PRIORITY)
+                    return GW_FAIL;
+                return sched.rpc(cmd, &value, flow_id, false);
+            }
+        }
 
+        switch (address) {
+        case ARBITER_DRR_BYTES:
+            drr_bytes = value;
+            break;
+        case ARBITER_WATCHDOG_TIMEOUT:
+            watchdog_timeout = value;
+            break;
+        case ARBITER_WATCHDOG_FAULTED:
+            if (fault_clears.full())
+                return GW_BUSY;
+            fault_clears.write(value);
+            break;
+        default:
+            return GW_FAIL;
+        }
         return GW_DONE;
     }
 
@@ -264,13 +391,42 @@ public:
     {
 #pragma HLS inline
         int flow_id, cmd;
-        if (decode_gateway_address(address, flow_id, cmd))
-            return sched.rpc(cmd, value, flow_id, true);
+        if (decode_gateway_address(address, flow_id, cmd)) {
+            switch (cmd) {
+            case ARBITER_SCHED_PRIORITY:
+                *value = priority_ports(flow_id, flow_id);
+                return GW_DONE;
+            case ARBITER_SCHED_RATE_CAP:
+                *value = rate_cap[flow_id];
+                return GW_DONE;
+            case ARBITER_SHAPER_RATE:
+                *value = shaper_rate[flow_id];
+                return GW_DONE;
+            case ARBITER_SHAPER_BURST:
+                *value = shaper_burst[flow_id];
+                return GW_DONE;
+            default:
+                if (cmd >= ARBITER_SCHED_PRIORITY) {
+                    *value = -1;
+                    return GW_FAIL;
+                }
+                return sched.rpc(cmd, value, flow_id, true);
+            }
+        }
 
         switch (address) {
         case ARBITER_NUM_TC:
             *value = NUM_TC;
             break;
+        case ARBITER_DRR_BYTES:
+            *value = drr_bytes;
+            break;
+        case ARBITER_WATCHDOG_TIMEOUT:
+            *value = watchdog_timeout;
+            break;
+        case ARBITER_WATCHDOG_FAULTED:
+            *value = gateway_faulted;
+            break;
         default:
             *value = -1;
             return GW_FAIL;
@@ -297,7 +453,10 @@ private:
 #pragma HLS inline
         if (peek_metadata[port].valid()) {
             udp::udp_builder_metadata m = peek_metadata[port].value();
-            *len = uint32_t(ALIGN(m.length, 32)) >> 5;
+            if (drr_bytes)
+                *len = m.length;
+            else
+                *len = uint32_t(ALIGN(m.length, MLX_AXI4_WIDTH_BYTES)) >> MLX_AXI4_OFFSET_BITS;
             return true;
         }
         return false;
@@ -315,6 +474,95 @@ private:
         return !peek_metadata[port].valid();
     }
 
+    /* Find the first priority port with a packet and within its rate cap */
+    bool next_priority_port(index_t* port) {
+#pragma HLS inline
+        bool found = false;
+        for (int i = NUM_TC - 1; i >= 0; --i) {
+#pragma HLS unroll
+            if (priority_ports(i, i) && !empty_metadata(i) && port_eligible(i) &&
+                (rate_cap[i] == 0 || rate_cap_tokens[i] > 0)) {
+                *port = i;
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    void tx_packet(index_t port, udp::udp_builder_metadata_stream& metadata_out) {
+#pragma HLS inline
+        assert(!empty_metadata(port));
+        udp::udp_builder_metadata m = read_metadata(port);
+        shaper_charge(port, m.length);
+        if (!m.empty_packet())
+            meta_to_data.write_nb(port);
+        metadata_out.write_nb(m);
+    }
+
+    void refill_rate_caps() {
+#pragma HLS inline
+#pragma HLS array_partition variable=rate_cap complete
+#pragma HLS array_partition variable=rate_cap_tokens complete
+        ++cycle_counter;
+        if (cycle_counter(ARBITER_RATE_CAP_LOG_TICK - 1, 0) != 0)
+            return;
+
+        for (int i = 0; i < NUM_TC; ++i) {
+#pragma HLS unroll
+            rate_cap_tokens[i] += rate_cap[i];
+            if (rate_cap_tokens[i] > rate_cap[i])
+                rate_cap_tokens[i] = rate_cap[i];
+        }
+    }
+
+    bool shaper_eligible(index_t port) {
+#pragma HLS inline
+        return shaper_rate[port] == 0 || shaper_tokens[port] > 0;
+    }
+
+    bool port_eligible(index_t port) {
+#pragma HLS inline
+        return shaper_eligible(port) && !meta_faulted(port, port);
+    }
+
+    /* Drop the words a faulted port's ikernel still sends for the packets
+     * the watchdog closed, up to and including their last words */
+    void drain_ports(tc_ports& tc) {
+#pragma HLS inline
+#define BOOST_PP_LOCAL_MACRO(i) \
+        if (faulted(i, i) && drain_packets[i] != 0) { \
+            ap_uint<hls_ik::axi_data::width> raw; \
+            if ((tc.data ## i).read_nb(raw)) { \
+                hls_ik::axi_data word = raw; \
+                if (word.last) \
+                    --drain_packets[i]; \
+            } \
+        }
+#define BOOST_PP_LOCAL_LIMITS (0, NUM_TC - 1)
+%:include BOOST_PP_LOCAL_ITERATE()
+    }
+
+    /* Packets are charged after the fact, so a port may overdraw its bucket
+     * by one packet, which lets bursts below the packet size work */
+    void shaper_charge(index_t port, ap_uint<16> length) {
+#pragma HLS inline
+        if (shaper_rate[port] != 0)
+            shaper_tokens[port] -= shaper_tokens_t(length) << ARBITER_SHAPER_LOG_TICK;
+    }
+
+    void refill_shapers() {
+#pragma HLS inline
+#pragma HLS array_partition variable=shaper_rate complete
+#pragma HLS array_partition variable=shaper_burst complete
+#pragma HLS array_partition variable=shaper_tokens complete
+        for (int i = 0; i < NUM_TC; ++i) {
+#pragma HLS unroll
+            shaper_tokens_t max = shaper_tokens_t(shaper_burst[i]) << ARBITER_SHAPER_LOG_TICK;
+            shaper_tokens_t tokens = shaper_tokens[i] + shaper_rate[i];
+            shaper_tokens[i] = tokens > max ? max : tokens;
+        }
+    }
+
     typedef ap_uint<NUM_TC> port_bitmap_t;
     hls::stream<index_t> tx_requests;
 
@@ -332,8 +580,40 @@ private:
     ap_uint<32> cycle_counter;
     /* Number of bytes to charge this port when evicting it */
     int accumulated_charge;
-    /* Number of flits a port is allowed to send before it is evicted */
+    /* Number of flits (or bytes with ARBITER_DRR_BYTES) a port is allowed
+     * to send before it is evicted. What is left when the head packet does
+     * not fit is returned to the scheduler as the port's deficit. */
     uint32_t quota;
+    bool drr_bytes;
+
+    /* Strict priority tier */
+    port_bitmap_t priority_ports;
+    int rate_cap[NUM_TC];
+    /* Bytes left of the rate cap in the current tick; negative when a
+     * packet overdrew it */
+    int rate_cap_tokens[NUM_TC];
+
+    /* Egress shapers. Tokens are in units of 1 / ARBITER_SHAPER_TICK
+     * bytes. */
+    typedef ap_int<32 + ARBITER_SHAPER_LOG_TICK + 2> shaper_tokens_t;
+    ap_uint<32> shaper_rate[NUM_TC];
+    ap_uint<32> shaper_burst[NUM_TC];
+    shaper_tokens_t shaper_tokens[NUM_TC];
+
+    /* Watchdog */
+    ap_uint<32> watchdog_timeout;
+    /* Cycles the packet in tx_data has waited for its next word */
+    ap_uint<32> stall_cycles;
+    /* Owned by tx_data. The gateway clears faults through fault_clears, and
+     * tx_data sends changes to the copies of tx_meta and the gateway. */
+    port_bitmap_t faulted;
+    hls::stream<port_bitmap_t> fault_clears;
+    port_bitmap_t faults_published;
+    hls::stream<port_bitmap_t> meta_faults, gateway_faults;
+    port_bitmap_t meta_faulted, gateway_faulted;
+    /* Packets closed by the watchdog whose remaining words are still to be
+     * drained from the port */
+    ap_uint<16> drain_packets[NUM_TC];
 
     ntl::gateway_impl<int> gateway;
 };
@@ -37,24 +37,70 @@ struct arbiter_per_port_stats {
 };
 
 struct arbiter_tx_per_port_stats {
-    arbiter_tx_per_port_stats() : words(), packets()
+    arbiter_tx_per_port_stats() : words(), packets(), truncated()
     {}
 
+    /* Words received from the port; the empty word that closes a truncated
+     * packet is not counted */
     ap_uint<64> words;
     ap_uint<64> packets;
+    /* Packets closed by the watchdog */
+    ap_uint<64> truncated;
 };
 
 template <unsigned num_ports>
 struct arbiter_stats {
-    arbiter_stats() : out_full() {}
+    arbiter_stats() : out_full(), faulted() {}
 
     arbiter_per_port_stats port[num_ports];
     arbiter_tx_per_port_stats tx_port[num_ports];
     ap_uint<64> out_full;
+    /* Ports faulted by the watchdog */
+    ap_uint<num_ports> faulted;
 };
 
-/* Each port has the two SCHED_DRR_* registers at offsets starting from
- * ARBITER_SCHEDULER and with stride ARBITER_SCHEDULER_STRIDE */
+/* Each port has the two SCHED_DRR_* registers, followed by
+ * ARBITER_SCHED_PRIORITY, ARBITER_SCHED_RATE_CAP and the ARBITER_SHAPER_*
+ * registers, at offsets starting from ARBITER_SCHEDULER and with stride
+ * ARBITER_SCHEDULER_STRIDE */
 #define ARBITER_NUM_TC 0x0
+/* When set, DRR quanta are in bytes and packets are charged their exact
+ * length. Otherwise quanta are in data path flits, and packets are charged
+ * their length rounded up to whole flits. */
+#define ARBITER_DRR_BYTES 0x1
+/* Watchdog of packets stalled by their ikernel. When the next data word of
+ * the packet being sent does not arrive for ARBITER_WATCHDOG_TIMEOUT cycles,
+ * the arbiter closes the packet with an empty last word and marks its port
+ * faulted. Faulted ports are not scheduled, and their packets that were
+ * already scheduled are closed the same way, so the other ports keep
+ * going. While a port is faulted, the words its ikernel still sends for the
+ * closed packets are dropped, up to and including their last words. Zero
+ * disables the watchdog. */
+#define ARBITER_WATCHDOG_TIMEOUT 0x2
+/* Bitmap of faulted ports. Writing a bitmap clears the faults of its ports,
+ * and stops dropping words of their closed packets, so reset the ikernel
+ * first unless it has sent the rest of them. */
+#define ARBITER_WATCHDOG_FAULTED 0x3
 #define ARBITER_SCHEDULER 0x10
-#define ARBITER_SCHEDULER_STRIDE 0x2
+#define ARBITER_SCHEDULER_STRIDE 0x8
+/* Ports with a non-zero ARBITER_SCHED_PRIORITY form a strict priority tier
+ * above the DRR ports. Whenever one of them has a packet, it is sent next,
+ * at a packet boundary of the DRR port being served, which keeps what is
+ * left of its quota as deficit. Among priority ports the lowest index wins. */
+#define ARBITER_SCHED_PRIORITY 0x2
+/* Bytes a priority port may send every ARBITER_RATE_CAP_TICK cycles, so that
+ * it cannot starve the DRR ports. Zero means no cap. A port that exhausts
+ * its cap waits for the next tick, without competing in DRR. */
+#define ARBITER_SCHED_RATE_CAP 0x3
+#define ARBITER_RATE_CAP_LOG_TICK 10
+#define ARBITER_RATE_CAP_TICK (1 << ARBITER_RATE_CAP_LOG_TICK)
+/* Token bucket shaper of the port's egress rate, in either tier. The port
+ * may send ARBITER_SHAPER_RATE bytes every ARBITER_SHAPER_TICK cycles, in
+ * bursts of up to ARBITER_SHAPER_BURST bytes. A port without tokens is not
+ * scheduled until it has some again, and the other ports use its share.
+ * A zero rate disables the shaper. An enabled shaper needs a non-zero
+ * burst: set the burst before the rate, and clear the rate first. */
+#define ARBITER_SHAPER_RATE 0x4
+#define ARBITER_SHAPER_BURST 0x5
+#define ARBITER_SHAPER_LOG_TICK 10
+#define ARBITER_SHAPER_TICK (1 << ARBITER_SHAPER_LOG_TICK)
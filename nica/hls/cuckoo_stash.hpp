@@ -0,0 +1,80 @@
+/* * Copyright (c) 2016-2018 Haggai Eran, Gabi Malka, Lior Zeno, Maroun Tork
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <ap_int.h>
+
+/* The stash of a cuckoo_table: a few fully associative slots for entries
+ * that found no bucket after the maximal number of displacements. Every
+ * lookup compares all the slots, so Size must stay small. */
+template <typename Entry, typename Key, unsigned Size>
+class cuckoo_stash
+{
+public:
+    typedef ap_uint<1> epoch_t;
+    typedef ap_uint<1> bank_t;
+
+    /* Index of the slot holding key in the given bank, or -1 */
+    int find(const Key& key, epoch_t epoch, bank_t bank) const
+    {
+#pragma HLS inline
+#pragma HLS array_partition variable=slots complete
+        int index = -1;
+        for (int i = 0; i < Size; ++i) {
+#pragma HLS unroll
+            if (slots[i].match(key, epoch, bank))
+                index = i;
+        }
+        return index;
+    }
+
+    /* Index of the first slot that belongs to no bank, or -1 */
+    int free_slot() const
+    {
+#pragma HLS inline
+        int index = -1;
+        for (int i = Size - 1; i >= 0; --i) {
+#pragma HLS unroll
+            if (!slots[i].banks)
+                index = i;
+        }
+        return index;
+    }
+
+    void clear()
+    {
+#pragma HLS inline
+        for (int i = 0; i < Size; ++i) {
+#pragma HLS unroll
+            slots[i].banks = 0;
+        }
+    }
+
+    Entry& operator[](int index) { return slots[index]; }
+    const Entry& operator[](int index) const { return slots[index]; }
+
+private:
+    Entry slots[Size];
+};
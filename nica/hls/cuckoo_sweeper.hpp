@@ -0,0 +1,101 @@
+/* * Copyright (c) 2016-2018 Haggai Eran, Gabi Malka, Lior Zeno, Maroun Tork
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <ap_int.h>
+
+/* Idle timeout bookkeeping of a cuckoo_table. Every lookup hit records the
+ * current time in ticks for the entry's ID, and while the table has nothing
+ * else to do it visits the IDs in turn, evicting the entries that have been
+ * idle for longer than the timeout. Every ID is visited once in about
+ * 2 * Capacity cycles, so ticks should be at least that long for timestamps
+ * not to wrap around. IDs run from 1 to Capacity. */
+template <typename Id, unsigned Capacity>
+class cuckoo_sweeper
+{
+public:
+    typedef ap_uint<16> timestamp_t;
+
+    cuckoo_sweeper() :
+        now(0), tick_count(0), tick_cycles(1), idle_timeout(0), sweep_id(1)
+    {}
+
+    /* Advance the clock, once per cycle */
+    void tick()
+    {
+#pragma HLS inline
+        if (++tick_count >= tick_cycles) {
+            tick_count = 0;
+            ++now;
+        }
+    }
+
+    /* Record a hit, or the addition of an entry */
+    void touch(Id id)
+    {
+#pragma HLS inline
+#pragma HLS dependence variable=last_hit inter false
+        last_hit[id - 1] = now;
+    }
+
+    /* Set the idle timeout in ticks (zero disables aging), and the length of
+     * a tick in cycles */
+    void configure(timestamp_t timeout, ap_uint<32> tick)
+    {
+#pragma HLS inline
+        idle_timeout = timeout;
+        tick_cycles = tick;
+        tick_count = 0;
+    }
+
+    bool enabled() const { return idle_timeout != 0; }
+
+    /* The ID to visit next */
+    Id current() const { return sweep_id; }
+
+    /* Move on from the current ID, returning whether it has been idle for
+     * longer than the timeout */
+    bool advance()
+    {
+#pragma HLS inline
+        const timestamp_t idle = now - last_hit[sweep_id - 1];
+        sweep_id = sweep_id == Capacity ? Id(1) : Id(sweep_id + 1);
+        return idle > idle_timeout;
+    }
+
+    /* Start over from the first ID, after the table was cleared */
+    void restart()
+    {
+#pragma HLS inline
+        sweep_id = 1;
+    }
+
+private:
+    timestamp_t last_hit[Capacity];
+    timestamp_t now;
+    ap_uint<32> tick_count, tick_cycles;
+    timestamp_t idle_timeout;
+    Id sweep_id;
+};
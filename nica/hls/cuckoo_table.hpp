@@ -0,0 +1,815 @@
+/* * Copyright (c) 2016-2018 Haggai Eran, Gabi Malka, Lior Zeno, Maroun Tork
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <tuple>
+#include <ap_int.h>
+#include <hls_stream.h>
+
+#include "gateway.hpp"
+#include "toeplitz.hpp"
+#include "cuckoo_stash.hpp"
+#include "cuckoo_sweeper.hpp"
+#include <ntl/cache.hpp>
+#include <ntl/constexpr.hpp>
+
+/* An exact match table with two hash functions: each key may reside in one
+ * of the Ways entries of its bucket in either half of the table, or in the
+ * stash (cuckoo_stash.hpp). Lookups are served at one per cycle. Updates
+ * arrive from the gateway through a request stream and are applied by the
+ * same process, which moves entries between buckets in the background to
+ * make room for new keys. Each key keeps the flow ID it was given when added
+ * while it moves.
+ *
+ * Entries carry the epoch they were written in, so a clear only flips the
+ * epoch and stale entries are scrubbed later. They also record the versions
+ * (banks) they belong to, so updates can be staged in the inactive bank and
+ * committed with a sync. Idle entries are evicted by the sweeper
+ * (cuckoo_sweeper.hpp). */
+template <typename Key, typename Value, unsigned Size, unsigned Ways,
+          unsigned StashSize, unsigned MaxKicks>
+class cuckoo_table
+{
+public:
+    static const unsigned capacity = Size + StashSize;
+    static const unsigned buckets = Size / Ways / 2;
+    static const int key_width = ntl::pack<Key>::width;
+
+    typedef Key tag_type;
+    typedef std::tuple<Key, Value> value_type;
+    typedef ntl::maybe<value_type> maybe_value_t;
+    typedef ap_uint<ntl::log2(capacity) + 1> id_t;
+    typedef ap_uint<ntl::log2(buckets)> bucket_t;
+    typedef ap_uint<ntl::log2(Ways)> way_t;
+    /* Position of an entry: table, bucket, way, or Size + stash index */
+    typedef ap_uint<ntl::log2(capacity) + 1> location_t;
+    typedef ntl::maybe<std::tuple<id_t, Value> > lookup_result_t;
+    typedef cuckoo_sweeper<id_t, capacity> sweeper_t;
+    typedef typename sweeper_t::timestamp_t timestamp_t;
+    /* With at most one scrub outstanding, entries are either of the current
+     * epoch or of the previous one */
+    typedef ap_uint<1> epoch_t;
+    typedef ap_uint<1> bank_t;
+
+    struct lookup_request {
+        Key key;
+        bank_t bank;
+
+        explicit lookup_request(const Key& key = Key(), bank_t bank = 0) :
+            key(key), bank(bank)
+        {}
+    };
+
+    cuckoo_table()
+    {
+        request_sent = false;
+        state = CTRL_IDLE;
+        respond = false;
+        displacing = false;
+        victim = 1;
+        next_fresh_id = 1;
+        free_head = free_tail = free_count = 0;
+        epoch = 0;
+        scrubbing = false;
+        clear_pending = false;
+        scrub_bucket = 0;
+        active = 0;
+        last_lookup_bank = 0;
+        syncing = false;
+        sync_location = 0;
+    }
+
+    /* Data path */
+    hls::stream<lookup_request> lookups;
+    hls::stream<lookup_result_t> results;
+    /* IDs of entries removed by the idle timeout */
+    hls::stream<id_t> evictions;
+
+    void hash_table()
+    {
+#pragma HLS pipeline enable_flush ii=1
+#pragma HLS array_partition variable=table complete dim=1
+#pragma HLS array_partition variable=table complete dim=2
+#pragma HLS dependence variable=table inter false
+#pragma HLS dependence variable=location inter false
+#pragma HLS dependence variable=free_ids inter false
+        if (!lookups.empty() && !results.full()) {
+            lookup_request l = lookups.read();
+            results.write(lookup(l.key, l.bank));
+            last_lookup_bank = l.bank;
+        }
+
+        control();
+        sweeper.tick();
+    }
+
+    /* Gateway side. Each call returns GW_BUSY until the table processed the
+     * command, and the caller repeats it with the same arguments. Staged
+     * updates only apply to the inactive bank. Adding sets the result to the
+     * new flow ID, to zero if the key exists, or to -1 if the table is
+     * full. */
+    int gateway_add_entry(const value_type& entry, int* result, bool staged = false)
+    {
+#pragma HLS inline
+        request r;
+        r.command = CMD_ADD;
+        r.staged = staged;
+        std::tie(r.key, r.value) = entry;
+        return gateway_request(r, result);
+    }
+
+    int gateway_delete_entry(const Key& key, int* result, bool staged = false)
+    {
+#pragma HLS inline
+        request r;
+        r.command = CMD_DELETE;
+        r.staged = staged;
+        r.key = key;
+        return gateway_request(r, result);
+    }
+
+    /* Make the given bank active, and copy it over the other bank */
+    int gateway_sync(bank_t bank)
+    {
+#pragma HLS inline
+        request r;
+        r.command = CMD_SYNC;
+        r.bank = bank;
+        int result;
+        return gateway_request(r, &result);
+    }
+
+    /* Set the idle timeout in ticks (zero disables aging), and the length of
+     * a tick in cycles */
+    int gateway_set_aging(timestamp_t timeout, ap_uint<32> tick)
+    {
+#pragma HLS inline
+        request r;
+        r.command = CMD_SET_AGING;
+        r.timeout = timeout;
+        r.tick = tick;
+        int result;
+        return gateway_request(r, &result);
+    }
+
+    /* Remove all entries */
+    int gateway_clear()
+    {
+#pragma HLS inline
+        request r;
+        r.command = CMD_CLEAR;
+        int result;
+        return gateway_request(r, &result);
+    }
+
+    /* Read or write the entry of flow ID address + 1 */
+    int gateway_debug_command(int address, bool write, maybe_value_t& entry)
+    {
+#pragma HLS inline
+        if (address < 0 || address >= int(capacity))
+            return GW_FAIL;
+
+        request r;
+        r.command = write ? CMD_WRITE : CMD_READ;
+        r.id = address + 1;
+        r.valid = write && entry.valid();
+        if (r.valid)
+            std::tie(r.key, r.value) = entry.value();
+
+        int result;
+        int ret = gateway_request(r, &result);
+        if (ret != GW_DONE)
+            return ret;
+        if (write)
+            return result ? GW_DONE : GW_FAIL;
+        entry = gateway_entry;
+        return GW_DONE;
+    }
+
+    /* Independent Toeplitz hashes for the two halves. Unlike multiplicative
+     * hashes they need no DSPs or carry chains, so both buckets are
+     * computed in the lookup's first pipeline stage. */
+    static bucket_t hash(const Key& key, int half)
+    {
+#pragma HLS inline
+        static const ap_uint<160> keys[2] = {
+            ap_uint<160>("0x9e3779b97f4a7c15f39cc0605cedc8341082276b"),
+            ap_uint<160>("0xbf58476d1ce4e5b94d49e8f6a8a2d1c37b3a96c1"),
+        };
+        const ap_uint<32> h = toeplitz_hash(ntl::pack<Key>::to_int(key), keys[half]);
+
+        return h ^ (h >> 16);
+    }
+
+private:
+    enum command_t {
+        CMD_ADD, CMD_DELETE, CMD_READ, CMD_WRITE, CMD_SET_AGING, CMD_CLEAR, CMD_SYNC
+    };
+
+    struct request {
+        command_t command;
+        Key key;
+        Value value;
+        id_t id;
+        bool valid;
+        bool staged;
+        bank_t bank;
+        timestamp_t timeout;
+        ap_uint<32> tick;
+    };
+
+    struct response {
+        int result;
+        maybe_value_t entry;
+    };
+
+    struct entry_t {
+        Key key;
+        Value value;
+        id_t id;
+        epoch_t epoch;
+        /* One bit per bank the entry belongs to. Zero for empty positions. */
+        ap_uint<2> banks;
+
+        entry_t() : id(0), epoch(0), banks(0) {}
+        entry_t(const Key& key, const Value& value, id_t id, epoch_t epoch, ap_uint<2> banks) :
+            key(key), value(value), id(id), epoch(epoch), banks(banks)
+        {}
+
+        /* Whether the position is taken, in any bank */
+        bool used(epoch_t cur) const { return banks != 0 && epoch == cur; }
+        bool live(epoch_t cur, bank_t bank) const { return banks[bank] && epoch == cur; }
+        bool match(const Key& k, epoch_t cur, bank_t bank) const
+        {
+            return live(cur, bank) && key == k;
+        }
+    };
+
+    static location_t make_location(int half, bucket_t bucket, way_t way)
+    {
+        return (half * buckets + bucket) * Ways + way;
+    }
+
+    lookup_result_t lookup(const Key& key, bank_t bank)
+    {
+#pragma HLS inline
+        bucket_t b[2] = { hash(key, 0), hash(key, 1) };
+        bool found = false;
+        entry_t e;
+
+        for (int half = 0; half < 2; ++half) {
+#pragma HLS unroll
+            for (int w = 0; w < Ways; ++w) {
+#pragma HLS unroll
+                entry_t candidate = table[half][w][b[half]];
+                if (candidate.match(key, epoch, bank)) {
+                    found = true;
+                    e = candidate;
+                }
+            }
+        }
+        const int stash_index = stash.find(key, epoch, bank);
+        if (stash_index >= 0) {
+            found = true;
+            e = stash[stash_index];
+        }
+        /* Entries in flight between buckets */
+        if (state == CTRL_WRITE && write_entry.match(key, epoch, bank)) {
+            found = true;
+            e = write_entry;
+        }
+        if (displacing && displaced.match(key, epoch, bank)) {
+            found = true;
+            e = displaced;
+        }
+
+        if (found)
+            sweeper.touch(e.id);
+
+        return ntl::make_maybe(found, std::make_tuple(e.id, e.value));
+    }
+
+    void control()
+    {
+#pragma HLS inline
+        switch (state) {
+        case CTRL_IDLE:
+            if (syncing) {
+                /* Updates wait for the copy, and the copy waits for lookups
+                 * of the previous bank to drain */
+                if (lookups.empty() || last_lookup_bank == active)
+                    state = CTRL_SYNC;
+                break;
+            }
+            if (requests.empty() || responses.full()) {
+                if (scrubbing) {
+                    state = CTRL_SCRUB;
+                } else if (sweeper.enabled() && !evictions.full()) {
+                    sweep_location = location[sweeper.current() - 1];
+                    state = CTRL_SWEEP;
+                }
+                break;
+            }
+            cur = requests.read();
+            switch (cur.command) {
+            case CMD_ADD:
+                add();
+                break;
+            case CMD_DELETE:
+                remove();
+                break;
+            case CMD_READ:
+            case CMD_WRITE:
+                debug_location = location[cur.id - 1];
+                state = CTRL_DEBUG;
+                break;
+            case CMD_SET_AGING:
+                sweeper.configure(cur.timeout, cur.tick);
+                reply.result = 0;
+                responses.write(reply);
+                break;
+            case CMD_CLEAR:
+                if (scrubbing) {
+                    clear_pending = true;
+                    state = CTRL_SCRUB;
+                } else {
+                    clear();
+                }
+                break;
+            case CMD_SYNC:
+                active = cur.bank;
+                syncing = true;
+                sync_location = 0;
+                reply.result = 0;
+                responses.write(reply);
+                break;
+            }
+            break;
+        case CTRL_WRITE:
+            table[write_half][write_way][write_bucket] = write_entry;
+            if (write_entry.banks)
+                location[write_entry.id - 1] = make_location(write_half, write_bucket, write_way);
+            if (respond) {
+                responses.write(reply);
+                respond = false;
+            }
+            state = displacing ? CTRL_DISPLACE : CTRL_IDLE;
+            break;
+        case CTRL_DISPLACE:
+            displace();
+            break;
+        case CTRL_DEBUG:
+            debug();
+            break;
+        case CTRL_SWEEP:
+            sweep();
+            break;
+        case CTRL_SCRUB:
+            for (int h = 0; h < 2; ++h) {
+#pragma HLS unroll
+                for (int w = 0; w < Ways; ++w) {
+#pragma HLS unroll
+                    scrub_entries[h][w] = table[h][w][scrub_bucket];
+                }
+            }
+            state = CTRL_SCRUB_WRITE;
+            break;
+        case CTRL_SCRUB_WRITE:
+            scrub();
+            break;
+        case CTRL_SYNC:
+            sync();
+            break;
+        }
+    }
+
+    /* The bank searched by the current update, and the banks it modifies */
+    bank_t update_bank() const
+    {
+#pragma HLS inline
+        return cur.staged ? bank_t(~active) : active;
+    }
+
+    ap_uint<2> update_banks() const
+    {
+#pragma HLS inline
+        return cur.staged ? ap_uint<2>(ap_uint<2>(1) << update_bank()) : ap_uint<2>(3);
+    }
+
+    /* Read both buckets of a key. Returns whether the key is found in the
+     * bank of the current update, with its position, and the first empty
+     * position if any. */
+    bool find(const Key& key, bucket_t b[2], entry_t entries[2][Ways],
+              int& half, way_t& way, int& empty_half, way_t& empty_way, int& stash_index)
+    {
+#pragma HLS inline
+        bool found = false;
+        empty_half = -1;
+
+        for (int h = 1; h >= 0; --h) {
+#pragma HLS unroll
+            for (int w = Ways - 1; w >= 0; --w) {
+#pragma HLS unroll
+                entries[h][w] = table[h][w][b[h]];
+                if (entries[h][w].match(key, epoch, update_bank())) {
+                    found = true;
+                    half = h;
+                    way = w;
+                }
+                if (!entries[h][w].used(epoch)) {
+                    empty_half = h;
+                    empty_way = w;
+                }
+            }
+        }
+        stash_index = stash.find(key, epoch, update_bank());
+
+        return found || stash_index >= 0;
+    }
+
+    void add()
+    {
+#pragma HLS inline
+        bucket_t b[2] = { hash(cur.key, 0), hash(cur.key, 1) };
+        entry_t entries[2][Ways];
+        int half, empty_half, stash_index;
+        way_t way, empty_way;
+
+        reply.result = 0;
+        if (find(cur.key, b, entries, half, way, empty_half, empty_way, stash_index)) {
+            responses.write(reply);
+            return;
+        }
+        /* A displacement only starts when the stash has room for the entry
+         * left homeless after MaxKicks moves, so it never fails */
+        if ((empty_half < 0 && stash.free_slot() < 0) ||
+            (free_count == 0 && next_fresh_id > capacity)) {
+            reply.result = -1;
+            responses.write(reply);
+            return;
+        }
+
+        entry_t e(cur.key, cur.value, allocate_id(), epoch, update_banks());
+        sweeper.touch(e.id);
+        if (empty_half >= 0) {
+            schedule_write(empty_half, b[empty_half], empty_way, e);
+        } else {
+            /* Take the place of an existing entry and move it */
+            const int half = victim[0];
+            const way_t way = victim >> 1;
+            displaced = entries[half][way];
+            displaced_half = half;
+            displacing = true;
+            kicks = 0;
+            schedule_write(half, b[half], way, e);
+            next_victim();
+        }
+        reply.result = e.id;
+        respond = true;
+    }
+
+    void remove()
+    {
+#pragma HLS inline
+        bucket_t b[2] = { hash(cur.key, 0), hash(cur.key, 1) };
+        entry_t entries[2][Ways];
+        int half, empty_half, stash_index;
+        way_t way, empty_way;
+
+        reply.result = 0;
+        if (!find(cur.key, b, entries, half, way, empty_half, empty_way, stash_index)) {
+            responses.write(reply);
+            return;
+        }
+
+        /* A staged deletion keeps the entry in the active bank. Its flow ID is
+         * released by the sync that drops it from both. */
+        if (stash_index >= 0) {
+            entry_t& e = stash[stash_index];
+            reply.result = e.id;
+            e.banks &= ~update_banks();
+            if (!e.banks)
+                free_id(e.id);
+            responses.write(reply);
+            return;
+        }
+
+        entry_t e = entries[half][way];
+        reply.result = e.id;
+        e.banks &= ~update_banks();
+        if (!e.banks)
+            free_id(e.id);
+        schedule_write(half, b[half], way, e);
+        respond = true;
+    }
+
+    /* Move the displaced entry to its bucket in the other half */
+    void displace()
+    {
+#pragma HLS inline
+        const int half = 1 - displaced_half;
+        const bucket_t b = hash(displaced.key, half);
+        entry_t entries[Ways];
+        int empty = -1;
+
+        for (int w = Ways - 1; w >= 0; --w) {
+#pragma HLS unroll
+            entries[w] = table[half][w][b];
+            if (!entries[w].used(epoch))
+                empty = w;
+        }
+
+        if (empty >= 0) {
+            schedule_write(half, b, empty, displaced);
+            displacing = false;
+        } else if (kicks == MaxKicks) {
+            int index = stash.free_slot();
+            stash[index] = displaced;
+            location[displaced.id - 1] = Size + index;
+            displacing = false;
+            state = CTRL_IDLE;
+        } else {
+            const way_t way = victim;
+            entry_t next = entries[way];
+            schedule_write(half, b, way, displaced);
+            displaced = next;
+            displaced_half = half;
+            ++kicks;
+            next_victim();
+        }
+    }
+
+    void debug()
+    {
+#pragma HLS inline
+        const bool in_stash = debug_location >= Size;
+        const int half = debug_location / (buckets * Ways);
+        const bucket_t b = debug_location / Ways;
+        const way_t w = debug_location;
+        entry_t e = in_stash ? stash[debug_location - Size] : table[half][w][b];
+        const bool present = e.used(epoch) && e.id == cur.id;
+
+        state = CTRL_IDLE;
+        reply.result = present;
+        reply.entry = ntl::make_maybe(present, std::make_tuple(e.key, e.value));
+        if (cur.command == CMD_READ || !present) {
+            responses.write(reply);
+            return;
+        }
+
+        if (cur.valid) {
+            e.value = cur.value;
+        } else {
+            e.banks = 0;
+            free_id(e.id);
+        }
+
+        if (in_stash) {
+            stash[debug_location - Size] = e;
+            responses.write(reply);
+        } else {
+            schedule_write(half, b, w, e);
+            respond = true;
+        }
+    }
+
+    /* Evict the entry of the current sweep ID if it has been idle too long */
+    void sweep()
+    {
+#pragma HLS inline
+        const bool in_stash = sweep_location >= Size;
+        const int half = sweep_location / (buckets * Ways);
+        const bucket_t b = sweep_location / Ways;
+        const way_t w = sweep_location;
+        entry_t e = in_stash ? stash[sweep_location - Size] : table[half][w][b];
+        const id_t id = sweeper.current();
+        const bool expired = sweeper.advance();
+
+        state = CTRL_IDLE;
+        /* Entries with staged changes are left alone, so an eviction always
+         * removes the entry from both banks */
+        if (!e.used(epoch) || e.banks != 3 || e.id != id || !expired)
+            return;
+
+        free_id(id);
+        evictions.write(id);
+        if (in_stash) {
+            stash[sweep_location - Size].banks = 0;
+        } else {
+            schedule_write(half, b, w, entry_t());
+        }
+    }
+
+    /* Flip the epoch, invalidating all entries, and start scrubbing them */
+    void clear()
+    {
+#pragma HLS inline
+        epoch = ~epoch;
+        stash.clear();
+        next_fresh_id = 1;
+        free_head = free_tail = free_count = 0;
+        sweeper.restart();
+        scrubbing = true;
+        scrub_bucket = 0;
+
+        reply.result = 0;
+        responses.write(reply);
+    }
+
+    /* Invalidate the stale entries of the bucket read by CTRL_SCRUB */
+    void scrub()
+    {
+#pragma HLS inline
+        for (int h = 0; h < 2; ++h) {
+#pragma HLS unroll
+            for (int w = 0; w < Ways; ++w) {
+#pragma HLS unroll
+                if (scrub_entries[h][w].banks && scrub_entries[h][w].epoch != epoch)
+                    table[h][w][scrub_bucket] = entry_t();
+            }
+        }
+
+        state = CTRL_IDLE;
+        if (scrub_bucket != buckets - 1) {
+            ++scrub_bucket;
+            if (clear_pending)
+                state = CTRL_SCRUB;
+            return;
+        }
+
+        scrubbing = false;
+        if (clear_pending) {
+            clear_pending = false;
+            clear();
+        }
+    }
+
+    /* Copy the active bank membership of the entry at the current sync
+     * position to the other bank */
+    void sync()
+    {
+#pragma HLS inline
+        const location_t loc = sync_location;
+        const bool in_stash = loc >= Size;
+        const int half = loc / (buckets * Ways);
+        const bucket_t b = loc / Ways;
+        const way_t w = loc;
+        entry_t e = in_stash ? stash[loc - Size] : table[half][w][b];
+        const ap_uint<2> banks = e.banks[active] ? 3 : 0;
+
+        state = CTRL_IDLE;
+        if (loc == capacity - 1)
+            syncing = false;
+        else
+            ++sync_location;
+        if (!e.used(epoch) || e.banks == banks)
+            return;
+
+        e.banks = banks;
+        if (!banks)
+            free_id(e.id);
+        if (in_stash) {
+            stash[loc - Size] = e;
+        } else {
+            schedule_write(half, b, w, e);
+        }
+    }
+
+    void schedule_write(int half, bucket_t bucket, way_t way, const entry_t& e)
+    {
+#pragma HLS inline
+        write_half = half;
+        write_bucket = bucket;
+        write_way = way;
+        write_entry = e;
+        state = CTRL_WRITE;
+    }
+
+    /* Victims are chosen pseudo-randomly, as a fixed choice tends to move
+     * the same entries back and forth */
+    void next_victim()
+    {
+#pragma HLS inline
+        victim = (victim >> 1) ^ (victim[0] ? 0xb400 : 0);
+    }
+
+    id_t allocate_id()
+    {
+#pragma HLS inline
+        if (free_count == 0)
+            return next_fresh_id++;
+
+        id_t id = free_ids[free_head];
+        free_head = free_head == capacity - 1 ? 0 : free_head + 1;
+        --free_count;
+        return id;
+    }
+
+    void free_id(id_t id)
+    {
+#pragma HLS inline
+        free_ids[free_tail] = id;
+        free_tail = free_tail == capacity - 1 ? 0 : free_tail + 1;
+        ++free_count;
+    }
+
+    int gateway_request(const request& r, int* result)
+    {
+#pragma HLS inline
+        if (!request_sent) {
+            if (requests.full())
+                return GW_BUSY;
+            requests.write(r);
+            request_sent = true;
+            return GW_BUSY;
+        }
+
+        if (responses.empty())
+            return GW_BUSY;
+
+        response resp = responses.read();
+        request_sent = false;
+        *result = resp.result;
+        gateway_entry = resp.entry;
+        return GW_DONE;
+    }
+
+    /* Gateway side state */
+    hls::stream<request> requests;
+    hls::stream<response> responses;
+    bool request_sent;
+    maybe_value_t gateway_entry;
+
+    /* Table side state */
+    entry_t table[2][Ways][buckets];
+    cuckoo_stash<entry_t, Key, StashSize> stash;
+    location_t location[capacity];
+
+    enum {
+        CTRL_IDLE, CTRL_WRITE, CTRL_DISPLACE, CTRL_DEBUG, CTRL_SWEEP,
+        CTRL_SCRUB, CTRL_SCRUB_WRITE, CTRL_SYNC
+    } state;
+    request cur;
+    response reply;
+    bool respond;
+    location_t debug_location;
+
+    /* Pending table write */
+    ap_uint<1> write_half;
+    bucket_t write_bucket;
+    way_t write_way;
+    entry_t write_entry;
+
+    /* Entry being moved to its alternate bucket */
+    entry_t displaced;
+    ap_uint<1> displaced_half;
+    bool displacing;
+    ap_uint<ntl::log2(MaxKicks) + 1> kicks;
+    /* LFSR choosing the entry to displace */
+    ap_uint<16> victim;
+
+    /* Free flow IDs. IDs that were never used are allocated from
+     * next_fresh_id, and deleted IDs are recycled through free_ids. */
+    id_t next_fresh_id;
+    id_t free_ids[capacity];
+    ap_uint<ntl::log2(capacity) + 1> free_head, free_tail, free_count;
+
+    /* Idle timeout */
+    sweeper_t sweeper;
+    location_t sweep_location;
+
+    /* Fast clear */
+    epoch_t epoch;
+    bool scrubbing;
+    bool clear_pending;
+    bucket_t scrub_bucket;
+    entry_t scrub_entries[2][Ways];
+
+    /* Versions */
+    bank_t active;
+    bank_t last_lookup_bank;
+    bool syncing;
+    location_t sync_location;
+};
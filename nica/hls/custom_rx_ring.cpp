@@ -78,10 +78,10 @@ hls_ik::axi_data custom_rx_ring::gen_bth(const ring_context& context, ap_uint<16
     len += pad_count;
     bth.flags = ap_uint<8>(pad_count) << 4;
 
-    ap_uint<256> data = (ap_uint<8>(bth.opcode), ap_uint<8>(bth.flags),
+    mlx::word data = (ap_uint<8>(bth.opcode), ap_uint<8>(bth.flags),
 		    ap_uint<16>(bth.pkey), ap_uint<8>(0),
 		    ap_uint<24>(bth.qpn),
-		    ap_uint<32>(bth.apsn), ap_uint<(32 - IB_BTH_BYTES) * 8>(0));
+		    ap_uint<32>(bth.apsn), ap_uint<(MLX_AXI4_WIDTH_BYTES - IB_BTH_BYTES) * 8>(0));
     return hls_ik::axi_data(data, hls_ik::axi_data::keep_bytes(IB_BTH_BYTES), true);
 }
 
@@ -33,14 +33,23 @@ using namespace hls_ik;
 
 using std::make_tuple;
 
-flow::flow(ap_uint<16> source_port, ap_uint<16> dest_port, ap_uint<32> saddr, ap_uint<32> daddr, vm_id_t vm_id)
-    : source_port(source_port), dest_port(dest_port), saddr(saddr), daddr(daddr), vm_id(vm_id)
+flow::flow(ap_uint<16> source_port, ap_uint<16> dest_port, ap_uint<32> saddr, ap_uint<32> daddr, vm_id_t vm_id,
+           vlan_id_t vlan_id, ap_uint<1> ipv6)
+    : source_port(source_port), dest_port(dest_port), saddr(saddr), daddr(daddr), vm_id(vm_id),
+      vlan_id(vlan_id), ipv6(ipv6)
 {
 }
 
-flow flow::from_header(const udp::header_parser& hdr, vm_id_t vm_id)
+flow flow::from_header(const udp::header_buffer& buf, vm_id_t vm_id)
 {
-    return flow(hdr.udp.source, hdr.udp.dest, hdr.ip.saddr, hdr.ip.daddr, vm_id);
+    udp::header_parser hdr = buf;
+    /* IPv6 addresses are folded by XOR-ing their 32-bit words */
+    ap_uint<32> saddr = hdr.ip.saddr ^ buf.saddr_high(31, 0) ^
+                        buf.saddr_high(63, 32) ^ buf.saddr_high(95, 64);
+    ap_uint<32> daddr = hdr.ip.daddr ^ buf.daddr_high(31, 0) ^
+                        buf.daddr_high(63, 32) ^ buf.daddr_high(95, 64);
+    return flow(hdr.udp.source, hdr.udp.dest, saddr, daddr, vm_id,
+                buf.vlan.vid(), buf.ipv6);
 }
 
 flow flow::mask(int fields)
@@ -50,7 +59,9 @@ flow flow::mask(int fields)
         (fields & FT_FIELD_DST_PORT) ? 0xffff : 0,
         (fields & FT_FIELD_SRC_IP) ? 0xffffffff : 0,
         (fields & FT_FIELD_DST_IP) ? 0xffffffff : 0,
-        (fields & FT_FIELD_VM_ID) ? 0xffffffff : 0);
+        (fields & FT_FIELD_VM_ID) ? 0xffffffff : 0,
+        (fields & FT_FIELD_VLAN_ID) ? 0xffffffff : 0,
+        (fields & (FT_FIELD_SRC_IP | FT_FIELD_DST_IP)) ? 1 : 0);
 }
 
 flow flow::operator &(const flow& mask) const
@@ -59,27 +70,25 @@ flow flow::operator &(const flow& mask) const
         source_port & mask.source_port,
         dest_port & mask.dest_port,
         saddr & mask.saddr,
-        daddr & mask.daddr);
+        daddr & mask.daddr,
+        vm_id & mask.vm_id,
+        vlan_id & mask.vlan_id,
+        ipv6 & mask.ipv6);
 }
 
 std::size_t hash_value(flow f)
 {
-#pragma HLS pipeline enable_flush ii=2
-    std::size_t seed = 0;
-
-    boost::hash_combine(seed, f.source_port.to_short());
-    boost::hash_combine(seed, f.dest_port.to_short());
-    boost::hash_combine(seed, f.saddr.to_int());
-    boost::hash_combine(seed, f.daddr.to_int());
-    boost::hash_combine(seed, f.vm_id.to_int());
+#pragma HLS inline
+    static const ap_uint<160> key(TOEPLITZ_RSS_KEY);
 
-    return seed;
+    return toeplitz_hash(ntl::pack<flow>::to_int(f), key);
 }
 
 ::std::ostream& operator<<(::std::ostream& out, const flow& v)
 {
     return out << "flow(saddr=" << v.saddr << ", sport=" << v.source_port
-               << ", daddr=" << v.daddr << ", dport=" << v.dest_port << ", vm_id=" << v.vm_id << ")";
+               << ", daddr=" << v.daddr << ", dport=" << v.dest_port << ", vm_id=" << v.vm_id
+               << ", vlan_id=" << v.vlan_id << ", ipv6=" << v.ipv6 << ")";
 }
 
 
@@ -89,19 +98,96 @@ std::size_t hash_value(flow f)
                << ", ikernel_id=" << v.ikernel_id << ")";
 }
 
+maybe<ternary_flow_table::match_t> ternary_flow_table::lookup(const flow& f, flow_table_bank_t bank) const
+{
+#pragma HLS inline
+#pragma HLS array_partition variable=rules complete dim=0
+    bool found = false;
+    rule_index_t best = 0;
+    rule_priority_t best_priority = 0;
+
+    for (int i = 0; i < FLOW_TABLE_RULES; ++i) {
+#pragma HLS unroll
+        const flow_table_rule& rule = rules[bank][i];
+        if (rule.match(f) && (!found || rule.priority > best_priority)) {
+            found = true;
+            best = i;
+            best_priority = rule.priority;
+        }
+    }
+
+    return make_maybe(found, make_tuple(best, rules[bank][best].value));
+}
+
+void ternary_flow_table::clear()
+{
+#pragma HLS inline
+    for (int b = 0; b < 2; ++b) {
+#pragma HLS unroll
+        for (int i = 0; i < FLOW_TABLE_RULES; ++i) {
+#pragma HLS unroll
+            rules[b][i].valid = false;
+        }
+    }
+}
+
+void ternary_flow_table::copy(flow_table_bank_t bank)
+{
+#pragma HLS inline
+    for (int i = 0; i < FLOW_TABLE_RULES; ++i) {
+#pragma HLS unroll
+        rules[1 - bank][i] = rules[bank][i];
+    }
+}
+
+void ternary_flow_table::set_rule(flow_table_bank_t bank, rule_index_t index,
+                                  const flow_table_rule& rule)
+{
+#pragma HLS inline
+    rules[bank][index] = rule;
+    rules[bank][index].key &= rule.mask;
+}
+
 void flow_table::ft_step(header_stream& header, result_stream& result,
-                         gateway_registers& g)
+                         counter_update_stream& counter_updates,
+                         gateway_registers& g, memory_t& mem, flow_table_stats* s)
 {
 #pragma HLS inline
-    ft_wrapper(header, result, g);
+    DO_PRAGMA(HLS STREAM variable=lookups depth=FIFO_FLOW_TABLE_PACKETS);
+    DO_PRAGMA(HLS STREAM variable=l2_pending depth=FT_L2_OUTSTANDING);
+#pragma HLS array_partition variable=batch_data complete dim=2
+    ft_wrapper(header, result, g, mem, s);
     hash_flow_table.hash_table();
+    counters.update(counter_updates);
+}
+
+l2_line_index_t flow_table::l2_line(const flow& key) const
+{
+#pragma HLS inline
+    /* Use different hash bits than the on-chip table, so that flows colliding
+     * there are spread across DRAM lines */
+    l2_line_index_t line = hash_value(key) >> FLOW_TABLE_LOG_SIZE;
+    return line & ((l2_line_index_t(1) << l2_log_size) - 1);
+}
+
+/* The high address bits an exact match checks, for the addresses FT_FIELDS
+ * selects */
+flow_addr_high_t flow_table::addr_high(const ap_uint<96>& saddr_high,
+                                       const ap_uint<96>& daddr_high, ap_uint<1> ipv6) const
+{
+#pragma HLS inline
+    const ap_uint<96> smask = ipv6 && (fields & FT_FIELD_SRC_IP) ? ~ap_uint<96>(0) : ap_uint<96>(0);
+    const ap_uint<96> dmask = ipv6 && (fields & FT_FIELD_DST_IP) ? ~ap_uint<96>(0) : ap_uint<96>(0);
+    return (saddr_high & smask, daddr_high & dmask);
 }
 
 void flow_table::ft_wrapper(header_stream& header, result_stream& result,
-                            gateway_registers& g)
+                            gateway_registers& g, memory_t& mem,
+                            flow_table_stats* s)
 {
-#pragma HLS pipeline enable_flush ii=3
+#pragma HLS pipeline enable_flush ii=1
 #pragma HLS inline region
+#pragma HLS dependence variable=flow_addr_high inter false
     gateway.gateway(g, [=](ap_uint<31> addr, int& data) -> int {
 #pragma HLS inline
         if (addr & GW_WRITE)
@@ -110,23 +196,270 @@ void flow_table::ft_wrapper(header_stream& header, result_stream& result,
             return reg_read(addr & ~GW_WRITE, &data);
     });
 
-    
-    if (!header.empty() && !hash_flow_table.lookups.full()) {
-        auto packet_flow_info = flow::from_header(header.read()) &
-                                flow::mask(fields);
-        hash_flow_table.lookups.write(packet_flow_info);
+    *s = stats;
+    ++cycle;
+
+    evicted_push();
+
+    if (l2_write_pending) {
+        mem.write(uint64_t(l2_base) + l2_gateway_index, l2_gateway_line);
+        l2_write_pending = false;
+    }
+
+    if (!header.empty() && !hash_flow_table.lookups.full() && !lookups.full()) {
+        const udp::header_buffer buf = header.read();
+        auto packet_flow_info = flow::from_header(buf);
+        packet_flow_info.vm_id = classify(packet_flow_info);
+        flow_table_lookup l;
+        l.key = packet_flow_info & flow::mask(fields);
+        l.addr_high = addr_high(buf.saddr_high, buf.daddr_high, buf.ipv6);
+        l.vm_id = packet_flow_info.vm_id;
+        l.rule = rules.lookup(packet_flow_info, active_bank);
+        hash_flow_table.lookups.write(hash_flow_table_t::lookup_request(l.key, active_bank));
+        lookups.write(l);
     }
 
-    if (!hash_flow_table.results.empty() && !result.full()) {
+    if (l2_gateway_state == L2_GW_POST) {
+        /* Gateway reads of the DRAM table are ordered with lookups through
+         * the same pending queue */
+        if (!l2_pending.full()) {
+            flow_table_pending p;
+            p.resolved = false;
+            p.gateway = true;
+            mem.post_read(uint64_t(l2_base) + l2_gateway_index);
+            l2_pending.write(p);
+            l2_gateway_state = L2_GW_WAIT;
+        }
+    } else if (!hash_flow_table.results.empty() && !lookups.empty() && !l2_pending.full()) {
         auto cur_results = hash_flow_table.results.read();
-        if (cur_results.valid()) {
-            flow_table_result res;
-            std::tie(res.flow_id, res.v) = cur_results.value();
-            result.write(res);
+        flow_table_lookup l = lookups.read();
+        flow_table_pending p;
+        p.key = l.key;
+        p.line = l2_line(l.key);
+        p.gateway = false;
+        p.resolved = true;
+        p.timestamp = cycle;
+
+        /* Wildcard rules are used only when no on-chip exact match exists.
+         * Only misses wait for the DRAM table, and only while it has
+         * entries, since results are output in order. */
+        if (l.rule.valid()) {
+            rule_index_t index;
+            std::tie(index, p.result.v) = l.rule.value();
+            p.result.flow_id = FT_RULE_FLOW_ID_BASE + index;
+        } else {
+            p.result = flow_table_result(0, vm_default[l.vm_id]);
+        }
+        p.result.vm_id = l.vm_id;
+
+        /* The key holds folded IPv6 addresses, so a hit must also match the
+         * rest of the address bits */
+        const bool hit = cur_results.valid() &&
+            flow_addr_high[std::get<0>(cur_results.value()) - 1] == l.addr_high;
+        if (hit) {
+            std::tie(p.result.flow_id, p.result.v) = cur_results.value();
+            ++stats.hits;
+        } else if (l2_log_size && l2_entries && !l.rule.valid()) {
+            mem.post_read(uint64_t(l2_base) + p.line);
+            p.resolved = false;
+            ++stats.l2_lookups;
+        } else if (l.rule.valid()) {
+            ++stats.rule_hits;
         } else {
-            result.write(flow_table_result(0, flow_table_value(FT_PASSTHROUGH)));
+            ++stats.misses;
+        }
+        l2_pending.write(p);
+    }
+
+    l2_output(result, mem);
+}
+
+/* Output results in order, completing DRAM table lookups as their lines
+ * arrive. Lookups keep being issued while earlier ones wait for DRAM. */
+void flow_table::l2_output(result_stream& result, memory_t& mem)
+{
+#pragma HLS inline
+    if (!l2_head_valid && !l2_pending.empty()) {
+        l2_pending.read(l2_head);
+        l2_head_valid = true;
+    }
+
+    if (!l2_head_valid)
+        return;
+
+    if (l2_head.resolved) {
+        if (!result.full()) {
+            result.write(l2_head.result);
+            l2_head_valid = false;
+        }
+        return;
+    }
+
+    if (!mem.has_read_response() || (!l2_head.gateway && result.full()))
+        return;
+
+    flow_table_l2_line line = mem.get_read_response();
+    l2_head_valid = false;
+
+    if (l2_head.gateway) {
+        l2_gateway_line = line;
+        l2_gateway_state = L2_GW_READY;
+        return;
+    }
+
+    flow_table_result res = l2_head.result;
+    bool found = false;
+    for (int i = 0; i < FT_L2_WAYS; ++i) {
+#pragma HLS unroll
+        if (line.entries[i].live(l2_epoch) && line.entries[i].key == l2_head.key) {
+            res = flow_table_result(FT_L2_FLOW_ID_BASE + l2_head.line * FT_L2_WAYS + i,
+                                    line.entries[i].value, l2_head.result.vm_id);
+            found = true;
+        }
+    }
+
+    ap_uint<32> latency = cycle - l2_head.timestamp;
+    stats.l2_latency_total += latency;
+    if (latency > stats.l2_latency_max)
+        stats.l2_latency_max = latency;
+    if (found)
+        ++stats.l2_hits;
+    else if (res.flow_id)
+        ++stats.rule_hits;
+    else
+        ++stats.misses;
+
+    result.write(res);
+}
+
+/* Add an entry to the on-chip table. Sets *value to the new flow ID, to zero
+ * if the key exists, or to -1 if the table is full or the VM is over its
+ * quota. */
+int flow_table::onchip_add_entry(const hash_flow_table_t::value_type& entry, int* value)
+{
+#pragma HLS inline
+    const vm_id_t vm = std::get<0>(entry).vm_id;
+    const flow_table_bank_t bank = staging ? flow_table_bank_t(~active_bank) : active_bank;
+    if (vm_used[bank][vm] >= vm_quota[vm]) {
+        *value = -1;
+        return GW_DONE;
+    }
+
+    int ret = hash_flow_table.gateway_add_entry(entry, value, staging);
+    if (ret == GW_DONE && *value > 0) {
+        flow_vm[*value - 1] = vm;
+        flow_addr_high[*value - 1] = addr_high(gateway_saddr_high, gateway_daddr_high,
+                                               std::get<0>(entry).ipv6);
+        vm_charge(vm, 1);
+    }
+    return ret;
+}
+
+/* Add an entry to the on-chip table, falling back to the DRAM table when
+ * the on-chip table is full or the VM is over its quota. With the DRAM table
+ * enabled, the key's line is read first, so that a key is never added to one
+ * level while it exists in the other. The DRAM table has a single version,
+ * so staged entries are never added to it. Its entries have no room for the
+ * high IPv6 address bits, so IPv6 flows are never added to it either. */
+int flow_table::add_entry(const hash_flow_table_t::value_type& entry, int* value)
+{
+#pragma HLS inline
+    if (!l2_log_size) {
+        int ret = onchip_add_entry(entry, value);
+        if (ret == GW_DONE && *value < 0)
+            *value = 0;
+        return ret;
+    }
+
+    if (l2_gateway_state == L2_GW_IDLE) {
+        l2_gateway_add = true;
+        std::tie(l2_gateway_key, l2_gateway_value) = entry;
+        l2_gateway_index = l2_line(l2_gateway_key);
+        l2_gateway_state = L2_GW_POST;
+        return GW_BUSY;
+    }
+
+    if (l2_gateway_state != L2_GW_READY || l2_write_pending)
+        return GW_BUSY;
+
+    int found, empty;
+    l2_gateway_find(found, empty);
+    if (found >= 0) {
+        *value = 0;
+        l2_gateway_state = L2_GW_IDLE;
+        return GW_DONE;
+    }
+
+    int ret = onchip_add_entry(entry, value);
+    if (ret != GW_DONE)
+        return ret;
+
+    if (*value < 0) {
+        *value = 0;
+        if (!staging && !l2_gateway_key.ipv6 && empty >= 0) {
+            l2_gateway_line.entries[empty] = flow_table_l2_entry(l2_gateway_key, l2_gateway_value,
+                                                                 l2_epoch, true);
+            l2_write_pending = true;
+            ++l2_entries;
+            *value = FT_L2_FLOW_ID_BASE + l2_gateway_index * FT_L2_WAYS + empty;
         }
     }
+    l2_gateway_state = L2_GW_IDLE;
+    return GW_DONE;
+}
+
+/* Delete an entry from the on-chip table, and then from the DRAM table if it
+ * is enabled, so that no copy of the key is left behind at either level */
+int flow_table::delete_entry(const flow& key, int* value)
+{
+#pragma HLS inline
+    if (l2_gateway_state == L2_GW_IDLE) {
+        int ret = hash_flow_table.gateway_delete_entry(key, value, staging);
+        if (ret == GW_DONE && *value > 0)
+            vm_charge(key.vm_id, -1);
+        if (ret != GW_DONE || !l2_log_size || staging)
+            return ret;
+
+        l2_gateway_add = false;
+        l2_gateway_result = *value;
+        l2_gateway_key = key;
+        l2_gateway_index = l2_line(l2_gateway_key);
+        l2_gateway_state = L2_GW_POST;
+        return GW_BUSY;
+    }
+
+    if (l2_gateway_state != L2_GW_READY || l2_write_pending)
+        return GW_BUSY;
+
+    int found, empty;
+    l2_gateway_find(found, empty);
+    *value = l2_gateway_result;
+    if (found >= 0) {
+        l2_gateway_line.entries[found].valid = false;
+        l2_write_pending = true;
+        --l2_entries;
+        if (*value <= 0)
+            *value = FT_L2_FLOW_ID_BASE + l2_gateway_index * FT_L2_WAYS + found;
+    }
+    l2_gateway_state = L2_GW_IDLE;
+    return GW_DONE;
+}
+
+/* Find the gateway key in the DRAM table line that ft_wrapper has read, and
+ * the first free entry of the line */
+void flow_table::l2_gateway_find(int& found, int& empty)
+{
+#pragma HLS inline
+    found = -1;
+    empty = -1;
+    for (int i = FT_L2_WAYS - 1; i >= 0; --i) {
+#pragma HLS unroll
+        const flow_table_l2_entry& e = l2_gateway_line.entries[i];
+        if (e.live(l2_epoch) && e.key == l2_gateway_key)
+            found = i;
+        if (!e.live(l2_epoch))
+            empty = i;
+    }
 }
 
 int flow_table::reg_write(int address, int value)
@@ -134,6 +467,7 @@ int flow_table::reg_write(int address, int value)
 #pragma HLS inline
 
     maybe<std::tuple<flow, flow_table_value> > entry;
+    flow_table_rule rule;
 
     switch (address) {
     case FT_FIELDS:
@@ -151,6 +485,53 @@ int flow_table::reg_write(int address, int value)
     case FT_KEY_DPORT:
         gateway_flow.dest_port = value;
         break;
+    case FT_KEY_VM_ID:
+        gateway_flow.vm_id = value;
+        break;
+    case FT_MASK_VM_ID:
+        gateway_mask.vm_id = value;
+        break;
+    case FT_KEY_VLAN_ID:
+        gateway_flow.vlan_id = value;
+        break;
+    case FT_MASK_VLAN_ID:
+        gateway_mask.vlan_id = value;
+        break;
+    case FT_KEY_IPV6:
+        gateway_flow.ipv6 = value;
+        break;
+    case FT_MASK_IPV6:
+        gateway_mask.ipv6 = value;
+        break;
+    case FT_KEY_SADDR_HIGH:
+    case FT_KEY_SADDR_HIGH + 1:
+    case FT_KEY_SADDR_HIGH + 2: {
+        const int lsb = 32 * (FT_KEY_SADDR_HIGH + 2 - address);
+        gateway_saddr_high(lsb + 31, lsb) = value;
+        break;
+    }
+    case FT_KEY_DADDR_HIGH:
+    case FT_KEY_DADDR_HIGH + 1:
+    case FT_KEY_DADDR_HIGH + 2: {
+        const int lsb = 32 * (FT_KEY_DADDR_HIGH + 2 - address);
+        gateway_daddr_high(lsb + 31, lsb) = value;
+        break;
+    }
+    case FT_MASK_SADDR:
+        gateway_mask.saddr = value;
+        break;
+    case FT_MASK_DADDR:
+        gateway_mask.daddr = value;
+        break;
+    case FT_MASK_SPORT:
+        gateway_mask.source_port = value;
+        break;
+    case FT_MASK_DPORT:
+        gateway_mask.dest_port = value;
+        break;
+    case FT_RULE_PRIORITY:
+        gateway_priority = value;
+        break;
     case FT_RESULT_ACTION:
         gateway_result.action = flow_table_action(value);
         break;
@@ -163,18 +544,138 @@ int flow_table::reg_write(int address, int value)
     case FT_VALID:
         gateway_valid = value;
         break;
-    case FT_SET_ENTRY:
+    case FT_SET_ENTRY: {
         entry = make_maybe(gateway_valid, make_tuple(gateway_flow, gateway_result));
-        return hash_flow_table.gateway_debug_command(value, true, entry);
+        int ret = hash_flow_table.gateway_debug_command(value, true, entry);
+        if (ret == GW_DONE && !gateway_valid)
+            vm_charge(flow_vm[value], -1);
+        if (ret == GW_DONE && gateway_valid)
+            flow_addr_high[value] = addr_high(gateway_saddr_high, gateway_daddr_high,
+                                              gateway_flow.ipv6);
+        return ret;
+    }
     case FT_READ_ENTRY: {
 	int ret = hash_flow_table.gateway_debug_command(value, false, entry);
         if (ret == GW_DONE) {
             gateway_valid = entry.valid();
-            if (entry.valid())
+            if (entry.valid()) {
                 std::tie(gateway_flow, gateway_result) = entry.value();
+                gateway_saddr_high = flow_addr_high[value](191, 96);
+                gateway_daddr_high = flow_addr_high[value](95, 0);
+            }
         }
         return ret;
     }
+    case FT_SET_RULE:
+        if (value < 0 || value >= FLOW_TABLE_RULES)
+            return GW_FAIL;
+        rule.key = gateway_flow;
+        rule.mask = gateway_mask;
+        rule.priority = gateway_priority;
+        rule.value = gateway_result;
+        rule.valid = gateway_valid;
+        if (!staging)
+            rules.set_rule(active_bank, value, rule);
+        rules.set_rule(flow_table_bank_t(~active_bank), value, rule);
+        break;
+    case FT_L2_LOG_SIZE:
+        if (value < 0 || value > FT_L2_MAX_LOG_SIZE)
+            return GW_FAIL;
+        l2_log_size = value;
+        break;
+    case FT_L2_BASE:
+        l2_base = value;
+        break;
+    case FT_COUNTER_INDEX:
+        if (value < 0 || value >= FT_TOTAL_COUNTERS)
+            return GW_FAIL;
+        counter_index = value;
+        counter_word = 0;
+        break;
+    case FT_COUNTER_CLEAR_ON_READ:
+        counter_clear_on_read = value;
+        break;
+    case FT_AGING_TIMEOUT:
+        if (value < 0 || value >= 1 << FT_AGING_MAX_LOG_TIMEOUT)
+            return GW_FAIL;
+        return set_aging(value, aging_tick);
+    case FT_AGING_TICK:
+        if (value <= 0)
+            return GW_FAIL;
+        return set_aging(aging_timeout, value);
+    case FT_SHADOW:
+        if (staging && !value) {
+            /* Drop the staged updates */
+            int ret = sync(active_bank);
+            if (ret != GW_DONE)
+                return ret;
+        }
+        staging = value;
+        break;
+    case FT_VM_INDEX:
+        if (value < 0 || value >= FT_VMS)
+            return GW_FAIL;
+        vm_index = value;
+        break;
+    case FT_VM_ADDR:
+        vm_addr[vm_index] = value;
+        break;
+    case FT_VM_MATCH_SOURCE:
+        vm_match_source = value;
+        break;
+    case FT_VM_QUOTA:
+        if (value < 0 || value > FLOW_TABLE_CAPACITY)
+            return GW_FAIL;
+        vm_quota[vm_index] = value;
+        break;
+    case FT_VM_DEFAULT:
+        vm_default[vm_index] = gateway_result;
+        break;
+    case FT_BATCH_RESET:
+        batch_words = 0;
+        batch_cursor = 0;
+        batch_running = false;
+        break;
+    case FT_BATCH_DATA:
+        if (batch_words >= FT_BATCH_SIZE * FT_BATCH_ENTRY_WORDS)
+            return GW_FAIL;
+        batch_data[batch_words / FT_BATCH_ENTRY_WORDS][batch_words % FT_BATCH_ENTRY_WORDS] = value;
+        ++batch_words;
+        break;
+    case FT_BATCH_RESULT:
+        if (batch_running || value < 0 || value >= batch_words / FT_BATCH_ENTRY_WORDS)
+            return GW_FAIL;
+        batch_cursor = value;
+        break;
+    case FT_POLICER_RATE:
+        if (value < 0 || value >= 1 << 16)
+            return GW_FAIL;
+        gateway_policer.rate = value;
+        break;
+    case FT_POLICER_BURST:
+        gateway_policer.burst = value;
+        break;
+    case FT_POLICER_EXCEED_ACTION:
+        if (value != FT_DROP && value != FT_PASSTHROUGH)
+            return GW_FAIL;
+        gateway_policer.exceed_action = flow_table_action(value);
+        break;
+    case FT_SET_POLICER:
+        if (value < 0 || value >= FT_COUNTERS)
+            return GW_FAIL;
+        if (gateway_policer.rate && gateway_policer.burst < FT_POLICER_MIN_BURST)
+            return GW_FAIL;
+        return policers.gateway_set(value, gateway_policer);
+    case FT_READ_RULE:
+        if (value < 0 || value >= FLOW_TABLE_RULES)
+            return GW_FAIL;
+        rule = rules.get_rule(staging ? flow_table_bank_t(~active_bank) : active_bank, value);
+        gateway_flow = rule.key;
+        gateway_mask = rule.mask;
+        gateway_priority = rule.priority;
+        gateway_result = rule.value;
+        gateway_valid = rule.valid;
+        break;
     default:
         return GW_FAIL;
     }
@@ -201,6 +702,53 @@ int flow_table::reg_read(int address, int* value)
     case FT_KEY_DPORT:
         *value = gateway_flow.dest_port;
         break;
+    case FT_KEY_VM_ID:
+        *value = gateway_flow.vm_id;
+        break;
+    case FT_MASK_VM_ID:
+        *value = gateway_mask.vm_id;
+        break;
+    case FT_KEY_VLAN_ID:
+        *value = gateway_flow.vlan_id;
+        break;
+    case FT_MASK_VLAN_ID:
+        *value = gateway_mask.vlan_id;
+        break;
+    case FT_KEY_IPV6:
+        *value = gateway_flow.ipv6;
+        break;
+    case FT_MASK_IPV6:
+        *value = gateway_mask.ipv6;
+        break;
+    case FT_KEY_SADDR_HIGH:
+    case FT_KEY_SADDR_HIGH + 1:
+    case FT_KEY_SADDR_HIGH + 2: {
+        const int lsb = 32 * (FT_KEY_SADDR_HIGH + 2 - address);
+        *value = gateway_saddr_high(lsb + 31, lsb);
+        break;
+    }
+    case FT_KEY_DADDR_HIGH:
+    case FT_KEY_DADDR_HIGH + 1:
+    case FT_KEY_DADDR_HIGH + 2: {
+        const int lsb = 32 * (FT_KEY_DADDR_HIGH + 2 - address);
+        *value = gateway_daddr_high(lsb + 31, lsb);
+        break;
+    }
+    case FT_MASK_SADDR:
+        *value = gateway_mask.saddr;
+        break;
+    case FT_MASK_DADDR:
+        *value = gateway_mask.daddr;
+        break;
+    case FT_MASK_SPORT:
+        *value = gateway_mask.source_port;
+        break;
+    case FT_MASK_DPORT:
+        *value = gateway_mask.dest_port;
+        break;
+    case FT_RULE_PRIORITY:
+        *value = gateway_priority;
+        break;
     case FT_RESULT_ACTION:
         *value = gateway_result.action;
         break;
@@ -214,9 +762,96 @@ int flow_table::reg_read(int address, int* value)
         *value = gateway_valid;
         break;
     case FT_ADD_FLOW:
-        return hash_flow_table.gateway_add_entry(make_tuple(gateway_flow, gateway_result), value);
+        return add_entry(make_tuple(gateway_flow, gateway_result), value);
     case FT_DELETE_FLOW:
-        return hash_flow_table.gateway_delete_entry(gateway_flow, value);
+        return delete_entry(gateway_flow, value);
+    case FT_CLEAR:
+        *value = 0;
+        return clear();
+    case FT_SHADOW:
+        *value = staging;
+        break;
+    case FT_COMMIT:
+        if (!staging)
+            goto err;
+        *value = 0;
+        return sync(flow_table_bank_t(~active_bank));
+    case FT_L2_LOG_SIZE:
+        *value = l2_log_size;
+        break;
+    case FT_L2_BASE:
+        *value = l2_base;
+        break;
+    case FT_COUNTER_INDEX:
+        *value = counter_index;
+        break;
+    case FT_COUNTER_DATA:
+        return read_counter(value);
+    case FT_COUNTER_CLEAR_ON_READ:
+        *value = counter_clear_on_read;
+        break;
+    case FT_COUNTER_CLEAR_ALL:
+        *value = 0;
+        return clear_counters();
+    case FT_AGING_TIMEOUT:
+        *value = aging_timeout;
+        break;
+    case FT_AGING_TICK:
+        *value = aging_tick;
+        break;
+    case FT_EVICTED:
+        *value = 0;
+        if (evicted_count) {
+            *value = evicted[evicted_head++];
+            --evicted_count;
+        }
+        break;
+    case FT_VM_INDEX:
+        *value = vm_index;
+        break;
+    case FT_VM_ADDR:
+        *value = vm_addr[vm_index];
+        break;
+    case FT_VM_MATCH_SOURCE:
+        *value = vm_match_source;
+        break;
+    case FT_VM_QUOTA:
+        *value = vm_quota[vm_index];
+        break;
+    case FT_VM_USED:
+        *value = vm_used[staging ? flow_table_bank_t(~active_bank) : active_bank][vm_index];
+        break;
+    case FT_VM_DEFAULT:
+        gateway_result = vm_default[vm_index];
+        *value = 0;
+        break;
+    case FT_POLICER_RATE:
+        *value = gateway_policer.rate;
+        break;
+    case FT_POLICER_BURST:
+        *value = gateway_policer.burst;
+        break;
+    case FT_POLICER_EXCEED_ACTION:
+        *value = gateway_policer.exceed_action;
+        break;
+    case FT_BATCH_ADD:
+        return batch_command(true, value);
+    case FT_BATCH_DELETE:
+        return batch_command(false, value);
+    case FT_BATCH_DATA:
+        *value = batch_words;
+        break;
+    case FT_BATCH_RESULT:
+        if (batch_running || batch_cursor >= batch_words / FT_BATCH_ENTRY_WORDS)
+            goto err;
+        *value = batch_results[batch_cursor++];
+        break;
+    case FT_BATCH_TAGGED_RESULT:
+        if (batch_running || batch_cursor >= batch_words / FT_BATCH_ENTRY_WORDS)
+            goto err;
+        *value = (batch_cursor + 1) << FLOW_ID_WIDTH | batch_results[batch_cursor];
+        ++batch_cursor;
+        break;
     default:
         goto err;
     }
@@ -228,11 +863,386 @@ err:
     return GW_FAIL;
 }
 
+hash_flow_table_t::value_type flow_table::batch_entry(int index)
+{
+#pragma HLS inline
+    ap_uint<32> saddr = batch_data[index][0],
+                daddr = batch_data[index][1],
+                ports = batch_data[index][2],
+                result = batch_data[index][3];
+
+    return make_tuple(flow(ports(31, 16), ports(15, 0), saddr, daddr, gateway_flow.vm_id,
+                           gateway_flow.vlan_id, gateway_flow.ipv6),
+                      flow_table_value(flow_table_action(int(result(7, 0))),
+                                       result(15, 8), result(31, 16)));
+}
+
+/* Apply one batched entry per call, returning GW_BUSY so that the gateway
+ * calls again until the whole batch has been applied. */
+int flow_table::batch_command(bool add, int* value)
+{
+#pragma HLS inline
+    if (!batch_running) {
+        batch_running = true;
+        batch_cursor = 0;
+        batch_succeeded = 0;
+    }
+
+    if (batch_cursor < batch_words / FT_BATCH_ENTRY_WORDS) {
+        hash_flow_table_t::value_type entry = batch_entry(batch_cursor);
+        int result;
+        int ret = add ? add_entry(entry, &result) :
+                        delete_entry(std::get<0>(entry), &result);
+        if (ret == GW_BUSY)
+            return GW_BUSY;
+        if (ret != GW_DONE || result == -1)
+            result = 0;
+        batch_results[batch_cursor] = result;
+        if (result)
+            ++batch_succeeded;
+        ++batch_cursor;
+        return GW_BUSY;
+    }
+
+    batch_running = false;
+    batch_cursor = 0;
+    *value = batch_succeeded;
+    return GW_DONE;
+}
+
+int flow_table::read_counter(int* value)
+{
+#pragma HLS inline
+    if (counter_word == 0) {
+        int ret = counters.gateway_read(counter_index, counter_clear_on_read, counter_snapshot);
+        if (ret != GW_DONE)
+            return ret;
+    }
+
+    switch (counter_word) {
+    case 0:
+        *value = counter_snapshot.packets;
+        break;
+    case 1:
+        *value = counter_snapshot.bytes(31, 0);
+        break;
+    default:
+        *value = counter_snapshot.bytes(47, 32);
+        break;
+    }
+
+    if (++counter_word == FT_COUNTER_WORDS) {
+        counter_word = 0;
+        counter_index = counter_index == FT_TOTAL_COUNTERS - 1 ? 0 : counter_index + 1;
+    }
+    return GW_DONE;
+}
+
+/* Clear one counter per call, returning GW_BUSY until all are cleared */
+int flow_table::clear_counters()
+{
+#pragma HLS inline
+    if (counter_clear_cursor < FT_TOTAL_COUNTERS) {
+        flow_counter c;
+        if (counters.gateway_read(counter_clear_cursor, true, c) == GW_DONE)
+            ++counter_clear_cursor;
+        return GW_BUSY;
+    }
+
+    counter_clear_cursor = 0;
+    counter_index = 0;
+    counter_word = 0;
+    return GW_DONE;
+}
+
+int flow_table::set_aging(int timeout, int tick)
+{
+#pragma HLS inline
+    int ret = hash_flow_table.gateway_set_aging(timeout, tick);
+    if (ret == GW_DONE) {
+        aging_timeout = timeout;
+        aging_tick = tick;
+    }
+    return ret;
+}
+
+int flow_table::clear()
+{
+#pragma HLS inline
+    if (l2_gateway_state != L2_GW_IDLE)
+        return GW_BUSY;
+
+    int ret = hash_flow_table.gateway_clear();
+    if (ret != GW_DONE)
+        return ret;
+
+    rules.clear();
+    ++l2_epoch;
+    l2_entries = 0;
+    for (int i = 0; i < FT_VMS; ++i)
+        vm_used[0][i] = vm_used[1][i] = 0;
+    evicted_head = evicted_tail = evicted_count = 0;
+    return GW_DONE;
+}
+
+/* Make a bank active and copy it over the other one. Packets classified
+ * from the next cycle on use the new bank, while the hash table keeps the
+ * old one until their earlier lookups are done. Wildcard rules are looked up
+ * before the packet is queued, so they are copied right away. Called
+ * repeatedly with the same bank until done. */
+int flow_table::sync(flow_table_bank_t bank)
+{
+#pragma HLS inline
+    active_bank = bank;
+    rules.copy(bank);
+    int ret = hash_flow_table.gateway_sync(bank);
+    if (ret == GW_DONE) {
+        for (int i = 0; i < FT_VMS; ++i)
+            vm_used[1 - bank][i] = vm_used[bank][i];
+    }
+    return ret;
+}
+
+/* The VM of the first FT_VM_ADDR matching the packet, or VM 0 */
+vm_id_t flow_table::classify(const flow& f) const
+{
+#pragma HLS inline
+#pragma HLS array_partition variable=vm_addr complete
+    const ap_uint<32> addr = vm_match_source ? f.saddr : f.daddr;
+    vm_id_t vm = 0;
+
+    for (int i = FT_VMS - 1; i >= 0; --i) {
+#pragma HLS unroll
+        if (vm_addr[i] != 0 && vm_addr[i] == addr)
+            vm = i;
+    }
+    return vm;
+}
+
+/* Account for an on-chip entry added or removed by the gateway, in the
+ * versions it affects */
+void flow_table::vm_charge(vm_id_t vm, int delta)
+{
+#pragma HLS inline
+    if (!staging)
+        vm_used[active_bank][vm] += delta;
+    vm_used[flow_table_bank_t(~active_bank)][vm] += delta;
+}
+
+/* Keep the flow IDs evicted by the hash table for the host to read */
+void flow_table::evicted_push()
+{
+#pragma HLS inline
+    /* While the queue is full, evictions are left unread, which stops the
+     * sweeper until the host reads some */
+    if (hash_flow_table.evictions.empty() || evicted_count == FT_EVICTED_SIZE)
+        return;
+
+    hash_flow_table_t::id_t id = hash_flow_table.evictions.read();
+    ++stats.evictions;
+    /* Only entries present in both versions are evicted */
+    const vm_id_t vm = flow_vm[id - 1];
+    --vm_used[0][vm];
+    --vm_used[1][vm];
+    evicted[evicted_tail++] = id;
+    ++evicted_count;
+}
+
+flow_counters::flow_counters() :
+    request_sent(false),
+    last_index(FT_COUNTERS),
+    last_vm_valid(false)
+{
+}
+
+void flow_counters::update(counter_update_stream& updates)
+{
+#pragma HLS pipeline enable_flush ii=1
+#pragma HLS dependence variable=counters inter false
+#pragma HLS dependence variable=vm_counters inter false
+    flow_id_t index = 0;
+    vm_id_t vm = 0;
+    ap_uint<16> length = 0;
+    bool gateway = false, clear = false, per_flow = false, per_vm = false;
+
+    if (!updates.empty()) {
+        flow_counter_update u = updates.read();
+        index = u.flow_id;
+        vm = u.vm_id;
+        length = u.length;
+        per_flow = u.flow_id < FT_COUNTERS;
+        per_vm = true;
+    } else if (!requests.empty() && !responses.full()) {
+        request r = requests.read();
+        index = r.index;
+        vm = r.index - FT_VM_COUNTER_BASE;
+        clear = r.clear;
+        gateway = true;
+        per_flow = r.index < FT_COUNTERS;
+        per_vm = !per_flow;
+    } else {
+        return;
+    }
+
+    if (per_flow) {
+        flow_counter c = index == last_index ? last : counters[index];
+        if (gateway) {
+            responses.write(c);
+            if (clear)
+                c = flow_counter();
+        } else {
+            ++c.packets;
+            c.bytes += length;
+        }
+        counters[index] = c;
+        last_index = index;
+        last = c;
+    }
+
+    if (per_vm) {
+        flow_counter c = last_vm_valid && vm == last_vm ? last_vm_counter : vm_counters[vm];
+        if (gateway) {
+            responses.write(c);
+            if (clear)
+                c = flow_counter();
+        } else {
+            ++c.packets;
+            c.bytes += length;
+        }
+        vm_counters[vm] = c;
+        last_vm = vm;
+        last_vm_valid = true;
+        last_vm_counter = c;
+    }
+}
+
+int flow_counters::gateway_read(int index, bool clear, flow_counter& value)
+{
+#pragma HLS inline
+    if (!request_sent) {
+        if (requests.full())
+            return GW_BUSY;
+        request r;
+        r.index = index;
+        r.clear = clear;
+        requests.write(r);
+        request_sent = true;
+        return GW_BUSY;
+    }
+
+    if (responses.empty())
+        return GW_BUSY;
+
+    value = responses.read();
+    request_sent = false;
+    return GW_DONE;
+}
+
+flow_policers::flow_policers() :
+    last_index(FT_COUNTERS),
+    now(0)
+{
+}
+
+void flow_policers::update()
+{
+#pragma HLS inline
+    ++now;
+
+    if (requests.empty())
+        return;
+
+    request r = requests.read();
+    r.p.tokens = ap_uint<32 + FT_POLICER_LOG_TICK>(r.p.burst) << FT_POLICER_LOG_TICK;
+    r.p.last = now;
+    policers[r.index] = r.p;
+    last_index = r.index;
+    last = r.p;
+}
+
+bool flow_policers::police(flow_id_t flow_id, ap_uint<16> length,
+                           flow_table_action& exceed_action)
+{
+#pragma HLS inline
+#pragma HLS dependence variable=policers inter false
+    ++now;
+
+    if (flow_id >= FT_COUNTERS)
+        return false;
+
+    flow_policer p = flow_id == last_index ? last : policers[flow_id];
+    if (p.rate == 0)
+        return false;
+
+    /* Refill by the cycles elapsed since the last packet, up to the burst */
+    ap_uint<32> elapsed = now - p.last;
+    ap_uint<32 + FT_POLICER_LOG_TICK> max = ap_uint<32 + FT_POLICER_LOG_TICK>(p.burst) << FT_POLICER_LOG_TICK;
+    ap_uint<64> tokens = p.tokens + ap_uint<64>(elapsed) * p.rate;
+    if (tokens > max)
+        tokens = max;
+
+    ap_uint<16 + FT_POLICER_LOG_TICK> cost = ap_uint<16 + FT_POLICER_LOG_TICK>(length) << FT_POLICER_LOG_TICK;
+    bool exceed = tokens < cost;
+    if (!exceed)
+        tokens -= cost;
+
+    p.tokens = tokens;
+    p.last = now;
+    policers[flow_id] = p;
+    last_index = flow_id;
+    last = p;
+
+    exceed_action = p.exceed_action;
+    return exceed;
+}
+
+int flow_policers::gateway_set(flow_id_t flow_id, const flow_policer& p)
+{
+#pragma HLS inline
+    if (requests.full())
+        return GW_BUSY;
+
+    request r;
+    r.index = flow_id;
+    r.p = p;
+    requests.write(r);
+    return GW_DONE;
+}
+
 void flow_table::reset()
 {
     fields = 0;
-
-    // TODO reset table
+    gateway_saddr_high = gateway_daddr_high = 0;
+    batch_words = 0;
+    batch_cursor = 0;
+    batch_running = false;
+    l2_log_size = 0;
+    l2_base = 0;
+    l2_epoch = 0;
+    l2_entries = 0;
+    l2_head_valid = false;
+    l2_gateway_state = L2_GW_IDLE;
+    l2_write_pending = false;
+    counter_index = 0;
+    counter_word = 0;
+    counter_clear_on_read = false;
+    counter_clear_cursor = 0;
+    gateway_policer = flow_policer();
+    aging_timeout = 0;
+    aging_tick = FT_AGING_DEFAULT_TICK;
+    evicted_head = evicted_tail = evicted_count = 0;
+    active_bank = 0;
+    staging = false;
+    vm_match_source = false;
+    vm_index = 0;
+    for (int i = 0; i < FT_VMS; ++i) {
+        vm_addr[i] = 0;
+        vm_quota[i] = FLOW_TABLE_CAPACITY;
+        vm_used[0][i] = vm_used[1][i] = 0;
+        vm_default[i] = flow_table_value(FT_PASSTHROUGH);
+    }
+    cycle = 0;
+    stats = flow_table_stats();
 }
 
 void flow_table::gateway_update()
@@ -241,12 +1251,14 @@ void flow_table::gateway_update()
 
 /* Just for testing synthesis results faster */
 void flow_table_top(header_stream& header, result_stream& result,
-                    gateway_registers& g)
+                    counter_update_stream& counter_updates,
+                    gateway_registers& g, memory_t& mem, flow_table_stats* stats)
 {
 #pragma HLS dataflow
     GATEWAY_OFFSET(g, 0x18, 0x28, 0x20);
+    NTL_MEMORY_INTERFACE_PRAGMA(mem)
     static flow_table ft;
 
-    ft.ft_step(header, result, g);
+    ft.ft_step(header, result, counter_updates, g, mem, stats);
 }
 
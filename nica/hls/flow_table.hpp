@@ -29,6 +29,8 @@ enum flow_table_action {
     FT_PASSTHROUGH = 0,
     FT_DROP = 1,
     FT_IKERNEL = 2,
+    /* Send to one of the engines of the replica group in the engine field */
+    FT_REPLICA_GROUP = 3,
 };
 
 enum flow_table_fields {
@@ -37,11 +39,46 @@ enum flow_table_fields {
     FT_FIELD_SRC_PORT = 1 << 2,
     FT_FIELD_DST_PORT = 1 << 3,
     FT_FIELD_VM_ID = 1 << 4,
+    FT_FIELD_VLAN_ID = 1 << 5,
 };
 
 #define FLOW_TABLE_LOG_SIZE 10
 #define FLOW_TABLE_SIZE (1 << FLOW_TABLE_LOG_SIZE)
 
+/* The exact match table is a two-way cuckoo hash table: every flow has one
+ * candidate bucket in each half of the table, each bucket holding
+ * FT_CUCKOO_WAYS entries. Flows that cannot be placed after
+ * FT_CUCKOO_MAX_KICKS displacements are kept in a small stash. */
+#define FT_CUCKOO_WAYS 4
+#define FT_CUCKOO_MAX_KICKS 64
+#define FT_STASH_SIZE 4
+/* Number of exact match flow IDs: 1 .. FLOW_TABLE_CAPACITY */
+#define FLOW_TABLE_CAPACITY (FLOW_TABLE_SIZE + FT_STASH_SIZE)
+
+/* Wildcard rules are matched in parallel to the exact match hash table. A
+ * packet that misses the hash table gets the value of the highest priority
+ * rule it matches. Rule flow IDs follow the hash table flow IDs:
+ * FT_RULE_FLOW_ID_BASE + rule index. */
+#define FLOW_TABLE_RULES_LOG_SIZE 4
+#define FLOW_TABLE_RULES (1 << FLOW_TABLE_RULES_LOG_SIZE)
+#define FT_RULE_FLOW_ID_BASE (FLOW_TABLE_CAPACITY + 1)
+
+/* Second-level table in DRAM, used for flows that do not fit the on-chip
+ * table. Each 512-bit line holds FT_L2_WAYS entries. Its flow IDs start at
+ * FT_L2_FLOW_ID_BASE + line * FT_L2_WAYS + way. */
+#define FT_L2_MAX_LOG_SIZE 16
+#define FT_L2_WAYS 3
+#define FT_L2_FLOW_ID_BASE (2 * FLOW_TABLE_SIZE)
+/* Maximal number of outstanding DRAM lookups */
+#define FT_L2_OUTSTANDING 32
+/* DRAM entries are tagged with the epoch they were written in, and only
+ * match in the same epoch. FT_CLEAR advances the epoch, so entries written
+ * 1 << FT_L2_EPOCH_WIDTH clears ago would reappear. */
+#define FT_L2_EPOCH_WIDTH 16
+
+/* Flow IDs cover the on-chip table, the wildcard rules, and the DRAM table */
+#define FLOW_ID_WIDTH (FT_L2_MAX_LOG_SIZE + 3)
+
 #define FT_FIELDS 0
 /* A read from this address causes the flow that was previously set through the
  * FT_KEY_* and FT_RESULT_* registers to be added to the flow table, returning
@@ -50,18 +87,204 @@ enum flow_table_fields {
 /* A read from this address causes the flow that was set through FT_KEY_*
  * registers to be removed from the flow table. */
 #define FT_DELETE_FLOW 0x2
+/* A read from this address removes all flows: the exact match table, the
+ * wildcard rules and the DRAM table, and drops the FT_EVICTED queue. It
+ * takes a few cycles regardless of the number of flows. Counters are not
+ * affected. */
+#define FT_CLEAR 0x3
+/* Debug access to the exact match table by flow ID minus one. FT_READ_ENTRY
+ * loads the entry to the FT_KEY_*, FT_RESULT_* and FT_VALID registers.
+ * FT_SET_ENTRY updates the entry's result, or deletes it if FT_VALID is
+ * clear. */
 #define FT_SET_ENTRY 0x4
 #define FT_READ_ENTRY 0x5
+/* A write to this address sets the wildcard rule whose index is written from
+ * the FT_KEY_*, FT_MASK_*, FT_RESULT_*, FT_RULE_PRIORITY and FT_VALID
+ * registers. */
+#define FT_SET_RULE 0x6
+/* A write to this address loads the wildcard rule whose index is written into
+ * the same registers. */
+#define FT_READ_RULE 0x7
+
+/* Batched updates: entries are appended one word at a time by writing
+ * FT_BATCH_DATA, FT_BATCH_ENTRY_WORDS words per entry:
+ *   word 0: source IP address
+ *   word 1: destination IP address
+ *   word 2: source port (bits 31:16), destination port (bits 15:0)
+ *   word 3: action (bits 7:0), engine (bits 15:8), ikernel ID (bits 31:16)
+ * Reading FT_BATCH_DATA returns the number of words written so far, so that
+ * a host that writes the words without waiting for each one can check that
+ * none was lost.
+ * A read from FT_BATCH_ADD or FT_BATCH_DELETE applies all the entries written
+ * since the last FT_BATCH_RESET, and returns the number of entries that
+ * succeeded. The per-entry results (the flow ID for additions, non-zero for
+ * successful deletions, zero on failure) can then be read by successive reads
+ * of FT_BATCH_RESULT. Writing FT_BATCH_RESULT sets the index of the next
+ * result to read. */
+#define FT_BATCH_RESET 0x8
+#define FT_BATCH_ADD 0x9
+#define FT_BATCH_DELETE 0xa
+#define FT_BATCH_DATA 0xb
+#define FT_BATCH_RESULT 0xc
+/* Like FT_BATCH_RESULT, with the entry index plus one in the bits above
+ * FLOW_ID_WIDTH, so that results read without waiting for each one can be
+ * matched to their entries */
+#define FT_BATCH_TAGGED_RESULT 0xd
+
+#define FT_BATCH_LOG_SIZE 10
+#define FT_BATCH_SIZE (1 << FT_BATCH_LOG_SIZE)
+#define FT_BATCH_ENTRY_WORDS 4
 
 #define FT_KEY_SADDR 0x10
 #define FT_KEY_DADDR 0x11
 #define FT_KEY_SPORT 0x12
 #define FT_KEY_DPORT 0x13
+/* Per-rule masks, used with FT_SET_RULE and FT_READ_RULE */
+#define FT_MASK_SADDR 0x14
+#define FT_MASK_DADDR 0x15
+#define FT_MASK_SPORT 0x16
+#define FT_MASK_DPORT 0x17
 #define FT_RESULT_ACTION 0x18
 #define FT_RESULT_ENGINE 0x19
 #define FT_RESULT_IKERNEL_ID 0x1a
+/* Higher values take precedence among matching wildcard rules */
+#define FT_RULE_PRIORITY 0x1b
+/* The VM of the flow, and its mask for wildcard rules. Batched entries belong
+ * to the VM in FT_KEY_VM_ID. */
+#define FT_KEY_VM_ID 0x1c
+#define FT_MASK_VM_ID 0x1d
+/* The VID of the outer VLAN tag of the flow, and its mask for wildcard rules.
+ * Untagged packets have VID zero. Batched entries use FT_KEY_VLAN_ID. */
+#define FT_KEY_VLAN_ID 0x1e
+#define FT_MASK_VLAN_ID 0x1f
+/* Set for IPv6 flows, and its mask for wildcard rules. The addresses of IPv6
+ * flows are folded to 32 bits by XOR-ing their four words, so FT_KEY_SADDR and
+ * FT_KEY_DADDR hold the folded addresses. Exact match tables that use either
+ * address also match the address family. Batched entries use FT_KEY_IPV6. */
+#define FT_KEY_IPV6 0x21
+#define FT_MASK_IPV6 0x22
+/* The high 96 bits of the IPv6 addresses of exact match flows, in three words
+ * starting from the most significant. On-chip hits are checked against them,
+ * so flows whose folded addresses collide do not match each other's packets,
+ * though they cannot be added together. Wildcard rules match the folded
+ * addresses only, and IPv6 flows are not added to the DRAM table. Batched
+ * entries use these registers too. */
+#define FT_KEY_SADDR_HIGH 0x23
+#define FT_KEY_DADDR_HIGH 0x26
+
+/* Log2 of the number of lines in the DRAM table. Zero disables it. When
+ * enabled, flows that cannot be added to the on-chip table through
+ * FT_ADD_FLOW or FT_BATCH_ADD are added to the DRAM table, and deletions
+ * are applied to both tables. Packets look up the DRAM table only when they
+ * miss the on-chip table and the wildcard rules, and while it has entries. */
+#define FT_L2_LOG_SIZE 0x30
+/* Index of the first DRAM line (64 bytes each) used by the DRAM table */
+#define FT_L2_BASE 0x31
+
+/* Per-flow packet and byte counters, indexed by flow ID. Flow ID zero counts
+ * UDP packets that matched nothing. Flows in the DRAM table are not counted
+ * individually. */
+#define FT_COUNTERS (FT_RULE_FLOW_ID_BASE + FLOW_TABLE_RULES)
+/* Per-VM packet and byte counters follow the per-flow ones, at
+ * FT_VM_COUNTER_BASE + VM */
+#define FT_VM_COUNTER_BASE FT_COUNTERS
+#define FT_TOTAL_COUNTERS (FT_VM_COUNTER_BASE + FT_VMS)
+/* Index of the next counter to read through FT_COUNTER_DATA */
+#define FT_COUNTER_INDEX 0x40
+/* Successive reads return the packets, bytes low and bytes high words of the
+ * counter at FT_COUNTER_INDEX, and then advance the index. The first read
+ * takes a snapshot of the whole counter, clearing it if
+ * FT_COUNTER_CLEAR_ON_READ is set. */
+#define FT_COUNTER_DATA 0x41
+#define FT_COUNTER_WORDS 3
+#define FT_COUNTER_CLEAR_ON_READ 0x42
+/* A read from this address clears all counters, including the per-VM ones */
+#define FT_COUNTER_CLEAR_ALL 0x43
+
+/* Idle timeout of exact match entries, in ticks. Entries that no packet hit
+ * for longer are evicted. Zero disables aging. Must be below
+ * 1 << FT_AGING_MAX_LOG_TIMEOUT. */
+#define FT_AGING_TIMEOUT 0x50
+#define FT_AGING_MAX_LOG_TIMEOUT 15
+/* Length of an aging tick in cycles. The sweeper visits every entry once in
+ * about 2 * FLOW_TABLE_CAPACITY cycles, so shorter ticks make the timeout
+ * inaccurate. */
+#define FT_AGING_TICK 0x51
+#define FT_AGING_DEFAULT_TICK (1 << 20)
+/* Successive reads return the flow IDs of evicted entries, oldest first, or
+ * zero when there are none. Up to FT_EVICTED_SIZE IDs are kept; while the
+ * queue is full, idle entries stay in the table until the host reads it. */
+#define FT_EVICTED 0x52
+#define FT_EVICTED_LOG_SIZE 8
+#define FT_EVICTED_SIZE (1 << FT_EVICTED_LOG_SIZE)
+
+/* Hitless reconfiguration. The exact match table and the wildcard rules keep
+ * an active and a shadow version. Writing one to FT_SHADOW starts staging:
+ * FT_ADD_FLOW, FT_DELETE_FLOW, the batched updates and FT_SET_RULE then only
+ * modify the shadow version, and FT_READ_RULE reads it, while packets keep
+ * using the active one. A read from FT_COMMIT makes the shadow version active
+ * at once; packets classified before it complete with the old version. The
+ * new version is then copied to the shadow in the background, and updates
+ * wait for the copy, which takes about 2 * FLOW_TABLE_CAPACITY cycles.
+ * Staging stays on until zero is written to FT_SHADOW, which drops any
+ * updates staged since the last commit.
+ *
+ * Flows are staged in the on-chip table only, which both versions share: a
+ * staged addition fails when the table is full, and the DRAM table is not
+ * used while staging. FT_SET_ENTRY, FT_CLEAR and the idle timeout apply to
+ * both versions. */
+#define FT_SHADOW 0x60
+#define FT_COMMIT 0x61
+
+/* VM partitions. Every packet is assigned to the VM whose FT_VM_ADDR equals
+ * its destination IP address, or its source address if FT_VM_MATCH_SOURCE is
+ * set, and to VM 0 if none does. Lookups include the VM when FT_FIELDS has
+ * FT_FIELD_VM_ID, so tenants only hit their own flows, and wildcard rules can
+ * match it through FT_MASK_VM_ID.
+ *
+ * Each VM may hold up to FT_VM_QUOTA entries of the on-chip table. Additions
+ * beyond the quota go to the DRAM table if it is enabled, and fail
+ * otherwise. Packets that match no flow or rule get the result of their VM's
+ * FT_VM_DEFAULT.
+ *
+ * The per-VM registers below refer to the VM at FT_VM_INDEX. */
+#define FT_LOG_VMS 6
+#define FT_VMS (1 << FT_LOG_VMS)
+#define FT_VM_INDEX 0x70
+/* IPv4 address of the VM, or zero for none */
+#define FT_VM_ADDR 0x71
+#define FT_VM_MATCH_SOURCE 0x72
+/* Maximal number of on-chip entries. Defaults to FLOW_TABLE_CAPACITY. */
+#define FT_VM_QUOTA 0x73
+/* Number of on-chip entries the VM holds (read-only). While staging, this is
+ * the count of the shadow version. */
+#define FT_VM_USED 0x74
+/* A write sets the VM's default result from the FT_RESULT_* registers, and a
+ * read loads it into them */
+#define FT_VM_DEFAULT 0x75
+
+/* Token bucket policers, one for each flow ID that has a counter (see
+ * FT_COUNTERS). A policer lets through FT_POLICER_RATE bytes of IP total
+ * length every FT_POLICER_TICK cycles on average, in bursts of up to
+ * FT_POLICER_BURST bytes. Packets beyond that get FT_POLICER_EXCEED_ACTION,
+ * FT_DROP or FT_PASSTHROUGH, instead of their flow's action. The burst must
+ * hold at least one FT_POLICER_MIN_BURST packet, or larger packets would never
+ * pass. A zero rate disables the policer, and all policers start disabled. Packets that fail
+ * the steering checks are not policed, nor are flows in the DRAM table.
+ * FT_CLEAR does not affect the policers. */
+#define FT_POLICER_LOG_TICK 10
+#define FT_POLICER_TICK (1 << FT_POLICER_LOG_TICK)
+/* IP total length of a full standard Ethernet frame */
+#define FT_POLICER_MIN_BURST 1500
+#define FT_POLICER_RATE 0x80
+#define FT_POLICER_BURST 0x81
+#define FT_POLICER_EXCEED_ACTION 0x82
+/* A write of a flow ID sets its policer from the registers above, with a
+ * full bucket. Fails if the rate is set with a burst below
+ * FT_POLICER_MIN_BURST. */
+#define FT_SET_POLICER 0x83
 
-/* Used with FT_SET_ENTRY and FT_READ_ENTRY to indicate valid/invalid entries */
+/* Used with FT_SET_ENTRY, FT_READ_ENTRY, FT_SET_RULE and FT_READ_RULE to indicate valid/invalid entries */
 #define FT_VALID 0x20
 
 #endif
@@ -32,6 +32,7 @@
 
 #include "flow_table.hpp"
 #include "ikernel.hpp"
+#include "cuckoo_table.hpp"
 #include <ntl/cache.hpp>
 
 namespace udp {
@@ -46,10 +47,16 @@ struct flow {
     ap_uint<32> saddr;
     ap_uint<32> daddr;
     hls_ik::vm_id_t vm_id;
+    /* VID of the outer VLAN tag, zero for untagged packets */
+    hls_ik::vlan_id_t vlan_id;
+    /* IPv6 flow, whose addresses are folded to 32 bits. The flow table
+     * checks the rest of the address bits of exact matches separately. */
+    ap_uint<1> ipv6;
 
     flow(ap_uint<16> source_port = 0, ap_uint<16> dest_port = 0,
-         ap_uint<32> saddr = 0, ap_uint<32> daddr = 0, hls_ik::vm_id_t vm_id = 0);
-    static flow from_header(const udp::header_parser& hdr, hls_ik::vm_id_t vm_id = 0);
+         ap_uint<32> saddr = 0, ap_uint<32> daddr = 0, hls_ik::vm_id_t vm_id = 0,
+         hls_ik::vlan_id_t vlan_id = 0, ap_uint<1> ipv6 = 0);
+    static flow from_header(const udp::header_buffer& buf, hls_ik::vm_id_t vm_id = 0);
 
     static flow mask(int fields);
     flow operator& (const flow& mask) const;
@@ -57,13 +64,15 @@ struct flow {
     bool operator== (const flow& other) const
     {
         return source_port == other.source_port && dest_port == other.dest_port &&
-               saddr == other.saddr && daddr == other.daddr && vm_id == other.vm_id;
+               saddr == other.saddr && daddr == other.daddr && vm_id == other.vm_id &&
+               vlan_id == other.vlan_id && ipv6 == other.ipv6;
     }
 
     bool operator!= (const flow& other) const
     {
         return source_port != other.source_port || dest_port != other.dest_port ||
-               saddr != other.saddr || daddr != other.daddr || vm_id != other.vm_id;
+               saddr != other.saddr || daddr != other.daddr || vm_id != other.vm_id ||
+               vlan_id != other.vlan_id || ipv6 != other.ipv6;
     }
 
     flow& operator&= (const flow& other)
@@ -73,22 +82,29 @@ struct flow {
     }
 };
 
+static_assert(FT_LOG_VMS == LOG_NUM_VMS, "FT_VM_* registers must cover all VM IDs");
+static_assert(FLOW_ID_WIDTH + FT_BATCH_LOG_SIZE + 1 <= 31,
+              "FT_BATCH_TAGGED_RESULT must fit a positive gateway value");
+
 namespace ntl {
     template <>
     struct pack<flow> {
-        static const int width = 16 * 2 + 32 * 2 + hls_ik::vm_id_t::width;
+        static const int vm_vlan_width = hls_ik::vm_id_t::width + hls_ik::vlan_id_t::width + 1;
+        static const int width = 16 * 2 + 32 * 2 + vm_vlan_width;
 
         static ap_uint<width> to_int(const flow& e) {
-            return (e.source_port, e.dest_port, e.saddr, e.daddr, e.vm_id);
+            return (e.source_port, e.dest_port, e.saddr, e.daddr, e.vm_id, e.vlan_id, e.ipv6);
         }
 
         static flow from_int(const ap_uint<width>& d) {
             auto e = flow(
-                d(hls_ik::vm_id_t::width + 96 - 1, hls_ik::vm_id_t::width + 80),
-                d(hls_ik::vm_id_t::width + 80 - 1, hls_ik::vm_id_t::width + 64),
-                d(hls_ik::vm_id_t::width + 64 - 1, hls_ik::vm_id_t::width + 32),
-                d(hls_ik::vm_id_t::width + 32 - 1, hls_ik::vm_id_t::width),
-                d(hls_ik::vm_id_t::width      - 1, 0)
+                d(vm_vlan_width + 96 - 1, vm_vlan_width + 80),
+                d(vm_vlan_width + 80 - 1, vm_vlan_width + 64),
+                d(vm_vlan_width + 64 - 1, vm_vlan_width + 32),
+                d(vm_vlan_width + 32 - 1, vm_vlan_width),
+                d(vm_vlan_width - 1, hls_ik::vlan_id_t::width + 1),
+                d(hls_ik::vlan_id_t::width, 1),
+                d(0, 0)
             );
             return e;
         }
@@ -143,38 +159,413 @@ namespace ntl {
 struct flow_table_result {
     flow_table_value v;
     hls_ik::flow_id_t flow_id;
+    /* The VM the packet was assigned to */
+    hls_ik::vm_id_t vm_id;
 
-    explicit flow_table_result(hls_ik::flow_id_t flow_id = 0, const flow_table_value& v = flow_table_value()) :
-        v(v), flow_id(flow_id)
+    explicit flow_table_result(hls_ik::flow_id_t flow_id = 0, const flow_table_value& v = flow_table_value(),
+                               hls_ik::vm_id_t vm_id = 0) :
+        v(v), flow_id(flow_id), vm_id(vm_id)
     {}
 };
 
 typedef hls::stream<flow_table_result> result_stream;
 
-typedef ntl::hash_table_wrapper<flow, flow_table_value, FLOW_TABLE_SIZE> hash_flow_table_t;
+/* A packet to account for in the per-flow counters */
+struct flow_counter_update {
+    hls_ik::flow_id_t flow_id;
+    ap_uint<16> length;
+    hls_ik::vm_id_t vm_id;
+
+    explicit flow_counter_update(hls_ik::flow_id_t flow_id = 0, ap_uint<16> length = 0,
+                                 hls_ik::vm_id_t vm_id = 0) :
+        flow_id(flow_id), length(length), vm_id(vm_id)
+    {}
+};
+
+typedef hls::stream<flow_counter_update> counter_update_stream;
+
+struct flow_counter {
+    ap_uint<32> packets;
+    /* Sum of IP total length fields */
+    ap_uint<48> bytes;
+
+    flow_counter() : packets(0), bytes(0) {}
+};
+
+/* Per-flow and per-VM counters, updated at up to one packet per cycle in
+ * their own process. The gateway reads and clears counters through a request
+ * stream, served in cycles without an update. */
+class flow_counters {
+public:
+    flow_counters();
+
+    void update(counter_update_stream& updates);
+
+    /* Read a counter, clearing it if requested. Returns GW_BUSY until the
+     * request is served, and the caller repeats it with the same
+     * arguments. */
+    int gateway_read(int index, bool clear, flow_counter& value);
+
+private:
+    struct request {
+        hls_ik::flow_id_t index;
+        bool clear;
+    };
+
+    hls::stream<request> requests;
+    hls::stream<flow_counter> responses;
+    bool request_sent;
+
+    flow_counter counters[FT_COUNTERS];
+    flow_counter vm_counters[FT_VMS];
+    /* The counters written in the previous cycle, forwarded to a read of the
+     * same counter that the memory cannot serve yet */
+    hls_ik::flow_id_t last_index;
+    flow_counter last;
+    hls_ik::vm_id_t last_vm;
+    bool last_vm_valid;
+    flow_counter last_vm_counter;
+};
+
+struct flow_policer {
+    /* Bytes per FT_POLICER_TICK cycles, zero when disabled */
+    ap_uint<16> rate;
+    /* Bucket size in bytes */
+    ap_uint<32> burst;
+    flow_table_action exceed_action;
+    /* Tokens in units of 1 / FT_POLICER_TICK bytes */
+    ap_uint<32 + FT_POLICER_LOG_TICK> tokens;
+    /* Cycle of the last refill. The clock wraps, so a flow idle for over
+     * 2^32 cycles may find its bucket less than full. */
+    ap_uint<32> last;
+
+    flow_policer() : rate(0), burst(0), exceed_action(FT_DROP), tokens(0), last(0) {}
+};
+
+/* Per-flow token bucket policers, owned by the steering stage's action
+ * process, which polices up to one packet per cycle. The gateway sets
+ * policers through a request stream, served in cycles without a packet. */
+class flow_policers {
+public:
+    flow_policers();
+
+    /* Advance the clock and apply a pending configuration update. Called in
+     * cycles without a packet to police. */
+    void update();
+    /* Advance the clock and charge a packet to the flow's bucket. Returns
+     * true if it exceeds the policer, and sets the action to apply to it
+     * instead. */
+    bool police(hls_ik::flow_id_t flow_id, ap_uint<16> length,
+                flow_table_action& exceed_action);
+
+    /* Set a policer. Returns GW_BUSY when the update stream is full. */
+    int gateway_set(hls_ik::flow_id_t flow_id, const flow_policer& p);
+
+private:
+    struct request {
+        hls_ik::flow_id_t index;
+        flow_policer p;
+    };
+
+    hls::stream<request> requests;
+
+    flow_policer policers[FT_COUNTERS];
+    /* The policer written in the previous cycle, forwarded like the
+     * counters */
+    hls_ik::flow_id_t last_index;
+    flow_policer last;
+    ap_uint<32> now;
+};
+
+typedef cuckoo_table<flow, flow_table_value, FLOW_TABLE_SIZE, FT_CUCKOO_WAYS,
+                     FT_STASH_SIZE, FT_CUCKOO_MAX_KICKS> hash_flow_table_t;
+
+typedef ap_uint<FLOW_TABLE_RULES_LOG_SIZE> rule_index_t;
+typedef ap_uint<8> rule_priority_t;
+
+/* A wildcard rule matches any flow that equals its key on the bits set in its
+ * mask. */
+struct flow_table_rule {
+    flow key;
+    flow mask;
+    rule_priority_t priority;
+    flow_table_value value;
+    bool valid;
+
+    flow_table_rule() : priority(0), valid(false) {}
+
+    bool match(const flow& f) const
+    {
+#pragma HLS inline
+        return valid && (f & mask) == key;
+    }
+};
+
+typedef hash_flow_table_t::bank_t flow_table_bank_t;
+
+/* Masked-match stage: all rules are compared against the flow in parallel,
+ * so the table is kept small and in registers. Like the exact match table,
+ * the rules have two banks. */
+class ternary_flow_table {
+public:
+    typedef std::tuple<rule_index_t, flow_table_value> match_t;
+
+    ntl::maybe<match_t> lookup(const flow& f, flow_table_bank_t bank) const;
+
+    void set_rule(flow_table_bank_t bank, rule_index_t index, const flow_table_rule& rule);
+    void clear();
+    /* Copy a bank over the other one */
+    void copy(flow_table_bank_t bank);
+    const flow_table_rule& get_rule(flow_table_bank_t bank, rule_index_t index) const
+    {
+        return rules[bank][index];
+    }
+
+private:
+    flow_table_rule rules[2][FLOW_TABLE_RULES];
+};
+
+/* Per-packet state carried alongside the on-chip hash table lookup */
+/* The high 96 bits of the source and destination IPv6 addresses */
+typedef ap_uint<192> flow_addr_high_t;
+
+struct flow_table_lookup {
+    /* The flow masked by the FT_FIELDS mask */
+    flow key;
+    /* The high address bits of the packet the key matches */
+    flow_addr_high_t addr_high;
+    hls_ik::vm_id_t vm_id;
+    ntl::maybe<ternary_flow_table::match_t> rule;
+};
+
+/* An entry of the DRAM table */
+typedef ap_uint<FT_L2_EPOCH_WIDTH> l2_epoch_t;
+
+struct flow_table_l2_entry {
+    flow key;
+    flow_table_value value;
+    l2_epoch_t epoch;
+    bool valid;
+
+    static const int value_width = ntl::pack<flow_table_value>::width;
+    static const int width = ntl::pack<flow>::width + value_width + FT_L2_EPOCH_WIDTH + 1;
+
+    flow_table_l2_entry(const flow& key = flow(), const flow_table_value& value = flow_table_value(),
+                        l2_epoch_t epoch = 0, bool valid = false) :
+        key(key), value(value), epoch(epoch), valid(valid)
+    {}
+
+    flow_table_l2_entry(const ap_uint<width>& d) :
+        key(ntl::pack<flow>::from_int(d(width - 1, value_width + FT_L2_EPOCH_WIDTH + 1))),
+        value(ntl::pack<flow_table_value>::from_int(d(value_width + FT_L2_EPOCH_WIDTH,
+                                                      FT_L2_EPOCH_WIDTH + 1))),
+        epoch(d(FT_L2_EPOCH_WIDTH, 1)),
+        valid(d(0, 0))
+    {}
+
+    operator ap_uint<width>() const
+    {
+        return (ntl::pack<flow>::to_int(key), ntl::pack<flow_table_value>::to_int(value),
+                epoch, ap_uint<1>(valid));
+    }
+
+    bool live(l2_epoch_t cur) const { return valid && epoch == cur; }
+};
+
+/* A DRAM line holding a bucket of FT_L2_WAYS entries */
+struct flow_table_l2_line {
+    static const int entry_width = flow_table_l2_entry::width;
+    static_assert(entry_width * FT_L2_WAYS <= 512, "DRAM table entries do not fit a line");
+
+    flow_table_l2_entry entries[FT_L2_WAYS];
+
+    flow_table_l2_line() {}
+
+    flow_table_l2_line(const ap_uint<512>& d)
+    {
+        for (int i = 0; i < FT_L2_WAYS; ++i) {
+#pragma HLS unroll
+            entries[i] = ap_uint<entry_width>(d((i + 1) * entry_width - 1, i * entry_width));
+        }
+    }
+
+    operator ap_uint<512>() const
+    {
+        ap_uint<512> d = 0;
+        for (int i = 0; i < FT_L2_WAYS; ++i) {
+#pragma HLS unroll
+            d((i + 1) * entry_width - 1, i * entry_width) = ap_uint<entry_width>(entries[i]);
+        }
+        return d;
+    }
+};
+
+typedef ap_uint<FT_L2_MAX_LOG_SIZE> l2_line_index_t;
+
+/* A lookup result waiting to be output in order. Unresolved entries wait for a
+ * DRAM line, either for a lookup that missed the on-chip table, or for a
+ * gateway update of the DRAM table. */
+struct flow_table_pending {
+    /* The result to use unless the DRAM table matches: the wildcard rule, or
+     * the on-chip table hit if resolved is set */
+    flow_table_result result;
+    flow key;
+    l2_line_index_t line;
+    bool resolved;
+    bool gateway;
+    ap_uint<32> timestamp;
+};
+
+struct flow_table_stats {
+    /* Hits in the on-chip exact match table */
+    ap_uint<32> hits;
+    /* Lookups sent to the DRAM table, and how many of them hit */
+    ap_uint<32> l2_lookups;
+    ap_uint<32> l2_hits;
+    /* Packets that matched a wildcard rule only */
+    ap_uint<32> rule_hits;
+    /* Packets that matched nothing */
+    ap_uint<32> misses;
+    /* Total and maximal DRAM lookup latency, in flow table cycles */
+    ap_uint<32> l2_latency_total;
+    ap_uint<32> l2_latency_max;
+    /* Entries removed by the idle timeout */
+    ap_uint<32> evictions;
+};
 
 class flow_table {
 public:
     flow_table() { reset(); }
     void ft_step(udp::header_stream& header, result_stream& result,
-                 hls_ik::gateway_registers& gateway);
+                 counter_update_stream& counter_updates,
+                 hls_ik::gateway_registers& gateway, hls_ik::memory_t& mem,
+                 flow_table_stats* stats);
 
     int reg_write(int address, int value);
     int reg_read(int address, int* value);
     void gateway_update();
     void reset();
 
+    /* Per-flow policers, called from the steering stage. See
+     * flow_policers. */
+    void policers_update()
+    {
+#pragma HLS inline
+        policers.update();
+    }
+    bool police(hls_ik::flow_id_t flow_id, ap_uint<16> length,
+                flow_table_action& exceed_action)
+    {
+#pragma HLS inline
+        return policers.police(flow_id, length, exceed_action);
+    }
+
 private:
     void ft_wrapper(udp::header_stream& header, result_stream& result,
-                    hls_ik::gateway_registers& gateway);
+                    hls_ik::gateway_registers& gateway, hls_ik::memory_t& mem,
+                    flow_table_stats* stats);
+    void l2_output(result_stream& result, hls_ik::memory_t& mem);
+    l2_line_index_t l2_line(const flow& key) const;
+    flow_addr_high_t addr_high(const ap_uint<96>& saddr_high, const ap_uint<96>& daddr_high,
+                               ap_uint<1> ipv6) const;
+    hash_flow_table_t::value_type batch_entry(int index);
+    int batch_command(bool add, int* value);
+    int onchip_add_entry(const hash_flow_table_t::value_type& entry, int* value);
+    int add_entry(const hash_flow_table_t::value_type& entry, int* value);
+    int delete_entry(const flow& key, int* value);
+    void l2_gateway_find(int& found, int& empty);
+    int read_counter(int* value);
+    int clear_counters();
+    int set_aging(int timeout, int tick);
+    int clear();
+    int sync(flow_table_bank_t bank);
+    hls_ik::vm_id_t classify(const flow& f) const;
+    void vm_charge(hls_ik::vm_id_t vm, int delta);
+    void evicted_push();
 
     bool reset_done;
     hash_flow_table_t hash_flow_table;
+    ternary_flow_table rules;
+    /* Lookups waiting for the hash table result of the same packet */
+    hls::stream<flow_table_lookup> lookups;
     flow gateway_flow;
+    flow gateway_mask;
+    ap_uint<96> gateway_saddr_high, gateway_daddr_high;
+    rule_priority_t gateway_priority;
     flow_table_value gateway_result;
     bool gateway_valid;
     int fields;
 
+    /* Staging area for batched updates (FT_BATCH_*) */
+    ap_uint<32> batch_data[FT_BATCH_SIZE][FT_BATCH_ENTRY_WORDS];
+    int batch_results[FT_BATCH_SIZE];
+    /* Number of words written to batch_data */
+    int batch_words;
+    /* Entry currently being applied, or the next result to read */
+    int batch_cursor;
+    int batch_succeeded;
+    bool batch_running;
+
+    /* DRAM table */
+    ap_uint<5> l2_log_size;
+    ap_uint<32> l2_base;
+    l2_epoch_t l2_epoch;
+    /* Live entries in the DRAM table */
+    ap_uint<32> l2_entries;
+    hls::stream<flow_table_pending> l2_pending;
+    flow_table_pending l2_head;
+    bool l2_head_valid;
+    /* DRAM table gateway update state */
+    enum { L2_GW_IDLE, L2_GW_POST, L2_GW_WAIT, L2_GW_READY } l2_gateway_state;
+    bool l2_gateway_add;
+    flow l2_gateway_key;
+    flow_table_value l2_gateway_value;
+    /* Flow ID the on-chip table returned for a deletion */
+    int l2_gateway_result;
+    l2_line_index_t l2_gateway_index;
+    flow_table_l2_line l2_gateway_line;
+    bool l2_write_pending;
+
+    /* Per-flow counters */
+    flow_counters counters;
+    int counter_index;
+    int counter_word;
+    bool counter_clear_on_read;
+    flow_counter counter_snapshot;
+    int counter_clear_cursor;
+
+    /* Per-flow policers, and the policer FT_SET_POLICER applies */
+    flow_policers policers;
+    flow_policer gateway_policer;
+
+    /* Idle timeout configuration, and evicted flow IDs for the host */
+    int aging_timeout;
+    int aging_tick;
+    hls_ik::flow_id_t evicted[FT_EVICTED_SIZE];
+    ap_uint<FT_EVICTED_LOG_SIZE> evicted_head, evicted_tail;
+    ap_uint<FT_EVICTED_LOG_SIZE + 1> evicted_count;
+
+    /* Table versions: lookups use the active bank, and while staging,
+     * updates go to the other one until FT_COMMIT */
+    flow_table_bank_t active_bank;
+    bool staging;
+
+    /* VM partitions */
+    ap_uint<32> vm_addr[FT_VMS];
+    bool vm_match_source;
+    int vm_index;
+    ap_uint<FLOW_TABLE_LOG_SIZE + 2> vm_quota[FT_VMS];
+    /* On-chip entries per VM in each version */
+    ap_uint<FLOW_TABLE_LOG_SIZE + 2> vm_used[2][FT_VMS];
+    flow_table_value vm_default[FT_VMS];
+    /* The VM of each on-chip flow ID minus one, for evictions */
+    hls_ik::vm_id_t flow_vm[FLOW_TABLE_CAPACITY];
+    /* The high address bits of each on-chip flow ID minus one, checked on
+     * hits since the key only holds the folded addresses */
+    flow_addr_high_t flow_addr_high[FLOW_TABLE_CAPACITY];
+
+    ap_uint<32> cycle;
+    flow_table_stats stats;
+
     ntl::gateway_impl<int> gateway;
 };
-
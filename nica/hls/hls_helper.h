@@ -300,10 +300,9 @@ inline void int_to_bytes(const int src, ap_uint<Width>& dest, const uint32_t off
 
 /* Zero out bytes in the data stream that have their keep bit cleared */
 template <typename axi>
-// TODO instead of 256 get the width from axi::data::width
-ap_uint<256> mask_last_word(axi word)
+ap_uint<decltype(axi::data)::width> mask_last_word(axi word)
 {
-    const size_t bits = 256;
+    const size_t bits = decltype(axi::data)::width;
     const size_t bytes = bits / 8;
     ap_uint<8> ret[bytes];
 #pragma HLS array_partition variable=ret complete
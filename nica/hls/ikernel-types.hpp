@@ -43,12 +43,13 @@ namespace hls_ik {
     typedef ap_uint<LOG_NUM_IKERNELS> ikernel_id_t;
     typedef ap_uint<LOG_NUM_ENGINES> engine_id_t;
     typedef ap_uint<LOG_NUM_VMS> vm_id_t;
-    /* One more bit for the miss flows */
-    typedef ap_uint<FLOW_TABLE_LOG_SIZE + 1> flow_id_t;
+    typedef ap_uint<12> vlan_id_t;
+    typedef ap_uint<FLOW_ID_WIDTH> flow_id_t;
 
     typedef ap_uint<1> direction_t;
     #define HOST (0)
     #define NET (1)
 
-    typedef ap_uint<11> pkt_len_t;
+    /* Same width as the IP total length, to cover jumbo frames */
+    typedef ap_uint<16> pkt_len_t;
 }
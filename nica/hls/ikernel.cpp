@@ -24,12 +24,14 @@
 //
 
 #include "ikernel.hpp"
+#include "mlx.h"
 
 #include <ntl/produce.hpp>
 #include <ntl/consume.hpp>
 
 #define TC_META_THRESHOLD 256
-#define TC_DATA_THRESHOLD 256
+/* Room for at least one maximum size packet */
+#define TC_DATA_THRESHOLD (MAX_PACKET_WORDS > 256 ? MAX_PACKET_WORDS : 256)
 
 namespace hls_ik {
 
@@ -45,7 +47,7 @@ namespace hls_ik {
         int traffic_class = id & (NUM_TC - 1);
         if (traffic_class == NUM_TC - 1)
             traffic_class = 0;
-        if (meta[traffic_class] > TC_META_THRESHOLD - 1 || data[traffic_class] > TC_DATA_THRESHOLD - (len >> 5))
+        if (meta[traffic_class] > TC_META_THRESHOLD - 1 || data[traffic_class] > TC_DATA_THRESHOLD - ((len + MLX_AXI4_WIDTH_BYTES - 1) >> MLX_AXI4_OFFSET_BITS))
             return false;
 
         return true;
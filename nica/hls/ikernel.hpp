@@ -52,8 +52,50 @@ inline bool operator==(const ikernel_id& a, const ikernel_id& b)
     return uuid_compare(a.uuid, b.uuid) == 0;
 }
 
+/* 802.1Q VLAN tags of a packet. Up to two tags (QinQ) are supported. */
+struct vlan_tags : public boost::equality_comparable<vlan_tags> {
+    /* Number of tags (0-2) */
+    ap_uint<2> count;
+    /* The outer tag is an 802.1ad service tag (ethertype 0x88a8) rather than
+     * 0x8100 */
+    ap_uint<1> stag;
+    /* Tag control information (PCP, DEI and VID) of the outer and inner tags */
+    ap_uint<16> outer;
+    ap_uint<16> inner;
+
+    bool operator ==(const vlan_tags& o) const {
+        return count == o.count && stag == o.stag &&
+               outer == o.outer && inner == o.inner;
+    }
+
+    static const int width = 2 + 1 + 16 + 16;
+
+    vlan_tags(const ap_uint<width> d = 0) :
+        count(d(34, 33)),
+        stag(d(32, 32)),
+        outer(d(31, 16)),
+        inner(d(15, 0))
+    {}
+
+    operator ap_uint<width>() const {
+        return (count, stag, outer, inner);
+    }
+
+    /* VLAN ID of the outer tag, or zero for untagged packets */
+    vlan_id_t vid() const { return count ? vlan_id_t(outer(11, 0)) : vlan_id_t(0); }
+    /* Priority code point of the outer tag */
+    ap_uint<3> pcp() const { return count ? ap_uint<3>(outer(15, 13)) : ap_uint<3>(0); }
+};
+
 /* Packet headers metadata */
 struct packet_metadata : public boost::equality_comparable<packet_metadata> {
+    /* VLAN tags, re-inserted on egress */
+    vlan_tags vlan;
+    /* IPv6 packet. The low 32 bits of the addresses are in ip_dst and
+     * ip_src, and the rest in ip_dst_high and ip_src_high. */
+    ap_uint<1> ipv6;
+    ap_uint<96> ip_dst_high;
+    ap_uint<96> ip_src_high;
     /* Ethernet destination MAC address */
     ap_uint<48> eth_dst;
     /* Ethernet source MAC address */
@@ -68,7 +110,11 @@ struct packet_metadata : public boost::equality_comparable<packet_metadata> {
     ap_uint<16> udp_src;
 
     bool operator ==(const packet_metadata& o) const {
-        return eth_dst  == o.eth_dst  &&
+        return vlan     == o.vlan     &&
+               ipv6     == o.ipv6     &&
+               ip_dst_high == o.ip_dst_high &&
+               ip_src_high == o.ip_src_high &&
+               eth_dst  == o.eth_dst  &&
                eth_src  == o.eth_src  &&
                ip_dst   == o.ip_dst   &&
                ip_src   == o.ip_src   &&
@@ -77,6 +123,10 @@ struct packet_metadata : public boost::equality_comparable<packet_metadata> {
     }
 
     static const int width =
+        vlan_tags::width +
+        1 +
+        96 +
+        96 +
         48 +
         48 +
         32 +
@@ -85,6 +135,10 @@ struct packet_metadata : public boost::equality_comparable<packet_metadata> {
         16;
 
     packet_metadata(const ap_uint<width> d = 0) :
+        vlan(d(width - 1, 385)),
+        ipv6(d(384, 384)),
+        ip_dst_high(d(383, 288)),
+        ip_src_high(d(287, 192)),
         eth_dst(d(191, 144)),
         eth_src(d(143, 96)),
         ip_dst(d(95, 64)),
@@ -94,8 +148,8 @@ struct packet_metadata : public boost::equality_comparable<packet_metadata> {
     {}
 
     operator ap_uint<width>() const {
-        return (eth_dst, eth_src, ip_dst, ip_src, udp_dst,
-                udp_src);
+        return (ap_uint<vlan_tags::width>(vlan), ipv6, ip_dst_high, ip_src_high,
+                eth_dst, eth_src, ip_dst, ip_src, udp_dst, udp_src);
     }
 
     packet_metadata reply() const {
@@ -105,6 +159,8 @@ struct packet_metadata : public boost::equality_comparable<packet_metadata> {
         m.eth_src = eth_dst;
         m.ip_dst = ip_src;
         m.ip_src = ip_dst;
+        m.ip_dst_high = ip_src_high;
+        m.ip_src_high = ip_dst_high;
         m.udp_dst = udp_src;
         m.udp_src = udp_dst;
 
@@ -34,24 +34,52 @@
 #include "hls_helper.h"
 #include "axi_data.hpp"
 
-#define MLX_AXI4_WIDTH_BITS 256
+/* Width of the data path. 256 bits by default; define as 512 to double the
+ * throughput at the same clock. */
+#ifndef MLX_AXI4_WIDTH_BITS
+#  define MLX_AXI4_WIDTH_BITS 256
+#endif
 #define MLX_AXI4_WIDTH_BYTES (MLX_AXI4_WIDTH_BITS / 8)
-
-#define MAX_PACKET_SIZE 1520
-#define MAX_PACKET_WORDS 48 // MAX_PACKET_SIZE / MLX_AXI4_WIDTH_BYTES
+/* Number of bits of a byte offset within a word */
+#define MLX_AXI4_OFFSET_BITS (MLX_AXI4_WIDTH_BITS == 512 ? 6 : 5)
+
+static_assert(MLX_AXI4_WIDTH_BITS == 256 || MLX_AXI4_WIDTH_BITS == 512,
+              "unsupported data path width");
+static_assert(decltype(hls_ik::axi_data::data)::width == MLX_AXI4_WIDTH_BITS,
+              "ntl::axi_data must be built with the same data path width");
+
+/* Maximum Ethernet frame size, without the FCS. The default covers a 9000
+ * bytes MTU with VLAN tags; define as 1520 for standard frames only. */
+#ifndef MAX_PACKET_SIZE
+#  define MAX_PACKET_SIZE 9216
+#endif
+#define MAX_PACKET_WORDS ((MAX_PACKET_SIZE + MLX_AXI4_WIDTH_BYTES - 1) / MLX_AXI4_WIDTH_BYTES)
 #define FIFO_PACKETS 15 // A single SRL
 #define FIFO_WORDS 511 // Utilize a BRAM
 
-/* The number of packets to hold while waiting for the flow table results */
-#define FIFO_FLOW_TABLE_PACKETS 5
+static_assert(FIFO_WORDS >= MAX_PACKET_WORDS, "data FIFOs must hold a whole packet");
+
+/* The number of packets to hold while waiting for the flow table results.
+ * Deep enough to keep minimum-size packets flowing while DRAM flow table
+ * lookups are outstanding. */
+#define FIFO_FLOW_TABLE_PACKETS 32
 
 namespace mlx {
     typedef ap_uint<MLX_AXI4_WIDTH_BITS> word;
+    typedef ap_uint<MLX_AXI4_WIDTH_BYTES> keep_t;
+    /* A byte offset within a word */
+    typedef ap_uint<MLX_AXI4_OFFSET_BITS> byte_offset_t;
+
+    static inline keep_t keep_all()
+    {
+        return ~keep_t(0);
+    }
+
     typedef ap_uint<12> user_t;
     typedef ap_uint<3> pkt_id_t;
     struct axi4s {
         word data;
-        ap_uint<MLX_AXI4_WIDTH_BYTES> keep;
+        keep_t keep;
         ap_uint<1> last;
         /**
          * bit 0 - drop
@@ -62,7 +90,7 @@ namespace mlx {
         pkt_id_t id;
 
         axi4s(const word& data = word(0),
-              const ap_uint<MLX_AXI4_WIDTH_BYTES>& keep = 0xffffffff,
+              const keep_t& keep = keep_all(),
               const ap_uint<1>& last = ap_uint<1>(0),
               const user_t& user = user_t(0),
               const pkt_id_t& id = pkt_id_t(0)) :
@@ -86,11 +114,11 @@ namespace mlx {
 #define MLX_TUSER_PRESERVE (~(mlx::USER_DROP | mlx::USER_LOSSY))
 
     /* 0 means all are valid */
-    static inline ap_uint<MLX_AXI4_WIDTH_BYTES> last_word_keep_num_bytes_valid(ap_uint<5> num_valid)
+    static inline keep_t last_word_keep_num_bytes_valid(byte_offset_t num_valid)
 	{
-		ap_uint<MLX_AXI4_WIDTH_BYTES> tmp = (1 << num_valid) - 1;
+		keep_t tmp = (ap_uint<MLX_AXI4_WIDTH_BYTES + 1>(1) << num_valid) - 1;
 		/* Reverse the bits */
-		return num_valid ? tmp(0, MLX_AXI4_WIDTH_BYTES - 1) : 0xffffffff;
+		return num_valid ? keep_t(tmp(0, MLX_AXI4_WIDTH_BYTES - 1)) : keep_all();
 	}
 
     typedef hls::stream<axi4s> stream;
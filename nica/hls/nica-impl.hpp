@@ -211,7 +211,8 @@ public:
                    config& config, nica_pipeline_stats& s,
                    trace_event events[4],
                    DECL_IKERNEL_PARAMS(),
-                   tc_ports& tc_out, tc_ports& tc_in);
+                   tc_ports& tc_out, tc_ports& tc_in,
+                   hls_ik::memory_t& ft_mem);
 
 #if !defined(__SYNTHESIS__)
     void verify();
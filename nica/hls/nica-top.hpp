@@ -74,7 +74,8 @@ void nica(mlx::stream& nwp2sbu, mlx::stream& sbu2nwp, mlx::stream& cxp2sbu,
           trace_event events[NUM_TRACE_EVENTS],
           DECL_IKERNEL_PARAMS(),
           tc_ports& h2n_tc_out, tc_ports& h2n_tc_in,
-          tc_ports& n2h_tc_out, tc_ports& n2h_tc_in
+          tc_ports& n2h_tc_out, tc_ports& n2h_tc_in,
+          hls_ik::memory_t& n2h_ft_mem, hls_ik::memory_t& h2n_ft_mem
     );
 
 #endif
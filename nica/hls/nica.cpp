@@ -62,6 +62,10 @@ void header_to_metadata_and_private::split_udp_hdr_stream(
     packet_metadata pkt = m.get_packet_metadata();
     // pkt.port_dst;
     // pkt.port_src;
+    pkt.vlan = buf.vlan;
+    pkt.ipv6 = buf.ipv6;
+    pkt.ip_dst_high = buf.daddr_high;
+    pkt.ip_src_high = buf.saddr_high;
     pkt.eth_dst = hdr.eth.dest;
     pkt.eth_src = hdr.eth.source;
     pkt.ip_dst = hdr.ip.daddr;
@@ -167,7 +171,8 @@ void nica_state<pipeline>::nica_step(
     config& config, nica_pipeline_stats& s,
     trace_event events[4],
     DECL_IKERNEL_PARAMS(),
-    tc_ports& tc_out, tc_ports& tc_in)
+    tc_ports& tc_out, tc_ports& tc_in,
+    hls_ik::memory_t& ft_mem)
 {
 #pragma HLS inline
     DO_PRAGMA(HLS STREAM variable=raw_in_to_udp depth=FIFO_WORDS);
@@ -201,7 +206,7 @@ void nica_state<pipeline>::nica_step(
         BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, header_udp_to_ikernel),
         BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, ft_results_to_ik),
         BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, data_udp_to_ikernel),
-        bool_pass_from_steering, &config.common, &s.udp);
+        bool_pass_from_steering, ft_mem, &config.common, &s.udp);
 
     dropper.step(raw_in_to_dropper, bool_pass_from_steering,
         BOOST_PP_CAT(tc_out.meta, BOOST_PP_DEC(NUM_TC)),
@@ -237,7 +242,7 @@ void nica_state<pipeline>::nica_step(
         events);
 
     builder.builder_step(hdr_arbiter_to_builder, data_arbiter_to_builder,
-        raw_builder_to_pad);
+        raw_builder_to_pad, config.common.udp_checksum);
 
     ethernet_pad.pad(raw_builder_to_pad, sbu2port);
 }
@@ -300,7 +305,8 @@ void nica(mlx::stream& prt_nw2sbu, mlx::stream& sbu2prt_nw, mlx::stream& prt_cx2
           trace_event events[NUM_TRACE_EVENTS],
           DECL_IKERNEL_PARAMS(),
           tc_ports& h2n_tc_out, tc_ports& h2n_tc_in,
-          tc_ports& n2h_tc_out, tc_ports& n2h_tc_in
+          tc_ports& n2h_tc_out, tc_ports& n2h_tc_in,
+          hls_ik::memory_t& n2h_ft_mem, hls_ik::memory_t& h2n_ft_mem
     )
 {
 #pragma HLS INTERFACE axis port=prt_nw2sbu
@@ -313,6 +319,8 @@ void nica(mlx::stream& prt_nw2sbu, mlx::stream& sbu2prt_nw, mlx::stream& prt_cx2
 #pragma HLS interface ap_fifo port=n2h_tc_in
 #pragma HLS interface ap_fifo port=h2n_tc_out
 #pragma HLS interface ap_fifo port=h2n_tc_in
+    NTL_MEMORY_INTERFACE_PRAGMA(n2h_ft_mem)
+    NTL_MEMORY_INTERFACE_PRAGMA(h2n_ft_mem)
 #ifdef SIMULATION_BUILD
 /* For RTL cosimulation we need the function control signals, but for the
  * Mellanox wrapper we don't. The co-simulation code also doesn't work well
@@ -322,15 +330,21 @@ void nica(mlx::stream& prt_nw2sbu, mlx::stream& sbu2prt_nw, mlx::stream& prt_cx2
 #  pragma HLS INTERFACE ap_ctrl_none port=return
 #  pragma HLS INTERFACE s_axilite port=cfg->n2h.common.enable offset=0x10
     GATEWAY_OFFSET(cfg->n2h.common.flow_table_gateway, 0x18, 0x20, 0x30)
+#  pragma HLS INTERFACE s_axilite port=cfg->n2h.common.checksum_validate offset=0x40
+#  pragma HLS INTERFACE s_axilite port=cfg->n2h.common.udp_checksum offset=0x48
 // #  pragma HLS INTERFACE s_axilite port=cfg->n2h.lossy offset=0x50
     GATEWAY_OFFSET(cfg->n2h.common.arbiter_gateway, 0x58, 0x60, 0x70)
     GATEWAY_OFFSET(cfg->n2h.custom_ring_gateway, 0x78, 0x80, 0x90)
+    GATEWAY_OFFSET(cfg->n2h.common.crossbar_gateway, 0x98, 0xa0, 0xb0)
 #  pragma HLS INTERFACE s_axilite port=stats->n2h offset=0x100
 
 #  pragma HLS INTERFACE s_axilite port=cfg->h2n.common.enable offset=0x410
     GATEWAY_OFFSET(cfg->h2n.common.flow_table_gateway, 0x418, 0x420, 0x430)
+#  pragma HLS INTERFACE s_axilite port=cfg->h2n.common.checksum_validate offset=0x440
+#  pragma HLS INTERFACE s_axilite port=cfg->h2n.common.udp_checksum offset=0x448
 // #  pragma HLS INTERFACE s_axilite port=cfg->h2n.lossy offset=0x450
     GATEWAY_OFFSET(cfg->h2n.common.arbiter_gateway, 0x458, 0x460, 0x470)
+    GATEWAY_OFFSET(cfg->h2n.common.crossbar_gateway, 0x478, 0x480, 0x490)
 #  pragma HLS INTERFACE s_axilite port=stats->h2n offset=0x500
 
 #  pragma HLS INTERFACE s_axilite port=stats->flow_table_size offset=0x800
@@ -362,10 +376,12 @@ void nica(mlx::stream& prt_nw2sbu, mlx::stream& sbu2prt_nw, mlx::stream& prt_cx2
 
         n2h.nica_step(prt_nw2sbu, sbu2prt_cx,
             cfg->n2h, stats->n2h, &events[TRACE_N2H],
-            BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, ik_buf), n2h_tc_out, n2h_tc_in);
+            BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, ik_buf), n2h_tc_out, n2h_tc_in,
+            n2h_ft_mem);
         h2n.nica_step(prt_cx2sbu, sbu2prt_nw,
             cfg->h2n, stats->h2n, &events[TRACE_H2N],
-            BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, ik_buf), h2n_tc_out, h2n_tc_in);
+            BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, ik_buf), h2n_tc_out, h2n_tc_in,
+            h2n_ft_mem);
 
 #define BOOST_PP_LOCAL_MACRO(n) \
         linker ## n.link(ik_buf ## n, ik ## n);
@@ -81,7 +81,7 @@ for p in pkts:
             p[IP].len = payload_len + 20 + 8 + bth_len + icrc_len
             p[UDP].len = payload_len + 8 + bth_len + icrc_len
             p[UDP].chksum = 0
-            p[IP].chksum = 0
+            del p[IP].chksum
             #print 'IP: %d, UDP: %d, payload: %d' % (p[IP].len, p[UDP].len, \
             #    len(p[UDP].payload))
             #p[UDP].payload.show2()
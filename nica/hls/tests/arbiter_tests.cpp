@@ -75,6 +75,90 @@ namespace {
             }
         }
 
+        /* Write packets of the given length in bytes */
+        void write_sized_packets(int port_index, int count, int length) {
+            int flits = ALIGN(length, MLX_AXI4_WIDTH_BYTES) / MLX_AXI4_WIDTH_BYTES;
+            for (int i = 0; i < count; ++i) {
+                udp_builder_metadata m;
+                m.length = length;
+                m.ip_identification = ip_id(port_index, i);
+
+                meta[port_index].write(m);
+
+                for (int j = 0; j < flits; ++j) {
+                    port[port_index].write(axi_data(flit_id(m.ip_identification, j), 0xffffffff, j == flits - 1));
+                }
+            }
+        }
+
+        /* Cycles from writing a one-flit packet to port 1 until it leaves,
+         * while port 0 is backlogged with bulk packets. */
+        int queueing_delay()
+        {
+            const int bulk_packets = 100, bulk_flits = 8;
+            const int total_flits = bulk_packets * bulk_flits + 1;
+            const axi_data probe(flit_id(ip_id(1, 0), 0), 0xffffffff, true);
+            int delay = -1;
+
+            write_sized_packets(0, bulk_packets, bulk_flits * MLX_AXI4_WIDTH_BYTES);
+            /* Metadata FIFOs are unbounded in C simulation, so keep the
+             * number of bulk packets already committed to the output small */
+            for (int i = 0; i < 10; ++i)
+                progress();
+            write_sized_packets(1, 1, 1);
+
+            for (int cycle = 0, flits = 0; flits < total_flits && cycle < total_flits * 10; ++cycle) {
+                progress();
+                while (!out.empty()) {
+                    axi_data d = out.read();
+                    if (d == probe)
+                        delay = cycle;
+                    ++flits;
+                }
+            }
+            while (!hdr_out.empty())
+                hdr_out.read();
+
+            return delay;
+        }
+
+        /* Run until total_flits words have left, and return the number of
+         * cycles from the first to the last one */
+        int egress_cycles(int total_flits)
+        {
+            int first = -1, last = -1, flits = 0;
+
+            for (int cycle = 0; flits < total_flits && cycle < total_flits * 10; ++cycle) {
+                progress();
+                while (!out.empty()) {
+                    out.read();
+                    if (first < 0)
+                        first = cycle;
+                    last = cycle;
+                    ++flits;
+                }
+            }
+            EXPECT_EQ(total_flits, flits);
+
+            return last - first + 1;
+        }
+
+        /* Read packets written with write_sized_packets */
+        void read_packets_of_port(int port_index, int count, int flits) {
+            for (int i = 0; i < count; ++i) {
+                ASSERT_FALSE(hdr_out.empty()) << i;
+                udp_builder_metadata m_out = hdr_out.read();
+                EXPECT_EQ(ip_id(port_index, i), m_out.ip_identification) << i;
+
+                for (int j = 0; j < flits; ++j) {
+                    axi_data d(flit_id(m_out.ip_identification, j), 0xffffffff, j == flits - 1);
+                    ASSERT_FALSE(out.empty()) << i;
+                    axi_data d_out = out.read();
+                    EXPECT_EQ(d, d_out) << i;
+                }
+            }
+        }
+
         int ip_id(int port_index, int pkt_id)
         {
             assert(port_index < NUM_TC);
@@ -148,6 +232,242 @@ namespace {
         }
     }
 
+    TEST_F(arbiter_tests, drr_bytes_shares)
+    {
+        const int packets = 200;
+        const int length[2] = {33, 64};
+        const int quantum[2] = {100, 200};
+        int flits = 0;
+
+        gateway.write(ARBITER_DRR_BYTES, 1);
+        EXPECT_EQ(1, gateway.read(ARBITER_DRR_BYTES));
+        for (int port_index = 0; port_index < 2; ++port_index) {
+            gateway.write(ARBITER_SCHEDULER + ARBITER_SCHEDULER_STRIDE * port_index + SCHED_DRR_QUANTUM,
+                          quantum[port_index]);
+            write_sized_packets(port_index, packets, length[port_index]);
+            flits += packets * (ALIGN(length[port_index], MLX_AXI4_WIDTH_BYTES) / MLX_AXI4_WIDTH_BYTES);
+        }
+        for (int i = 0; i < flits * 10 && int(out.size()) < flits; ++i)
+            progress();
+        EXPECT_EQ(flits, int(out.size()));
+
+        /* Compare the bytes each port sent while both were backlogged */
+        int bytes[2] = {}, sent[2] = {};
+        while (!hdr_out.empty() && sent[0] < packets && sent[1] < packets) {
+            udp_builder_metadata m = hdr_out.read();
+            int port_index = m.ip_identification >> 8;
+            ASSERT_LT(port_index, 2);
+            bytes[port_index] += m.length;
+            ++sent[port_index];
+        }
+        ASSERT_GT(bytes[0], 0);
+        EXPECT_NEAR(double(bytes[1]) / bytes[0], double(quantum[1]) / quantum[0], 0.1);
+
+        while (!hdr_out.empty())
+            hdr_out.read();
+        while (!out.empty())
+            out.read();
+        gateway.write(ARBITER_DRR_BYTES, 0);
+    }
+
+    TEST_F(arbiter_tests, priority_queueing_delay)
+    {
+        const int port1_priority = ARBITER_SCHEDULER + ARBITER_SCHEDULER_STRIDE + ARBITER_SCHED_PRIORITY;
+
+        /* Quanta that let port 0 send its whole backlog in one round */
+        for (int port_index = 0; port_index < 2; ++port_index)
+            gateway.write(ARBITER_SCHEDULER + ARBITER_SCHEDULER_STRIDE * port_index + SCHED_DRR_QUANTUM, 1000);
+
+        int drr_delay = queueing_delay();
+        gateway.write(port1_priority, 1);
+        EXPECT_EQ(1, gateway.read(port1_priority));
+        int priority_delay = queueing_delay();
+        gateway.write(port1_priority, 0);
+
+        EXPECT_GE(priority_delay, 0);
+        EXPECT_GE(drr_delay, 0);
+        EXPECT_LT(priority_delay * 4, drr_delay) << "priority delay " << priority_delay
+                                                 << ", DRR delay " << drr_delay;
+    }
+
+    TEST_F(arbiter_tests, shaper)
+    {
+        const int packets = 40, length = 64;
+        const int flits = ALIGN(length, MLX_AXI4_WIDTH_BYTES) / MLX_AXI4_WIDTH_BYTES;
+        /* One byte per cycle */
+        const int rate = ARBITER_SHAPER_TICK, burst = 128;
+        const int port0 = ARBITER_SCHEDULER;
+        int sent[2] = {}, done[2] = {-1, -1};
+
+        for (int port_index = 0; port_index < 2; ++port_index)
+            gateway.write(ARBITER_SCHEDULER + ARBITER_SCHEDULER_STRIDE * port_index + SCHED_DRR_QUANTUM, 2 * flits);
+        gateway.write(port0 + ARBITER_SHAPER_BURST, burst);
+        gateway.write(port0 + ARBITER_SHAPER_RATE, rate);
+        EXPECT_EQ(rate, gateway.read(port0 + ARBITER_SHAPER_RATE));
+        EXPECT_EQ(burst, gateway.read(port0 + ARBITER_SHAPER_BURST));
+
+        write_sized_packets(0, packets, length);
+        write_sized_packets(1, packets, length);
+        for (int cycle = 0; cycle < packets * length * 2 && (done[0] < 0 || done[1] < 0); ++cycle) {
+            progress();
+            while (!hdr_out.empty()) {
+                udp_builder_metadata m = hdr_out.read();
+                int port_index = m.ip_identification >> 8;
+                ASSERT_LT(port_index, 2);
+                if (++sent[port_index] == packets)
+                    done[port_index] = cycle;
+            }
+            while (!out.empty())
+                out.read();
+        }
+
+        /* The shaped port sends its first burst and then its rate, and
+         * does not hold back the other one */
+        const int expected = (packets * length - burst) * ARBITER_SHAPER_TICK / rate;
+        EXPECT_NEAR(done[0], expected, expected / 10);
+        EXPECT_GE(done[1], 0);
+        EXPECT_LT(done[1], done[0] / 4);
+
+        gateway.write(port0 + ARBITER_SHAPER_RATE, 0);
+    }
+
+    TEST_F(arbiter_tests, back_to_back_single_port)
+    {
+        const int packets = 64, length = 64;
+        const int flits = ALIGN(length, MLX_AXI4_WIDTH_BYTES) / MLX_AXI4_WIDTH_BYTES;
+
+        gateway.write(ARBITER_SCHEDULER + ARBITER_SCHEDULER_STRIDE * 2 + SCHED_DRR_QUANTUM, packets * flits);
+        write_sized_packets(2, packets, length);
+        EXPECT_EQ(packets * flits, egress_cycles(packets * flits)) << "one word per cycle";
+
+        while (!hdr_out.empty())
+            hdr_out.read();
+    }
+
+    TEST_F(arbiter_tests, back_to_back_port_switches)
+    {
+        const int packets = 64, length = 64;
+        const int flits = ALIGN(length, MLX_AXI4_WIDTH_BYTES) / MLX_AXI4_WIDTH_BYTES;
+
+        /* Four packets per DRR round */
+        for (int port_index = 0; port_index < 2; ++port_index) {
+            gateway.write(ARBITER_SCHEDULER + ARBITER_SCHEDULER_STRIDE * port_index + SCHED_DRR_QUANTUM, 4 * flits);
+            write_sized_packets(port_index, packets, length);
+        }
+        EXPECT_EQ(2 * packets * flits, egress_cycles(2 * packets * flits)) << "one word per cycle";
+
+        int switches = 0, last_port = -1;
+        while (!hdr_out.empty()) {
+            udp_builder_metadata m = hdr_out.read();
+            int port_index = m.ip_identification >> 8;
+            if (last_port >= 0 && port_index != last_port)
+                ++switches;
+            last_port = port_index;
+        }
+        EXPECT_GE(switches, packets / 4) << "TC switches";
+    }
+
+    TEST_F(arbiter_tests, watchdog)
+    {
+        const int timeout = 100, flits = 4;
+        const int stalled = ip_id(0, 0);
+
+        gateway.write(ARBITER_WATCHDOG_TIMEOUT, timeout);
+        /* A packet whose ikernel stalls after half of its data */
+        udp_builder_metadata m;
+        m.length = flits * MLX_AXI4_WIDTH_BYTES;
+        m.ip_identification = stalled;
+        meta[0].write(m);
+        for (int j = 0; j < flits / 2; ++j)
+            port[0].write(axi_data(flit_id(stalled, j), 0xffffffff, false));
+        for (int i = 0; i < 10; ++i)
+            progress();
+        ap_uint<64> port0_words = stats.tx_port[0].words;
+        ap_uint<64> port1_packets = stats.tx_port[1].packets;
+        write_sized_packets(1, 8, 2 * MLX_AXI4_WIDTH_BYTES);
+
+        for (int i = 0; i < timeout * 2; ++i)
+            progress();
+
+        EXPECT_EQ(1, stats.tx_port[0].truncated);
+        EXPECT_EQ(0, stats.tx_port[0].words - port0_words) << "the closing empty word is not counted";
+        EXPECT_EQ(1, stats.faulted);
+        EXPECT_EQ(1, gateway.read(ARBITER_WATCHDOG_FAULTED));
+        EXPECT_EQ(8, stats.tx_port[1].packets - port1_packets) << "other ports keep going";
+
+        /* The truncated packet ends with an empty word */
+        udp_builder_metadata m_out = hdr_out.read();
+        EXPECT_EQ(stalled, m_out.ip_identification);
+        for (int j = 0; j < flits / 2; ++j)
+            EXPECT_EQ(axi_data(flit_id(stalled, j), 0xffffffff, false), axi_data(out.read()));
+        EXPECT_EQ(axi_data(0, 0, true), axi_data(out.read()));
+        read_packets_of_port(1, 8, 2);
+
+        /* A faulted port is not scheduled until its fault is cleared. The
+         * ikernel is reset meanwhile, so the next packet's data only comes
+         * after the fault is cleared. */
+        m.length = MLX_AXI4_WIDTH_BYTES;
+        m.ip_identification = ip_id(0, 0);
+        meta[0].write(m);
+        for (int i = 0; i < 20; ++i)
+            progress();
+        EXPECT_TRUE(hdr_out.empty());
+
+        gateway.write(ARBITER_WATCHDOG_FAULTED, 1);
+        EXPECT_EQ(0, gateway.read(ARBITER_WATCHDOG_FAULTED));
+        port[0].write(axi_data(flit_id(m.ip_identification, 0), 0xffffffff, true));
+        for (int i = 0; i < 20; ++i)
+            progress();
+        EXPECT_FALSE(hdr_out.empty());
+        read_packets_of_port(0, 1, 1);
+
+        gateway.write(ARBITER_WATCHDOG_TIMEOUT, 0);
+    }
+
+    TEST_F(arbiter_tests, watchdog_resume)
+    {
+        const int timeout = 100, flits = 4;
+        const int stalled = ip_id(0, 0);
+
+        gateway.write(ARBITER_WATCHDOG_TIMEOUT, timeout);
+        udp_builder_metadata m;
+        m.length = flits * MLX_AXI4_WIDTH_BYTES;
+        m.ip_identification = stalled;
+        meta[0].write(m);
+        for (int j = 0; j < flits / 2; ++j)
+            port[0].write(axi_data(flit_id(stalled, j), 0xffffffff, false));
+        for (int i = 0; i < timeout * 2; ++i)
+            progress();
+        EXPECT_EQ(1, stats.tx_port[0].truncated);
+        ap_uint<64> port0_words = stats.tx_port[0].words;
+
+        /* The ikernel resumes after the timeout: the rest of the truncated
+         * packet is dropped */
+        for (int j = flits / 2; j < flits; ++j)
+            port[0].write(axi_data(flit_id(stalled, j), 0xffffffff, j == flits - 1));
+        for (int i = 0; i < 20; ++i)
+            progress();
+        EXPECT_TRUE(port[0].empty());
+        EXPECT_EQ(port0_words, stats.tx_port[0].words);
+
+        udp_builder_metadata m_out = hdr_out.read();
+        EXPECT_EQ(stalled, m_out.ip_identification);
+        for (int j = 0; j < flits / 2; ++j)
+            EXPECT_EQ(axi_data(flit_id(stalled, j), 0xffffffff, false), axi_data(out.read()));
+        EXPECT_EQ(axi_data(0, 0, true), axi_data(out.read()));
+        EXPECT_TRUE(out.empty());
+
+        /* Once the fault is cleared, the port's next packets are intact */
+        gateway.write(ARBITER_WATCHDOG_FAULTED, 1);
+        write_sized_packets(0, 2, 2 * MLX_AXI4_WIDTH_BYTES);
+        for (int i = 0; i < 20; ++i)
+            progress();
+        read_packets_of_port(0, 2, 2);
+        EXPECT_EQ(1, stats.tx_port[0].truncated);
+
+        gateway.write(ARBITER_WATCHDOG_TIMEOUT, 0);
+    }
+
     class demux_tests : public arbiter_tests {
     protected:
         hls_ik::data_stream passthrough_data_in, demux_data;
@@ -23,19 +23,26 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
 
-#define CACHE_ENABLE_DEBUG_COMMANDS
-
 #include "flow_table_impl.hpp"
 #include "ikernel_tests.hpp"
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
 typedef hash_flow_table_t::value_type value_type;
 typedef hash_flow_table_t::maybe_value_t maybe_value_t;
 typedef hash_flow_table_t::tag_type tag_type;
 
-/* Instantiate here to make sure the code instantiated notices the
- * CACHE_ENABLE_DEBUG_COMMANDS definition */
-template class ntl::hash_table_wrapper<flow, flow_table_value, FLOW_TABLE_SIZE>;
+/* Instantiate here to make sure all table members compile */
+template class cuckoo_table<flow, flow_table_value, FLOW_TABLE_SIZE, FT_CUCKOO_WAYS,
+                            FT_STASH_SIZE, FT_CUCKOO_MAX_KICKS>;
+
+/* Updates may wait for a previous flow's displacement to complete */
+static const int update_retries = 2 * FT_CUCKOO_MAX_KICKS + 30;
 
 using std::make_tuple;
 using std::get;
@@ -48,17 +55,23 @@ using ntl::maybe;
 using ntl::make_maybe;
 
 void flow_table_top(header_stream& header, result_stream& result,
-                    gateway_registers& g);
+                    counter_update_stream& counter_updates,
+                    gateway_registers& g, hls_ik::memory_t& mem,
+                    flow_table_stats* stats);
 namespace {
     class flow_table_tests : public ::testing::Test {
     protected:
         flow_table_wrapper gateway;
         header_stream header;
         result_stream result;
+        counter_update_stream counter_updates;
         gateway_registers regs;
+        hls_ik::memory_t mem;
+        flow_table_stats stats;
+        ntl::tests::memory_model<DDR_INTERFACE_WIDTH> dram;
 
         flow_table_tests() :
-            gateway([&]() { flow_table_top(header, result, regs); }, regs)
+            gateway([&]() { progress(); }, regs)
         {}
 
         // SetUp() is run immediately before a test starts.
@@ -80,11 +93,14 @@ namespace {
             gateway.write(FT_KEY_DADDR, f.daddr);
             gateway.write(FT_KEY_SPORT, f.source_port);
             gateway.write(FT_KEY_DPORT, f.dest_port);
+            gateway.write(FT_KEY_VM_ID, f.vm_id);
+            gateway.write(FT_KEY_VLAN_ID, f.vlan_id);
+            gateway.write(FT_KEY_IPV6, f.ipv6);
             gateway.write(FT_RESULT_ACTION, result.action);
             gateway.write(FT_RESULT_ENGINE, result.engine_id);
             gateway.write(FT_RESULT_IKERNEL_ID, result.ikernel_id);
 
-            return gateway.read(FT_ADD_FLOW, 15);
+            return gateway.read(FT_ADD_FLOW, update_retries);
         }
 
         int delete_flow(const hash_flow_table_t::tag_type& f)
@@ -93,8 +109,11 @@ namespace {
             gateway.write(FT_KEY_DADDR, f.daddr);
             gateway.write(FT_KEY_SPORT, f.source_port);
             gateway.write(FT_KEY_DPORT, f.dest_port);
+            gateway.write(FT_KEY_VM_ID, f.vm_id);
+            gateway.write(FT_KEY_VLAN_ID, f.vlan_id);
+            gateway.write(FT_KEY_IPV6, f.ipv6);
 
-            return gateway.read(FT_DELETE_FLOW, 15);
+            return gateway.read(FT_DELETE_FLOW, update_retries);
         }
 
         maybe_value_t get_entry(uint32_t address)
@@ -114,9 +133,107 @@ namespace {
                 flow_table_value(flow_table_action(action), ikernel, ikernel_id)));
         }
 
+        void set_rule(int index, const flow& key, const flow& mask, int priority,
+                      const flow_table_value& value, bool valid = true)
+        {
+            gateway.write(FT_KEY_SADDR, key.saddr);
+            gateway.write(FT_KEY_DADDR, key.daddr);
+            gateway.write(FT_KEY_SPORT, key.source_port);
+            gateway.write(FT_KEY_DPORT, key.dest_port);
+            gateway.write(FT_MASK_SADDR, mask.saddr);
+            gateway.write(FT_MASK_DADDR, mask.daddr);
+            gateway.write(FT_MASK_SPORT, mask.source_port);
+            gateway.write(FT_MASK_DPORT, mask.dest_port);
+            gateway.write(FT_KEY_VLAN_ID, key.vlan_id);
+            gateway.write(FT_MASK_VLAN_ID, mask.vlan_id);
+            gateway.write(FT_KEY_IPV6, key.ipv6);
+            gateway.write(FT_MASK_IPV6, mask.ipv6);
+            gateway.write(FT_RULE_PRIORITY, priority);
+            gateway.write(FT_RESULT_ACTION, value.action);
+            gateway.write(FT_RESULT_ENGINE, value.engine_id);
+            gateway.write(FT_RESULT_IKERNEL_ID, value.ikernel_id);
+            gateway.write(FT_VALID, valid);
+            gateway.write(FT_SET_RULE, index);
+        }
+
+        flow_table_result lookup(const flow& f)
+        {
+            udp::header_parser hdr;
+            hdr.udp.source = f.source_port;
+            hdr.udp.dest = f.dest_port;
+            hdr.ip.saddr = f.saddr;
+            hdr.ip.daddr = f.daddr;
+            udp::header_buffer buf = hdr;
+            if (f.vlan_id) {
+                buf.vlan.count = 1;
+                buf.vlan.outer = f.vlan_id;
+            }
+            buf.ipv6 = f.ipv6;
+            return lookup(buf);
+        }
+
+        flow_table_result lookup(const udp::header_buffer& buf)
+        {
+            header.write(buf);
+
+            for (int i = 0; i < 30 && result.empty(); ++i)
+                progress();
+
+            EXPECT_FALSE(result.empty());
+            return result.read();
+        }
+
+        /* Apply a batch of additions or deletions, returning the number of
+         * successful entries and filling per-entry results */
+        int batch(const std::vector<value_type>& entries, bool add,
+                  std::vector<uint32_t>& results)
+        {
+            gateway.write(FT_BATCH_RESET, 0);
+            for (auto& e : entries) {
+                flow f;
+                flow_table_value v;
+                std::tie(f, v) = e;
+
+                gateway.write(FT_BATCH_DATA, f.saddr);
+                gateway.write(FT_BATCH_DATA, f.daddr);
+                gateway.write(FT_BATCH_DATA, int(f.source_port) << 16 | int(f.dest_port));
+                gateway.write(FT_BATCH_DATA, int(v.action) | int(v.engine_id) << 8 |
+                                             int(v.ikernel_id) << 16);
+            }
+
+            EXPECT_EQ(entries.size() * FT_BATCH_ENTRY_WORDS, gateway.read(FT_BATCH_DATA));
+            int succeeded = gateway.read(add ? FT_BATCH_ADD : FT_BATCH_DELETE,
+                                         15 * (entries.size() + 1));
+            results.clear();
+            for (size_t i = 0; i < entries.size(); ++i)
+                results.push_back(gateway.read(FT_BATCH_RESULT));
+
+            /* Tagged results repeat the same results after a seek */
+            if (!entries.empty()) {
+                gateway.write(FT_BATCH_RESULT, 0);
+                for (size_t i = 0; i < entries.size(); ++i) {
+                    uint32_t tagged = gateway.read(FT_BATCH_TAGGED_RESULT);
+                    EXPECT_EQ(i + 1, tagged >> FLOW_ID_WIDTH) << i;
+                    EXPECT_EQ(results[i], tagged & ((1 << FLOW_ID_WIDTH) - 1)) << i;
+                }
+            }
+
+            return succeeded;
+        }
+
+        /* Read a counter as (packets, bytes) */
+        std::tuple<uint32_t, uint64_t> read_counter()
+        {
+            uint32_t packets = gateway.read(FT_COUNTER_DATA, 5);
+            uint64_t bytes = uint32_t(gateway.read(FT_COUNTER_DATA));
+            bytes |= uint64_t(gateway.read(FT_COUNTER_DATA)) << 32;
+            return make_tuple(packets, bytes);
+        }
+
         void progress()
         {
-            flow_table_top(header, result, regs);
+            flow_table_top(header, result, counter_updates, regs, mem, &stats);
+            dram.mem(mem);
         }
     };
 
@@ -142,6 +259,651 @@ namespace {
             }
         }
     }
+
+    TEST_F(flow_table_tests, batch)
+    {
+        std::vector<value_type> entries;
+        std::vector<uint32_t> results, added;
+
+        for (int i = 0; i < 200; ++i)
+            entries.push_back(make_tuple(flow(i, 11211, 0x0a000000 + i, 0x0a000001),
+                                         flow_table_value(FT_IKERNEL, i & 1, i & 0x3f)));
+
+        /* Entries may fail due to hash collisions, but results must be
+         * reported per entry */
+        int succeeded = batch(entries, true, added);
+        EXPECT_GT(succeeded, 0);
+        EXPECT_EQ(succeeded, std::count_if(added.begin(), added.end(),
+                                           [](uint32_t r) { return r != 0; }));
+        for (int i = 0; i < 200; ++i) {
+            if (!added[i])
+                continue;
+            maybe_value_t entry = get_entry(added[i] - 1);
+            EXPECT_TRUE(entry.valid());
+            EXPECT_EQ(entries[i], entry.value());
+        }
+
+        /* Adding the same flows again fails for every entry */
+        EXPECT_EQ(0, batch(entries, true, results));
+        for (int i = 0; i < 200; ++i)
+            EXPECT_EQ(0, results[i]) << i;
+
+        EXPECT_EQ(succeeded, batch(entries, false, results));
+        for (int i = 0; i < 200; ++i)
+            EXPECT_EQ(bool(added[i]), bool(results[i])) << i;
+
+        EXPECT_EQ(0, batch(entries, false, results));
+    }
+
+    TEST_F(flow_table_tests, wildcard_rules)
+    {
+        const flow any_source = flow(0, 0xffff, 0, 0xffffffff);
+        const flow exact = flow(0xffff, 0xffff, 0xffffffff, 0xffffffff);
+        const flow_table_value memcached(FT_IKERNEL, 0, 3);
+        const flow_table_value blocked(FT_DROP);
+        const flow_table_value special(FT_IKERNEL, 1, 4);
+
+        gateway.set_fields(FT_FIELD_SRC_IP | FT_FIELD_DST_IP |
+                           FT_FIELD_SRC_PORT | FT_FIELD_DST_PORT);
+        set_rule(0, flow(0, 11211, 0, 0x0a000001), any_source, 1, memcached);
+        set_rule(2, flow(0, 0, 0, 0x0a000001), flow(0, 0, 0, 0xffffffff), 0, flow_table_value(FT_PASSTHROUGH));
+
+        /* Any client matches the wildcard rule */
+        for (int i = 0; i < 10; ++i) {
+            flow_table_result res = lookup(flow(1000 + i, 11211, 0x0a000100 + i, 0x0a000001));
+            EXPECT_EQ(memcached, res.v);
+            EXPECT_EQ(FT_RULE_FLOW_ID_BASE + 0, res.flow_id);
+        }
+
+        /* A higher priority rule overrides the wildcard one, regardless of
+         * rule order */
+        set_rule(1, flow(1000, 11211, 0x0a000063, 0x0a000001), exact, 2, blocked);
+        flow_table_result res = lookup(flow(1000, 11211, 0x0a000063, 0x0a000001));
+        EXPECT_EQ(blocked, res.v);
+        EXPECT_EQ(FT_RULE_FLOW_ID_BASE + 1, res.flow_id);
+
+        /* Lower priority rule for the rest of the traffic to that address */
+        res = lookup(flow(1000, 80, 0x0a000063, 0x0a000001));
+        EXPECT_EQ(flow_table_value(FT_PASSTHROUGH), res.v);
+        EXPECT_EQ(FT_RULE_FLOW_ID_BASE + 2, res.flow_id);
+
+        /* Exact matches take precedence over wildcard rules */
+        flow f(1001, 11211, 0x0a000101, 0x0a000001);
+        uint32_t index = add_flow(make_tuple(f, special));
+        EXPECT_NE(0, index);
+        res = lookup(f);
+        EXPECT_EQ(special, res.v);
+        EXPECT_EQ(index, res.flow_id);
+        EXPECT_TRUE(delete_flow(f));
+
+        /* Unmatched traffic passes through */
+        res = lookup(flow(1000, 11211, 0x0a000063, 0x0a000002));
+        EXPECT_EQ(flow_table_value(FT_PASSTHROUGH), res.v);
+        EXPECT_EQ(0, res.flow_id);
+
+        /* Invalidated rules no longer match */
+        for (int i = 0; i < 3; ++i)
+            set_rule(i, flow(), flow(), 0, flow_table_value(), false);
+        res = lookup(flow(1000, 11211, 0x0a000100, 0x0a000001));
+        EXPECT_EQ(0, res.flow_id);
+    }
+
+    TEST_F(flow_table_tests, counters)
+    {
+        gateway.read(FT_COUNTER_CLEAR_ALL, 3 * FT_TOTAL_COUNTERS + 10);
+
+        for (int i = 0; i < 10; ++i) {
+            counter_updates.write(flow_counter_update(1, 100 + i));
+            counter_updates.write(flow_counter_update(FT_COUNTERS - 1, 1500));
+            progress();
+            progress();
+        }
+        /* Flows of the DRAM table are not counted */
+        counter_updates.write(flow_counter_update(FT_L2_FLOW_ID_BASE, 64));
+        for (int i = 0; i < 5; ++i)
+            progress();
+
+        /* Reading all counters sequentially */
+        gateway.write(FT_COUNTER_CLEAR_ON_READ, 0);
+        gateway.write(FT_COUNTER_INDEX, 0);
+        for (int i = 0; i < FT_COUNTERS; ++i) {
+            uint32_t packets;
+            uint64_t bytes;
+            std::tie(packets, bytes) = read_counter();
+            if (i == 1) {
+                EXPECT_EQ(10u, packets);
+                EXPECT_EQ(1045, bytes);
+            } else if (i == FT_COUNTERS - 1) {
+                EXPECT_EQ(10u, packets);
+                EXPECT_EQ(15000, bytes);
+            } else {
+                EXPECT_EQ(0u, packets) << i;
+                EXPECT_EQ(0u, bytes) << i;
+            }
+        }
+
+        /* Clear on read resets only the counters read */
+        gateway.write(FT_COUNTER_CLEAR_ON_READ, 1);
+        gateway.write(FT_COUNTER_INDEX, 1);
+        EXPECT_EQ(make_tuple(10u, uint64_t(1045)), read_counter());
+        gateway.write(FT_COUNTER_INDEX, 1);
+        EXPECT_EQ(make_tuple(0u, uint64_t(0)), read_counter());
+        gateway.write(FT_COUNTER_INDEX, FT_COUNTERS - 1);
+        gateway.write(FT_COUNTER_CLEAR_ON_READ, 0);
+        EXPECT_EQ(make_tuple(10u, uint64_t(15000)), read_counter());
+
+        gateway.read(FT_COUNTER_CLEAR_ALL, 3 * FT_TOTAL_COUNTERS + 10);
+        gateway.write(FT_COUNTER_INDEX, FT_COUNTERS - 1);
+        EXPECT_EQ(make_tuple(0u, uint64_t(0)), read_counter());
+    }
+
+    TEST_F(flow_table_tests, dram_table)
+    {
+        const int num_flows = FLOW_TABLE_SIZE + 256;
+        std::vector<uint32_t> ids;
+
+        gateway.set_fields(FT_FIELD_SRC_IP | FT_FIELD_DST_IP |
+                           FT_FIELD_SRC_PORT | FT_FIELD_DST_PORT);
+        gateway.write(FT_L2_BASE, 0);
+        gateway.write(FT_L2_LOG_SIZE, 10);
+        EXPECT_EQ(10, gateway.read(FT_L2_LOG_SIZE));
+
+        /* More flows than fit on-chip: the rest go to DRAM */
+        int in_dram = 0;
+        for (int i = 0; i < num_flows; ++i) {
+            flow f(i, 11211, 0x0b000000 + i, 0x0a000001);
+            uint32_t id = add_flow(make_tuple(f, flow_table_value(FT_IKERNEL, 0, i & 0x3f)));
+            ASSERT_NE(0, id) << i;
+            ids.push_back(id);
+            in_dram += id >= FT_L2_FLOW_ID_BASE;
+        }
+        EXPECT_GE(in_dram, num_flows - FLOW_TABLE_CAPACITY);
+
+        const flow_table_stats before = stats;
+        for (int i = 0; i < num_flows; ++i) {
+            flow_table_result res = lookup(flow(i, 11211, 0x0b000000 + i, 0x0a000001));
+            EXPECT_EQ(ids[i], res.flow_id) << i;
+            EXPECT_EQ(flow_table_value(FT_IKERNEL, 0, i & 0x3f), res.v) << i;
+        }
+        EXPECT_EQ(in_dram, stats.l2_hits - before.l2_hits);
+        EXPECT_EQ(num_flows - in_dram, stats.hits - before.hits);
+
+        /* Existing keys are not added again at either level */
+        for (int i = 0; i < num_flows; ++i) {
+            flow f(i, 11211, 0x0b000000 + i, 0x0a000001);
+            EXPECT_EQ(0, add_flow(make_tuple(f, flow_table_value(FT_IKERNEL, 0, 1)))) << i;
+        }
+
+        for (int i = 0; i < num_flows; ++i)
+            EXPECT_EQ(ids[i], delete_flow(flow(i, 11211, 0x0b000000 + i, 0x0a000001))) << i;
+
+        /* Deleting removes the only copy */
+        for (int i = 0; i < num_flows; ++i) {
+            flow f(i, 11211, 0x0b000000 + i, 0x0a000001);
+            EXPECT_EQ(0, delete_flow(f)) << i;
+            EXPECT_EQ(0, lookup(f).flow_id) << i;
+        }
+
+        /* Misses in both tables pass through, without waiting for DRAM once
+         * it is empty */
+        const uint32_t l2_lookups = stats.l2_lookups;
+        flow_table_result res = lookup(flow(0, 11211, 0x0b000000, 0x0a000001));
+        EXPECT_EQ(0, res.flow_id);
+        EXPECT_EQ(flow_table_value(FT_PASSTHROUGH), res.v);
+        EXPECT_EQ(l2_lookups, stats.l2_lookups);
+        EXPECT_GT(stats.l2_latency_max, 0);
+
+        gateway.write(FT_L2_LOG_SIZE, 0);
+    }
+
+    TEST_F(flow_table_tests, cuckoo_occupancy)
+    {
+        std::mt19937 gen(47);
+        std::vector<value_type> added;
+        std::vector<uint32_t> ids;
+        int attempts[10] = {}, failures[10] = {};
+        int first_failure = 0;
+
+        gateway.set_fields(FT_FIELD_SRC_IP | FT_FIELD_DST_IP |
+                           FT_FIELD_SRC_PORT | FT_FIELD_DST_PORT);
+
+        /* Add random flows until the table is full or adds keep failing,
+         * recording the success rate per tenth of the capacity */
+        for (int i = 0; i < 2 * FLOW_TABLE_CAPACITY && added.size() < FLOW_TABLE_CAPACITY; ++i) {
+            value_type entry = make_tuple(flow(gen(), gen(), gen(), gen()),
+                                          flow_table_value(FT_IKERNEL, 0, i & 0x3f));
+            int decile = added.size() * 10 / FLOW_TABLE_CAPACITY;
+
+            ++attempts[decile];
+            if (uint32_t id = add_flow(entry)) {
+                added.push_back(entry);
+                ids.push_back(id);
+            } else {
+                ++failures[decile];
+                if (!first_failure)
+                    first_failure = added.size();
+            }
+        }
+
+        for (int d = 0; d < 10; ++d) {
+            if (!attempts[d])
+                continue;
+            std::cout << "occupancy " << d * 10 << "%-" << (d + 1) * 10 << "%: "
+                      << attempts[d] - failures[d] << "/" << attempts[d] << " added\n";
+        }
+        std::cout << "first failure at " << first_failure << "/" << FLOW_TABLE_CAPACITY << "\n";
+
+        /* Collisions alone should not fail adds before the table is 90% full */
+        for (int d = 0; d < 9; ++d)
+            EXPECT_EQ(0, failures[d]) << "occupancy " << d * 10 << "%";
+
+        /* Flows keep their flow IDs while they move in the table */
+        for (size_t i = 0; i < added.size(); ++i) {
+            flow_table_result res = lookup(get<0>(added[i]));
+            EXPECT_EQ(ids[i], res.flow_id) << i;
+            EXPECT_EQ(get<1>(added[i]), res.v) << i;
+        }
+
+        for (size_t i = 0; i < added.size(); ++i)
+            EXPECT_EQ(ids[i], delete_flow(get<0>(added[i]))) << i;
+        EXPECT_EQ(0, lookup(get<0>(added[0])).flow_id);
+    }
+
+    TEST_F(flow_table_tests, idle_timeout)
+    {
+        const flow active(1, 2, 0x0b000001, 0x0b000002);
+        const flow idle(3, 4, 0x0b000003, 0x0b000004);
+        const flow_table_value value(FT_IKERNEL, 0, 1);
+        const flow_table_stats before = stats;
+
+        gateway.set_fields(FT_FIELD_SRC_IP | FT_FIELD_DST_IP |
+                           FT_FIELD_SRC_PORT | FT_FIELD_DST_PORT);
+        uint32_t active_id = add_flow(make_tuple(active, value));
+        uint32_t idle_id = add_flow(make_tuple(idle, value));
+        ASSERT_NE(0, active_id);
+        ASSERT_NE(0, idle_id);
+
+        gateway.write(FT_AGING_TICK, 1, 15);
+        gateway.write(FT_AGING_TIMEOUT, 3000, 15);
+        EXPECT_EQ(3000, gateway.read(FT_AGING_TIMEOUT));
+
+        /* Only the flow that receives no packets ages out */
+        for (int i = 0; i < 20; ++i) {
+            EXPECT_EQ(active_id, lookup(active).flow_id);
+            for (int j = 0; j < 300; ++j)
+                progress();
+        }
+        EXPECT_EQ(active_id, lookup(active).flow_id);
+        EXPECT_EQ(0, lookup(idle).flow_id);
+
+        std::vector<uint32_t> evicted;
+        for (uint32_t id; (id = gateway.read(FT_EVICTED));)
+            evicted.push_back(id);
+        EXPECT_NE(evicted.end(), std::find(evicted.begin(), evicted.end(), idle_id));
+        EXPECT_EQ(evicted.end(), std::find(evicted.begin(), evicted.end(), active_id));
+        EXPECT_EQ(evicted.size(), stats.evictions - before.evictions);
+
+        gateway.write(FT_AGING_TIMEOUT, 0, 15);
+        gateway.write(FT_AGING_TICK, FT_AGING_DEFAULT_TICK, 15);
+        EXPECT_FALSE(delete_flow(idle));
+        EXPECT_EQ(active_id, delete_flow(active));
+    }
+
+    TEST_F(flow_table_tests, eviction_backpressure)
+    {
+        const int num_flows = FT_EVICTED_SIZE + 16;
+        const flow_table_stats before = stats;
+        std::vector<uint32_t> ids;
+
+        gateway.set_fields(FT_FIELD_SRC_IP | FT_FIELD_DST_IP |
+                           FT_FIELD_SRC_PORT | FT_FIELD_DST_PORT);
+        for (int i = 0; i < num_flows; ++i) {
+            flow f(i, 11211, 0x0c000000 + i, 0x0a000001);
+            ids.push_back(add_flow(make_tuple(f, flow_table_value(FT_IKERNEL, 0, 1))));
+            ASSERT_NE(0, ids.back()) << i;
+        }
+
+        gateway.write(FT_AGING_TICK, 1, 15);
+        gateway.write(FT_AGING_TIMEOUT, 100, 15);
+        for (int i = 0; i < 4 * FLOW_TABLE_CAPACITY; ++i)
+            progress();
+
+        /* The queue filled up, and the rest of the idle flows wait in the
+         * table instead of being lost */
+        EXPECT_EQ(FT_EVICTED_SIZE, stats.evictions - before.evictions);
+        std::vector<uint32_t> evicted;
+        for (uint32_t id; (id = gateway.read(FT_EVICTED));)
+            evicted.push_back(id);
+        for (int i = 0; i < 4 * FLOW_TABLE_CAPACITY; ++i)
+            progress();
+        for (uint32_t id; (id = gateway.read(FT_EVICTED));)
+            evicted.push_back(id);
+
+        EXPECT_EQ(num_flows, stats.evictions - before.evictions);
+        std::sort(evicted.begin(), evicted.end());
+        std::sort(ids.begin(), ids.end());
+        EXPECT_EQ(ids, evicted);
+
+        gateway.write(FT_AGING_TIMEOUT, 0, 15);
+        gateway.write(FT_AGING_TICK, FT_AGING_DEFAULT_TICK, 15);
+    }
+
+    TEST_F(flow_table_tests, line_rate)
+    {
+        const int packets = 256;
+        const flow f(1, 2, 0x0c000001, 0x0c000002);
+
+        gateway.set_fields(FT_FIELD_SRC_IP | FT_FIELD_DST_IP |
+                           FT_FIELD_SRC_PORT | FT_FIELD_DST_PORT);
+        gateway.write(FT_L2_LOG_SIZE, 0);
+        uint32_t id = add_flow(make_tuple(f, flow_table_value(FT_IKERNEL, 0, 1)));
+        ASSERT_NE(0, id);
+
+        /* Back-to-back minimum-size packets, alternating hits and misses */
+        for (int i = 0; i < packets; ++i) {
+            const flow cur = i & 1 ? flow(i, 2, 0x0c000001, 0x0c000002) : f;
+            udp::header_parser hdr;
+            hdr.udp.source = cur.source_port;
+            hdr.udp.dest = cur.dest_port;
+            hdr.ip.saddr = cur.saddr;
+            hdr.ip.daddr = cur.daddr;
+            hdr.ip.tot_len = 46;
+            header.write(hdr);
+        }
+
+        std::vector<int> done;
+        for (int cycle = 0; cycle < 2 * packets && done.size() < packets; ++cycle) {
+            progress();
+            while (!result.empty()) {
+                flow_table_result res = result.read();
+                EXPECT_EQ(done.size() & 1 ? 0 : id, res.flow_id) << done.size();
+                done.push_back(cycle);
+            }
+        }
+
+        /* Once the pipeline fills, every cycle completes a lookup */
+        ASSERT_EQ(packets, done.size());
+        EXPECT_LE(done[0], 4);
+        for (int i = 1; i < packets; ++i)
+            EXPECT_EQ(done[i - 1] + 1, done[i]) << i;
+
+        EXPECT_EQ(id, delete_flow(f));
+    }
+
+    TEST_F(flow_table_tests, clear)
+    {
+        const flow other(1000, 7, 0x0d0000ff, 0x0d000001);
+        std::vector<flow> flows;
+
+        gateway.set_fields(FT_FIELD_SRC_IP | FT_FIELD_DST_IP |
+                           FT_FIELD_SRC_PORT | FT_FIELD_DST_PORT);
+        for (int i = 0; i < 100; ++i) {
+            flows.push_back(flow(i, 7, 0x0d000000 + i, 0x0d000001));
+            ASSERT_NE(0, add_flow(make_tuple(flows.back(), flow_table_value(FT_IKERNEL, 0, 1))));
+        }
+        set_rule(3, flow(0, 0, 0, 0x0d000001), flow(0, 0, 0, 0xffffffff), 0,
+                 flow_table_value(FT_DROP));
+        EXPECT_EQ(FT_RULE_FLOW_ID_BASE + 3, lookup(other).flow_id);
+
+        /* Clearing takes a few cycles regardless of the number of flows */
+        EXPECT_EQ(0, gateway.read(FT_CLEAR, 5));
+        for (auto& f : flows)
+            EXPECT_EQ(0, lookup(f).flow_id);
+        EXPECT_EQ(0, lookup(other).flow_id);
+        EXPECT_FALSE(delete_flow(flows[0]));
+
+        /* Flow IDs are allocated from the start again */
+        for (size_t i = 0; i < flows.size(); ++i)
+            EXPECT_EQ(i + 1, add_flow(make_tuple(flows[i], flow_table_value(FT_IKERNEL, 0, 1))));
+        for (size_t i = 0; i < flows.size(); ++i)
+            EXPECT_EQ(i + 1, lookup(flows[i]).flow_id);
+
+        /* A clear right after another one waits for the scrubber */
+        EXPECT_EQ(0, gateway.read(FT_CLEAR, 5));
+        EXPECT_EQ(0, gateway.read(FT_CLEAR, 2 * FLOW_TABLE_SIZE / FT_CUCKOO_WAYS + 10));
+        for (auto& f : flows)
+            EXPECT_EQ(0, lookup(f).flow_id);
+        EXPECT_NE(0, add_flow(make_tuple(flows[0], flow_table_value(FT_IKERNEL, 0, 1))));
+        EXPECT_EQ(0, gateway.read(FT_CLEAR, 2 * FLOW_TABLE_SIZE / FT_CUCKOO_WAYS + 10));
+    }
+
+    TEST_F(flow_table_tests, shadow)
+    {
+        /* Updates wait for the copy that follows a commit or an abort */
+        const int sync_retries = 3 * FLOW_TABLE_CAPACITY + update_retries;
+        const flow a(1, 7, 0x0e000001, 0x0e000001), b(2, 7, 0x0e000002, 0x0e000001),
+                   other(3, 7, 0x0e000003, 0x0e000001);
+        const flow_table_value old_value(FT_IKERNEL, 0, 1), new_value(FT_IKERNEL, 1, 2);
+
+        gateway.set_fields(FT_FIELD_SRC_IP | FT_FIELD_DST_IP |
+                           FT_FIELD_SRC_PORT | FT_FIELD_DST_PORT);
+        uint32_t old_id = add_flow(make_tuple(a, old_value));
+        ASSERT_NE(0, old_id);
+
+        /* Staged updates are not visible to packets */
+        gateway.write(FT_SHADOW, 1);
+        EXPECT_EQ(1, gateway.read(FT_SHADOW));
+        EXPECT_EQ(old_id, delete_flow(a));
+        uint32_t new_id = add_flow(make_tuple(a, new_value));
+        ASSERT_NE(0, new_id);
+        EXPECT_NE(old_id, new_id);
+        uint32_t b_id = add_flow(make_tuple(b, new_value));
+        ASSERT_NE(0, b_id);
+        set_rule(3, flow(0, 0, 0, 0x0e000001), flow(0, 0, 0, 0xffffffff), 0,
+                 flow_table_value(FT_DROP));
+
+        flow_table_result res = lookup(a);
+        EXPECT_EQ(old_id, res.flow_id);
+        EXPECT_EQ(old_value, res.v);
+        EXPECT_EQ(0, lookup(b).flow_id);
+        EXPECT_EQ(0, lookup(other).flow_id);
+
+        /* A packet classified before the commit completes with the old
+         * version */
+        udp::header_parser hdr;
+        hdr.udp.source = a.source_port;
+        hdr.udp.dest = a.dest_port;
+        hdr.ip.saddr = a.saddr;
+        hdr.ip.daddr = a.daddr;
+        header.write(hdr);
+        progress();
+        EXPECT_EQ(0, gateway.read(FT_COMMIT, 5));
+        for (int i = 0; i < 30 && result.empty(); ++i)
+            progress();
+        ASSERT_FALSE(result.empty());
+        EXPECT_EQ(old_id, result.read().flow_id);
+
+        res = lookup(a);
+        EXPECT_EQ(new_id, res.flow_id);
+        EXPECT_EQ(new_value, res.v);
+        EXPECT_EQ(b_id, lookup(b).flow_id);
+        EXPECT_EQ(FT_RULE_FLOW_ID_BASE + 3, lookup(other).flow_id);
+
+        /* The copy releases the replaced entry */
+        gateway.write(FT_KEY_SADDR, b.saddr);
+        gateway.write(FT_KEY_DADDR, b.daddr);
+        gateway.write(FT_KEY_SPORT, b.source_port);
+        gateway.write(FT_KEY_DPORT, b.dest_port);
+        EXPECT_EQ(b_id, gateway.read(FT_DELETE_FLOW, sync_retries));
+        EXPECT_FALSE(get_entry(old_id - 1).valid());
+        EXPECT_EQ(b_id, lookup(b).flow_id);
+
+        /* Dropping the staged updates keeps the active version */
+        gateway.write(FT_SHADOW, 0, sync_retries);
+        EXPECT_EQ(0, gateway.read(FT_SHADOW));
+        EXPECT_EQ(b_id, lookup(b).flow_id);
+        EXPECT_EQ(b_id, delete_flow(b));
+        EXPECT_EQ(0, lookup(b).flow_id);
+        EXPECT_EQ(new_id, lookup(a).flow_id);
+    }
+
+    TEST_F(flow_table_tests, vm_partitions)
+    {
+        const uint32_t vm1_addr = 0x0f000001, vm2_addr = 0x0f000002;
+        const flow_table_value value(FT_IKERNEL, 0, 1);
+
+        gateway.set_fields(FT_FIELD_SRC_IP | FT_FIELD_DST_IP | FT_FIELD_SRC_PORT |
+                           FT_FIELD_DST_PORT | FT_FIELD_VM_ID);
+        gateway.write(FT_VM_INDEX, 1);
+        gateway.write(FT_VM_ADDR, vm1_addr);
+        gateway.write(FT_VM_QUOTA, 2);
+        gateway.write(FT_VM_INDEX, 2);
+        gateway.write(FT_VM_ADDR, vm2_addr);
+
+        /* A tenant cannot take more than its quota */
+        std::vector<flow> flows;
+        for (int i = 0; i < 3; ++i)
+            flows.push_back(flow(i, 7, 0x0a000000 + i, vm1_addr, 1));
+        uint32_t id = add_flow(make_tuple(flows[0], value));
+        EXPECT_NE(0, id);
+        EXPECT_NE(0, add_flow(make_tuple(flows[1], value)));
+        EXPECT_EQ(0, add_flow(make_tuple(flows[2], value)));
+        gateway.write(FT_VM_INDEX, 1);
+        EXPECT_EQ(2, gateway.read(FT_VM_USED));
+
+        /* Other tenants can still add flows, and do not hit the flows of
+         * others even with the same addresses */
+        const flow spoof(0, 7, 0x0a000000, vm1_addr, 2);
+        EXPECT_NE(0, add_flow(make_tuple(spoof, flow_table_value(FT_DROP))));
+        flow_table_result res = lookup(flows[0]);
+        EXPECT_EQ(id, res.flow_id);
+        EXPECT_EQ(value, res.v);
+        EXPECT_EQ(1, res.vm_id);
+        EXPECT_TRUE(delete_flow(spoof));
+
+        /* Deleting a flow returns its entry to the quota */
+        EXPECT_EQ(id, delete_flow(flows[0]));
+        EXPECT_EQ(1, gateway.read(FT_VM_USED));
+        EXPECT_NE(0, add_flow(make_tuple(flows[2], value)));
+
+        /* Misses get the default result of their VM */
+        gateway.write(FT_RESULT_ACTION, FT_DROP);
+        gateway.write(FT_RESULT_ENGINE, 0);
+        gateway.write(FT_RESULT_IKERNEL_ID, 0);
+        gateway.write(FT_VM_INDEX, 2);
+        gateway.write(FT_VM_DEFAULT, 0);
+        res = lookup(flow(9, 9, 0x0a000009, vm2_addr));
+        EXPECT_EQ(0, res.flow_id);
+        EXPECT_EQ(FT_DROP, res.v.action);
+        EXPECT_EQ(2, res.vm_id);
+        res = lookup(flow(9, 9, 0x0a000009, vm1_addr));
+        EXPECT_EQ(FT_PASSTHROUGH, res.v.action);
+        EXPECT_EQ(1, res.vm_id);
+        EXPECT_EQ(0, lookup(flow(9, 9, 0x0a000009, 0x0a000001)).vm_id);
+
+        /* Per-VM counters follow the per-flow ones */
+        for (int i = 0; i < 2; ++i)
+            counter_updates.write(flow_counter_update(0, 100, 2));
+        counter_updates.write(flow_counter_update(FT_L2_FLOW_ID_BASE, 64, 1));
+        gateway.write(FT_COUNTER_INDEX, FT_VM_COUNTER_BASE + 1);
+        EXPECT_EQ(make_tuple(1u, uint64_t(64)), read_counter());
+        EXPECT_EQ(make_tuple(2u, uint64_t(200)), read_counter());
+    }
+
+    TEST_F(flow_table_tests, vlan)
+    {
+        const flow_table_value memcached(FT_IKERNEL, 0, 3);
+        const flow_table_value blocked(FT_DROP);
+
+        gateway.set_fields(FT_FIELD_DST_PORT | FT_FIELD_VLAN_ID);
+        flow f(0, 11211, 0, 0, 0, 100);
+        uint32_t index = add_flow(make_tuple(f, memcached));
+        EXPECT_NE(0, index);
+
+        /* Only packets tagged with the flow's VID match it */
+        flow_table_result res = lookup(flow(1000, 11211, 0x0a000002, 0x0a000001, 0, 100));
+        EXPECT_EQ(memcached, res.v);
+        EXPECT_EQ(index, res.flow_id);
+        EXPECT_EQ(0, lookup(flow(1000, 11211, 0x0a000002, 0x0a000001, 0, 101)).flow_id);
+        EXPECT_EQ(0, lookup(flow(1000, 11211, 0x0a000002, 0x0a000001)).flow_id);
+
+        /* A wildcard rule matching a whole VLAN */
+        set_rule(0, flow(0, 0, 0, 0, 0, 200), flow(0, 0, 0, 0, 0, 0xfff), 0, blocked);
+        res = lookup(flow(1000, 80, 0x0a000002, 0x0a000001, 0, 200));
+        EXPECT_EQ(blocked, res.v);
+        EXPECT_EQ(FT_RULE_FLOW_ID_BASE + 0, res.flow_id);
+        EXPECT_EQ(0, lookup(flow(1000, 80, 0x0a000002, 0x0a000001, 0, 100)).flow_id);
+
+        EXPECT_TRUE(delete_flow(f));
+        EXPECT_EQ(0, lookup(flow(1000, 11211, 0x0a000002, 0x0a000001, 0, 100)).flow_id);
+    }
+
+    TEST_F(flow_table_tests, ipv6)
+    {
+        const flow_table_value memcached(FT_IKERNEL, 0, 3);
+        const flow_table_value blocked(FT_DROP);
+
+        /* 2001:db8::1:0a00:0002 -> 2001:db8::0a00:0001, folded */
+        const uint32_t saddr_words[3] = { 0x20010db8, 0, 1 },
+                       daddr_words[3] = { 0x20010db8, 0, 0 };
+        const ap_uint<96> saddr_high = (ap_uint<32>(saddr_words[0]), ap_uint<32>(saddr_words[1]),
+                                        ap_uint<32>(saddr_words[2]));
+        const ap_uint<96> daddr_high = (ap_uint<32>(daddr_words[0]), ap_uint<32>(daddr_words[1]),
+                                        ap_uint<32>(daddr_words[2]));
+        const uint32_t saddr = 0x0a000002 ^ 0x20010db8 ^ 1,
+                       daddr = 0x0a000001 ^ 0x20010db8;
+
+        gateway.set_fields(FT_FIELD_SRC_IP | FT_FIELD_DST_IP | FT_FIELD_DST_PORT);
+        for (int i = 0; i < 3; ++i) {
+            gateway.write(FT_KEY_SADDR_HIGH + i, saddr_words[i]);
+            gateway.write(FT_KEY_DADDR_HIGH + i, daddr_words[i]);
+        }
+        flow f(0, 11211, saddr, daddr, 0, 0, 1);
+        uint32_t index = add_flow(make_tuple(f, memcached));
+        EXPECT_NE(0, index);
+
+        udp::header_parser hdr;
+        hdr.udp.source = 1000;
+        hdr.udp.dest = 11211;
+        hdr.ip.saddr = 0x0a000002;
+        hdr.ip.daddr = 0x0a000001;
+        udp::header_buffer buf = hdr;
+        buf.ipv6 = true;
+        buf.saddr_high = saddr_high;
+        buf.daddr_high = daddr_high;
+        flow_table_result res = lookup(buf);
+        EXPECT_EQ(memcached, res.v);
+        EXPECT_EQ(index, res.flow_id);
+
+        /* Other addresses with the same fold miss:
+         * 2001:db8:0:1::0a00:0002 */
+        buf.saddr_high = (ap_uint<32>(0x20010db8), ap_uint<32>(1), ap_uint<32>(0));
+        EXPECT_EQ(0, lookup(buf).flow_id);
+        buf.saddr_high = saddr_high;
+
+        /* An IPv4 flow with the same addresses as the folded ones is
+         * distinct */
+        EXPECT_EQ(0, lookup(flow(1000, 11211, saddr, daddr)).flow_id);
+
+        /* Wildcard rules match the address family through FT_MASK_IPV6 */
+        set_rule(0, flow(0, 80, 0, 0, 0, 0, 1), flow(0, 0xffff, 0, 0, 0, 0, 1), 0, blocked);
+        res = lookup(flow(1000, 80, saddr, daddr, 0, 0, 1));
+        EXPECT_EQ(blocked, res.v);
+        EXPECT_EQ(FT_RULE_FLOW_ID_BASE + 0, res.flow_id);
+        EXPECT_EQ(0, lookup(flow(1000, 80, saddr, daddr)).flow_id);
+
+        EXPECT_TRUE(delete_flow(f));
+        EXPECT_EQ(0, lookup(buf).flow_id);
+    }
+
+    /* A policer whose bucket cannot hold a full packet is rejected */
+    TEST(flow_table, policer_burst)
+    {
+        std::unique_ptr<flow_table> ft(new flow_table());
+
+        ASSERT_EQ(GW_DONE, ft->reg_write(FT_POLICER_RATE, 1));
+        ASSERT_EQ(GW_DONE, ft->reg_write(FT_POLICER_BURST, 0));
+        EXPECT_EQ(GW_FAIL, ft->reg_write(FT_SET_POLICER, 1));
+        ASSERT_EQ(GW_DONE, ft->reg_write(FT_POLICER_BURST, FT_POLICER_MIN_BURST - 1));
+        EXPECT_EQ(GW_FAIL, ft->reg_write(FT_SET_POLICER, 1));
+        ASSERT_EQ(GW_DONE, ft->reg_write(FT_POLICER_BURST, FT_POLICER_MIN_BURST));
+        EXPECT_EQ(GW_DONE, ft->reg_write(FT_SET_POLICER, 1));
+
+        /* Disabling needs no burst */
+        ASSERT_EQ(GW_DONE, ft->reg_write(FT_POLICER_RATE, 0));
+        ASSERT_EQ(GW_DONE, ft->reg_write(FT_POLICER_BURST, 0));
+        EXPECT_EQ(GW_DONE, ft->reg_write(FT_SET_POLICER, 1));
+    }
 }
 
 int main(int argc, char **argv) {
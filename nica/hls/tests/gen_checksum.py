@@ -0,0 +1,74 @@
+
+# Copyright (c) 2016-2017 Haggai Eran, Gabi Malka, Lior Zeno, Maroun Tork
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without modification,
+# are permitted provided that the following conditions are met:
+#
+#  * Redistributions of source code must retain the above copyright notice, this
+# list of conditions and the following disclaimer.
+#  * Redistributions in binary form must reproduce the above copyright notice,
+# this list of conditions and the following disclaimer in the documentation and/or
+# other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Generate UDP packets with correct and corrupted checksums, and the packets
+# expected after checksum validation drops the corrupted ones and the rest
+# pass through the passthrough ikernel.
+
+from scapy.all import *
+
+def make_pkt(sz, l3, ip_checksum, udp_checksum):
+    payload = [sz % 256] * sz
+    pkt = Ether(str(Ether()/l3/UDP(dport=0x0bad, sport=sz)/
+                    Raw(load=str(bytearray(payload)))))
+    if not ip_checksum:
+        pkt[IP].chksum ^= 0x1
+    if udp_checksum is None:
+        pkt[UDP].chksum = 0
+    elif not udp_checksum:
+        pkt[UDP].chksum ^= 0x100
+    return Ether(str(pkt))
+
+def expected(p):
+    p = p.copy()
+    if p.haslayer(IP):
+        del p[IP].chksum
+        p[IP].flags = 0
+        p[UDP].chksum = 0
+    else:
+        # The UDP checksum is mandatory over IPv6
+        del p[UDP].chksum
+    p = Ether(str(p))
+    if len(p) < 60:
+        p = Ether(str(p) + '\0' * (60 - len(p)))
+    return p
+
+ipv4 = IP()
+ipv6 = IPv6(src='2001:db8::1', dst='2001:db8:0:1::a00:1')
+
+sizes = [0, 1, 17, 100, 1400]
+pkts = []
+valid = []
+for l3, ip_checksums in [(ipv4, [True, False]), (ipv6, [True])]:
+    for ip_checksum in ip_checksums:
+        for udp_checksum in [True, False, None]:
+            for sz in sizes:
+                p = make_pkt(sz, l3, ip_checksum, udp_checksum)
+                pkts.append(p)
+                if ip_checksum and (udp_checksum or
+                                    (udp_checksum is None and l3 is ipv4)):
+                    valid.append(p)
+
+wrpcap("checksum.pcap", pkts)
+wrpcap("checksum-expected.pcap", [expected(p) for p in valid])
@@ -0,0 +1,59 @@
+
+# Copyright (c) 2016-2017 Haggai Eran, Gabi Malka, Lior Zeno, Maroun Tork
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without modification,
+# are permitted provided that the following conditions are met:
+#
+#  * Redistributions of source code must retain the above copyright notice, this
+# list of conditions and the following disclaimer.
+#  * Redistributions in binary form must reproduce the above copyright notice,
+# this list of conditions and the following disclaimer in the documentation and/or
+# other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Generate UDP packets with IP options, and the packets expected after they
+# pass through the passthrough ikernel, which emits them without the options.
+
+from scapy.all import *
+
+def make_pkt(sz, options_len):
+    payload = [sz % 256] * sz
+    pkt = Ether()/IP(options=[IPOption_NOP()] * options_len)/ \
+          UDP(dport=0x0bad, sport=sz)/Raw(load=str(bytearray(payload)))
+    return pkt
+
+def strip_options(p):
+    p = p.copy()
+    p[IP].options = []
+    del p[IP].ihl
+    del p[IP].len
+    del p[IP].chksum
+    p[IP].flags = 0
+    p[UDP].chksum = 0
+    p = Ether(str(p))
+    if len(p) < 60:
+        p = Ether(str(p) + '\0' * (60 - len(p)))
+    return p
+
+sizes = [0, 1, 2, 21, 22, 23, 32, 54, 100, 1400]
+pkts = []
+expected = []
+for options_len in range(4, 44, 4):
+    for sz in sizes:
+        pkt = make_pkt(sz, options_len)
+        pkts.append(pkt)
+        expected.append(strip_options(pkt))
+
+wrpcap("ip_options.pcap", pkts)
+wrpcap("ip_options-stripped.pcap", expected)
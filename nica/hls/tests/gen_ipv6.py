@@ -0,0 +1,45 @@
+
+# Copyright (c) 2016-2017 Haggai Eran, Gabi Malka, Lior Zeno, Maroun Tork
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without modification,
+# are permitted provided that the following conditions are met:
+#
+#  * Redistributions of source code must retain the above copyright notice, this
+# list of conditions and the following disclaimer.
+#  * Redistributions in binary form must reproduce the above copyright notice,
+# this list of conditions and the following disclaimer in the documentation and/or
+# other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Generate IPv6 UDP packets, untagged and VLAN tagged, and the packets
+# expected after they pass through the passthrough ikernel.
+
+from scapy.all import *
+
+def make_pkt(sz, tags):
+    payload = [sz % 256] * sz
+    eth = Ether()/tags if tags else Ether()
+    pkt = eth/IPv6(src='2001:db8::1', dst='2001:db8:0:1::a00:1')/ \
+          UDP(dport=0x0bad, sport=sz)/Raw(load=str(bytearray(payload)))
+    return Ether(str(pkt))
+
+sizes = [0, 1, 2, 17, 18, 19, 22, 32, 100, 1400]
+pkts = []
+for tags in [None, Dot1Q(prio=3, vlan=100)]:
+    for sz in sizes:
+        pkts.append(make_pkt(sz, tags))
+
+wrpcap("ipv6.pcap", pkts)
+# The UDP checksum is mandatory over IPv6, so it is recomputed on egress
+wrpcap("ipv6-expected.pcap", pkts)
@@ -0,0 +1,57 @@
+
+# Copyright (c) 2016-2017 Haggai Eran, Gabi Malka, Lior Zeno, Maroun Tork
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without modification,
+# are permitted provided that the following conditions are met:
+#
+#  * Redistributions of source code must retain the above copyright notice, this
+# list of conditions and the following disclaimer.
+#  * Redistributions in binary form must reproduce the above copyright notice,
+# this list of conditions and the following disclaimer in the documentation and/or
+# other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Generate VLAN tagged UDP packets, and the packets expected after they pass
+# through the passthrough ikernel, which re-inserts the tags.
+
+from scapy.all import *
+
+def make_pkt(sz, tags, options_len):
+    payload = [sz % 256] * sz
+    pkt = Ether()/tags/IP(options=[IPOption_NOP()] * options_len)/ \
+          UDP(dport=0x0bad, sport=sz)/Raw(load=str(bytearray(payload)))
+    return Ether(str(pkt))
+
+def expected(p):
+    p = p.copy()
+    del p[IP].chksum
+    p[IP].flags = 0
+    p[UDP].chksum = 0
+    p = Ether(str(p))
+    if len(p) < 60:
+        p = Ether(str(p) + '\0' * (60 - len(p)))
+    return p
+
+single = Dot1Q(prio=3, vlan=100)
+double = Dot1AD(prio=5, vlan=10)/Dot1Q(prio=1, vlan=20)
+
+sizes = [0, 1, 2, 17, 18, 19, 22, 32, 100, 1400]
+pkts = []
+for tags in [single, double]:
+    for options_len in [0, 4, 28]:
+        for sz in sizes:
+            pkts.append(make_pkt(sz, tags, options_len))
+
+wrpcap("vlan.pcap", pkts)
+wrpcap("vlan-expected.pcap", [expected(p) for p in pkts])
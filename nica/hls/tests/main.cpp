@@ -52,6 +52,31 @@ hds_stats& operator -= (hds_stats& s1, const hds_stats& s2)
     s1.ft_action_passthrough -= s2.ft_action_passthrough;
     s1.ft_action_drop -= s2.ft_action_drop;
     s1.ft_action_ikernel -= s2.ft_action_ikernel;
+    s1.drop_bad_ip_checksum -= s2.drop_bad_ip_checksum;
+    s1.drop_bad_udp_checksum -= s2.drop_bad_udp_checksum;
+    s1.policer_drop -= s2.policer_drop;
+    s1.policer_passthrough -= s2.policer_passthrough;
+
+    return s1;
+}
+
+flow_table_stats& operator -= (flow_table_stats& s1, const flow_table_stats& s2)
+{
+    s1.hits -= s2.hits;
+    s1.l2_lookups -= s2.l2_lookups;
+    s1.l2_hits -= s2.l2_hits;
+    s1.rule_hits -= s2.rule_hits;
+    s1.misses -= s2.misses;
+    s1.l2_latency_total -= s2.l2_latency_total;
+    s1.evictions -= s2.evictions;
+
+    return s1;
+}
+
+udp::crossbar_stats& operator -= (udp::crossbar_stats& s1, const udp::crossbar_stats& s2)
+{
+    for (unsigned i = 0; i < NUM_IKERNELS; ++i)
+        s1.voq_full[i] -= s2.voq_full[i];
 
     return s1;
 }
@@ -76,6 +101,7 @@ arbiter_tx_per_port_stats& operator -= (arbiter_tx_per_port_stats& s1, const arb
 {
     s1.words -= s2.words;
     s1.packets -= s2.packets;
+    s1.truncated -= s2.truncated;
  
     return s1;
 }
@@ -95,6 +121,8 @@ arbiter_stats<num_ports>& operator -= (arbiter_stats<num_ports>& s1, const arbit
 nica_pipeline_stats& operator -= (nica_pipeline_stats& s1, const nica_pipeline_stats& s2)
 {
     s1.udp.hds -= s2.udp.hds;
+    s1.udp.ft -= s2.udp.ft;
+    s1.udp.crossbar -= s2.udp.crossbar;
     s1.arbiter -= s2.arbiter;
 #define BOOST_PP_LOCAL_MACRO(i) \
     s1.ik ## i -= s2.ik ## i;
@@ -159,7 +187,10 @@ public:
         nica(nwp2sbu, sbu2nwp, cxp2sbu, sbu2cxp,
              &c, &s, events,
              BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, ports),
-             h2n_tc_out, h2n_tc_in, n2h_tc_out, n2h_tc_in);
+             h2n_tc_out, h2n_tc_in, n2h_tc_out, n2h_tc_in,
+             n2h_ft_mem, h2n_ft_mem);
+        n2h_ft_dram.mem(n2h_ft_mem);
+        h2n_ft_dram.mem(h2n_ft_mem);
         link_fifo(h2n_tc_out, h2n_tc_in);
         link_fifo(n2h_tc_out, n2h_tc_in);
     }
@@ -186,6 +217,40 @@ public:
         /* TODO reset ikernel */
     }
 
+    /* Steer all UDP packets from the network to ikernel 0, returning the
+     * flow ID */
+    uint32_t steer_to_ikernel0()
+    {
+        c.n2h.common.enable = true;
+        flow_table_wrapper ft_gateway([&]() { nica_top(); }, c.n2h.common.flow_table_gateway);
+        uint32_t flow_id = ft_gateway.add_flow(0, FT_IKERNEL);
+        EXPECT_TRUE(flow_id);
+        return flow_id;
+    }
+
+    /* Pass the packets of input from the network, and compare the ones that
+     * reach the host with expected, filtered by expected_filter. Packet IDs
+     * are verified unless the pipeline drops packets. The callback is called
+     * after each input packet. */
+    void run_n2h_pcap(const char* input, const char* expected,
+                      const char* expected_filter = "", bool verify_ids = true,
+                      callback_t callback = callback_t())
+    {
+        FILE* temp_file = tmpfile();
+        EXPECT_TRUE(temp_file) << "cannot create temporary file for output.";
+
+        udp_tb::pkt_id_verifier n2h_verifier;
+        hls::stream<mlx::user_t> n2h_user_values;
+        udp_tb::pkt_id_verifier* verifier = verify_ids ? &n2h_verifier : NULL;
+        hls::stream<mlx::user_t>* user_values = verify_ids ? &n2h_user_values : NULL;
+        read_pcap_callback(input, nwp2sbu, 0, std::numeric_limits<int>::max(),
+                           verifier, user_values, callback);
+        run();
+        write_pcap(temp_file, sbu2cxp, false, verifier, user_values);
+
+        EXPECT_TRUE(compare_output(filename(temp_file), "", expected, expected_filter));
+    }
+
 protected:
     udp::header_stream header;
     hls_ik::data_stream data;
@@ -199,6 +264,8 @@ protected:
 %:include BOOST_PP_LOCAL_ITERATE()
     hls_ik::virt_gateway_registers gateway0, gateway1;
     tc_ports h2n_tc_out, h2n_tc_in, n2h_tc_out, n2h_tc_in;
+    hls_ik::memory_t n2h_ft_mem, h2n_ft_mem;
+    ntl::tests::memory_model<DDR_INTERFACE_WIDTH> n2h_ft_dram, h2n_ft_dram;
 };
 
 TEST_F(testbench, n2h)
@@ -237,6 +304,19 @@ TEST_F(testbench, n2h)
     EXPECT_EQ(diff.n2h.ik0.packets, 100) << "packets";
 }
 
+TEST_F(testbench, udp_checksum)
+{
+    c.n2h.common.udp_checksum = true;
+    steer_to_ikernel0();
+    ikernel0 = passthrough_top;
+    reset_ikernel();
+    run_n2h_pcap("input.pcap", "input-checksum.pcap");
+
+    nica_stats diff = stats();
+    EXPECT_EQ(diff.n2h.udp.hds.ft_action_ikernel, 100) << "packets in matched statistic";
+    EXPECT_EQ(diff.n2h.ik0.packets, 100) << "packets";
+}
+
 TEST_F(testbench, all_packet_sizes)
 {
     const char *input_filename = "all_sizes.pcap";
@@ -272,6 +352,85 @@ TEST_F(testbench, all_packet_sizes)
     EXPECT_EQ(diff.n2h.udp.hds.passthrough_disabled, 0) << "disabled";
     EXPECT_EQ(diff.n2h.ik0.packets, 38) << "packets";
 }
+
+TEST_F(testbench, jumbo_frames)
+{
+    steer_to_ikernel0();
+    ikernel0 = passthrough_top;
+    reset_ikernel();
+    /* The ikernel passes a word per top() call, give it time for each
+     * packet */
+    run_n2h_pcap("jumbo.pcap", "jumbo-padded.pcap", "", true, [&]() {
+        for (int i = 0; i < MAX_PACKET_WORDS; ++i)
+            top();
+    });
+
+    nica_stats diff = stats();
+    EXPECT_EQ(diff.n2h.udp.hds.ft_action_ikernel, 5) << "packets in matched statistic";
+    EXPECT_EQ(diff.n2h.udp.hds.passthrough_bad_length, 0) << "bad length";
+    EXPECT_EQ(diff.n2h.ik0.packets, 5) << "packets";
+}
+
+TEST_F(testbench, ip_options)
+{
+    steer_to_ikernel0();
+    ikernel0 = passthrough_top;
+    reset_ikernel();
+    /* The UDP header and payload are found past the options, and the
+     * ikernel output is built without them */
+    run_n2h_pcap("ip_options.pcap", "ip_options-stripped.pcap");
+
+    nica_stats diff = stats();
+    EXPECT_EQ(diff.n2h.udp.hds.ft_action_ikernel, 100) << "packets in matched statistic";
+    EXPECT_EQ(diff.n2h.udp.hds.passthrough_bad_length, 0) << "bad length";
+    EXPECT_EQ(diff.n2h.ik0.packets, 100) << "packets";
+}
+
+TEST_F(testbench, vlan)
+{
+    steer_to_ikernel0();
+    ikernel0 = passthrough_top;
+    reset_ikernel();
+    /* Tags are stripped on ingress and re-inserted on egress */
+    run_n2h_pcap("vlan.pcap", "vlan-expected.pcap");
+
+    nica_stats diff = stats();
+    EXPECT_EQ(diff.n2h.udp.hds.ft_action_ikernel, 60) << "packets in matched statistic";
+    EXPECT_EQ(diff.n2h.udp.hds.passthrough_not_ipv4, 0) << "!ipv4";
+    EXPECT_EQ(diff.n2h.ik0.packets, 60) << "packets";
+}
+
+TEST_F(testbench, ipv6)
+{
+    steer_to_ikernel0();
+    ikernel0 = passthrough_top;
+    reset_ikernel();
+    /* The IPv6 header is translated on ingress and rebuilt on egress */
+    run_n2h_pcap("ipv6.pcap", "ipv6-expected.pcap");
+
+    nica_stats diff = stats();
+    EXPECT_EQ(diff.n2h.udp.hds.ft_action_ikernel, 20) << "packets in matched statistic";
+    EXPECT_EQ(diff.n2h.udp.hds.passthrough_not_ipv4, 0) << "!ipv4";
+    EXPECT_EQ(diff.n2h.ik0.packets, 20) << "packets";
+}
+
+TEST_F(testbench, checksum_validation)
+{
+    c.n2h.common.checksum_validate = true;
+    steer_to_ikernel0();
+    ikernel0 = passthrough_top;
+    reset_ikernel();
+    /* Packets with bad checksums are dropped, so packet IDs are not
+     * verified */
+    run_n2h_pcap("checksum.pcap", "checksum-expected.pcap", "", false);
+
+    nica_stats diff = stats();
+    EXPECT_EQ(diff.n2h.udp.hds.ft_action_ikernel, 45) << "packets in matched statistic";
+    EXPECT_EQ(diff.n2h.udp.hds.drop_bad_ip_checksum, 15) << "bad IP checksum";
+    EXPECT_EQ(diff.n2h.udp.hds.drop_bad_udp_checksum, 20) << "bad UDP checksum";
+    EXPECT_EQ(diff.n2h.ik0.packets, 15) << "packets";
+}
+
 /* Test passthrough for non-ikernel traffic */
 TEST_F(testbench, h2n_nica_passthrough)
 {
@@ -341,6 +500,36 @@ TEST_F(testbench, drop)
     EXPECT_EQ(diff.n2h.ik0.packets, 0) << "packets";
 }
 
+TEST_F(testbench, policer)
+{
+    uint32_t flow_id = steer_to_ikernel0();
+    flow_table_wrapper ft_gateway([&]() { nica_top(); }, c.n2h.common.flow_table_gateway);
+    /* A minimal bucket that refills far slower than the packets arrive, so
+     * only its initial burst of the 32 byte packets gets through */
+    const int burst_packets = FT_POLICER_MIN_BURST / 32;
+    ft_gateway.write(FT_POLICER_RATE, 1);
+    ft_gateway.write(FT_POLICER_BURST, FT_POLICER_MIN_BURST);
+    ft_gateway.write(FT_POLICER_EXCEED_ACTION, FT_DROP);
+    ft_gateway.write(FT_SET_POLICER, flow_id);
+
+    ikernel0 = ::threshold_top;
+    reset_ikernel();
+    virt_gateway_wrapper gw([&]() { top(); }, gateway0, 15);
+    gw.write(THRESHOLD_VALUE, 0xffffffff);
+    run_n2h_pcap("input.pcap", "input.pcap", "!ip || !udp");
+
+    nica_stats diff = stats();
+    EXPECT_EQ(diff.n2h.udp.hds.policer_drop, 100 - burst_packets) << "policed packets";
+    EXPECT_EQ(diff.n2h.udp.hds.policer_passthrough, 0) << "policed packets passed";
+    EXPECT_EQ(diff.n2h.udp.hds.ft_action_drop, 100 - burst_packets) << "dropped packets";
+    EXPECT_EQ(diff.n2h.udp.hds.ft_action_ikernel, burst_packets) << "packets to the ikernel";
+    EXPECT_EQ(diff.n2h.ik0.packets, burst_packets) << "packets";
+
+    /* Disable the policer for the next tests */
+    ft_gateway.write(FT_POLICER_RATE, 0);
+    ft_gateway.write(FT_SET_POLICER, flow_id);
+}
+
 TEST_F(testbench, custom_rx_ring)
 {
     const char *input_filename = "input.pcap";
@@ -456,6 +645,50 @@ TEST_F(testbench, flow_table)
         EXPECT_FALSE(ft_gateway.delete_flow(port)) << port;
 }
 
+/* By default a stalled ikernel holds back the dispatcher instead of losing
+ * packets */
+TEST(voq_crossbar, lossless)
+{
+    udp::voq_crossbar xbar;
+    udp::header_stream hdr_in, hdr_out;
+    result_stream results_in, results_out;
+    hls_ik::data_stream data_in, data_out;
+    udp::crossbar_stats s = {};
+
+    const int packets = 2 * VOQ_PACKETS, payload = 100;
+    const int words = (payload + MLX_AXI4_WIDTH_BYTES - 1) / MLX_AXI4_WIDTH_BYTES;
+    for (int i = 0; i < packets; ++i) {
+        udp::header_parser hdr;
+        hdr.udp.length = hdr.udp.width / 8 + payload;
+        hdr_in.write(hdr);
+        results_in.write(flow_table_result(i, flow_table_value(FT_IKERNEL, 0)));
+        for (int w = 0; w < words; ++w)
+            data_in.write(hls_ik::axi_data(i, hls_ik::axi_data::keep_bytes(MLX_AXI4_WIDTH_BYTES),
+                                           w == words - 1));
+    }
+
+    /* The ikernel is stalled: the queue fills up and the dispatcher waits */
+    for (int cycle = 0; cycle < packets * (words + 1) + 100; ++cycle) {
+        xbar.dispatch(hdr_in, data_in, results_in);
+        xbar.update_stats(&s);
+    }
+    EXPECT_EQ(int(hdr_in.size()), packets - VOQ_PACKETS - 1) << "dispatcher did not wait";
+    EXPECT_EQ(s.voq_full[0], 0);
+
+    /* Once it resumes, all the packets arrive in order */
+    for (int cycle = 0; cycle < 2 * packets * (words + 1) + 100; ++cycle) {
+        xbar.dispatch(hdr_in, data_in, results_in);
+        xbar.voq0.forward(hdr_out, results_out, data_out);
+        xbar.update_stats(&s);
+    }
+    EXPECT_TRUE(hdr_in.empty() && data_in.empty());
+    EXPECT_EQ(int(hdr_out.size()), packets);
+    EXPECT_EQ(int(data_out.size()), packets * words);
+    EXPECT_EQ(s.voq_full[0], 0);
+    for (int i = 0; i < packets; ++i)
+        EXPECT_EQ(int(results_out.read().flow_id), i);
+}
+
 #if NUM_IKERNELS >= 2
 TEST_F(testbench, two_ikernels)
 {
@@ -463,8 +696,8 @@ TEST_F(testbench, two_ikernels)
     FILE* temp_file = tmpfile();
     EXPECT_TRUE(temp_file) << "cannot create temporary file for output.";
 
-    c.n2h.enable = true;
-    flow_table_wrapper ft_gateway([&]() { nica_top(); }, c.n2h.flow_table_gateway);
+    c.n2h.common.enable = true;
+    flow_table_wrapper ft_gateway([&]() { nica_top(); }, c.n2h.common.flow_table_gateway);
     ft_gateway.set_fields(FT_FIELD_DST_PORT);
     EXPECT_TRUE(ft_gateway.add_flow(2989, FT_IKERNEL, 0));
     EXPECT_TRUE(ft_gateway.add_flow(47824, FT_IKERNEL, 1));
@@ -504,6 +737,128 @@ TEST_F(testbench, two_ikernels)
     EXPECT_EQ(diff.n2h.ik1.actions[hls_ik::PASS], 76) << "PASS packets";
     EXPECT_EQ(diff.n2h.ik1.actions[hls_ik::GENERATE], 0) << "GENERATE packets";
 }
+
+/* With XBAR_DROP_ON_FULL, a stalled ikernel must not hold back the traffic
+ * of the other ikernels */
+TEST(voq_crossbar, isolation)
+{
+    udp::voq_crossbar xbar;
+    udp::header_stream hdr_in, hdr_out0, hdr_out1;
+    result_stream results_in, results_out0, results_out1;
+    hls_ik::data_stream data_in, data_out0, data_out1;
+    udp::crossbar_stats s = {};
+
+    ASSERT_EQ(xbar.reg_write(XBAR_DROP_ON_FULL, 1), GW_DONE);
+    const int packets = 40, payload = 100;
+    const int words = (payload + MLX_AXI4_WIDTH_BYTES - 1) / MLX_AXI4_WIDTH_BYTES;
+    for (int i = 0; i < 2 * packets; ++i) {
+        udp::header_parser hdr;
+        hdr.udp.length = hdr.udp.width / 8 + payload;
+        hdr_in.write(hdr);
+        results_in.write(flow_table_result(i, flow_table_value(FT_IKERNEL, i & 1)));
+        for (int w = 0; w < words; ++w)
+            data_in.write(hls_ik::axi_data(i, hls_ik::axi_data::keep_bytes(MLX_AXI4_WIDTH_BYTES),
+                                           w == words - 1));
+    }
+
+    /* Only ikernel 0 accepts packets */
+    for (int cycle = 0; cycle < 2 * packets * (words + 1) + 100; ++cycle) {
+        xbar.dispatch(hdr_in, data_in, results_in);
+        xbar.voq0.forward(hdr_out0, results_out0, data_out0);
+        xbar.update_stats(&s);
+    }
+    EXPECT_TRUE(hdr_in.empty() && data_in.empty()) << "dispatcher stalled";
+    EXPECT_EQ(hdr_out0.size(), packets);
+    EXPECT_EQ(results_out0.size(), packets);
+    EXPECT_EQ(data_out0.size(), packets * words);
+    EXPECT_EQ(s.voq_full[0], 0);
+    EXPECT_EQ(s.voq_full[1], packets - VOQ_PACKETS);
+
+    /* The packets queued for ikernel 1 are delivered once it resumes */
+    for (int cycle = 0; cycle < VOQ_PACKETS * (words + 1) + 100; ++cycle)
+        xbar.voq1.forward(hdr_out1, results_out1, data_out1);
+    EXPECT_EQ(hdr_out1.size(), VOQ_PACKETS);
+    EXPECT_EQ(data_out1.size(), VOQ_PACKETS * words);
+    for (int i = 0; i < VOQ_PACKETS; ++i)
+        EXPECT_EQ(int(results_out1.read().flow_id), 2 * i + 1);
+}
+
+/* Packets of a replica group are spread over its engines, with all the
+ * packets of a flow at the same engine and in order */
+TEST(voq_crossbar, replica_group)
+{
+    udp::voq_crossbar xbar;
+    udp::header_stream hdr_in, hdr_out[2];
+    result_stream results_in, results_out[2];
+    hls_ik::data_stream data_in, data_out[2];
+    udp::crossbar_stats s = {};
+    int engines;
+
+    /* Groups must not extend past the last engine */
+    EXPECT_EQ(xbar.reg_write(XBAR_GROUP_BASE + XBAR_GROUP_ENGINES, 1 | NUM_IKERNELS << 8), GW_FAIL);
+    EXPECT_EQ(xbar.reg_write(XBAR_GROUP_BASE + XBAR_GROUP_ENGINES, NUM_IKERNELS | 1 << 8), GW_FAIL);
+    ASSERT_EQ(xbar.reg_read(XBAR_GROUP_BASE + XBAR_GROUP_ENGINES, &engines), GW_DONE);
+    EXPECT_EQ(engines, 0);
+
+    for (int hash_payload = 0; hash_payload < 2; ++hash_payload) {
+        ASSERT_EQ(xbar.reg_write(XBAR_GROUP_BASE + XBAR_GROUP_ENGINES, 0 | 2 << 8), GW_DONE);
+        ASSERT_EQ(xbar.reg_write(XBAR_GROUP_BASE + XBAR_GROUP_HASH, hash_payload ?
+                                 XBAR_HASH_PAYLOAD | 2 << 8 | 4 << 16 : XBAR_HASH_5TUPLE),
+                  GW_DONE);
+        /* Apply the configuration */
+        for (int cycle = 0; cycle < 2; ++cycle)
+            xbar.dispatch(hdr_in, data_in, results_in);
+
+        const int flows = 12, packets = 3;
+        for (int p = 0; p < packets; ++p) {
+            for (int f = 0; f < flows; ++f) {
+                udp::header_parser hdr;
+                hdr.ip.saddr = 0x0a000001;
+                hdr.ip.daddr = 0x0a000002;
+                hdr.udp.source = hash_payload ? 1000 + p : 1000 + f;
+                hdr.udp.dest = 2989;
+                hdr.udp.length = hdr.udp.width / 8 + 8;
+                hdr_in.write(hdr);
+                results_in.write(flow_table_result(f, flow_table_value(FT_REPLICA_GROUP, 0)));
+                /* The key is in payload bytes 2..5, the sequence number in
+                 * byte 7 */
+                ap_uint<MLX_AXI4_WIDTH_BITS> d = 0;
+                d(MLX_AXI4_WIDTH_BITS - 17, MLX_AXI4_WIDTH_BITS - 48) = hash_payload ? f * 0x1234567 : 0;
+                d(MLX_AXI4_WIDTH_BITS - 57, MLX_AXI4_WIDTH_BITS - 64) = p;
+                data_in.write(hls_ik::axi_data(d, hls_ik::axi_data::keep_bytes(8), true));
+            }
+        }
+
+        for (int cycle = 0; cycle < 4 * flows * packets; ++cycle) {
+            xbar.dispatch(hdr_in, data_in, results_in);
+            xbar.voq0.forward(hdr_out[0], results_out[0], data_out[0]);
+            xbar.voq1.forward(hdr_out[1], results_out[1], data_out[1]);
+            xbar.update_stats(&s);
+        }
+        EXPECT_EQ(s.voq_full[0] + s.voq_full[1], 0) << "drops";
+
+        int engine[flows], next[flows], used[2] = {};
+        std::fill(engine, engine + flows, -1);
+        std::fill(next, next + flows, 0);
+        for (int e = 0; e < 2; ++e) {
+            while (!results_out[e].empty()) {
+                hdr_out[e].read();
+                int f = results_out[e].read().flow_id;
+                int p = data_out[e].read().data(MLX_AXI4_WIDTH_BITS - 57, MLX_AXI4_WIDTH_BITS - 64).to_int();
+                if (engine[f] == -1) {
+                    engine[f] = e;
+                    ++used[e];
+                }
+                EXPECT_EQ(engine[f], e) << "flow " << f << " changed engines";
+                EXPECT_EQ(next[f]++, p) << "flow " << f << " reordered";
+            }
+        }
+        for (int f = 0; f < flows; ++f)
+            EXPECT_EQ(next[f], packets) << "flow " << f;
+        EXPECT_GT(used[0], 0) << "engine 0 unused";
+        EXPECT_GT(used[1], 0) << "engine 1 unused";
+    }
+}
 #endif
 
 int main(int argc, char **argv) {
@@ -33,6 +33,8 @@ parser.add_option("-r", "--reverse", action="store_true", dest="reverse",
                   default=False, help="Reverse destination and source addresses")
 parser.add_option("", "--dest-port", dest="dport",
                   help="Filter UDP destination port")
+parser.add_option("", "--udp-checksum", action="store_true", dest="udp_checksum",
+                  default=False, help="Compute UDP checksums instead of zeroing them")
 options, args = parser.parse_args()
 infile, outfile = args
 
@@ -41,9 +43,12 @@ out = []
 for p in pkts:
     if p.haslayer(IP) and p.haslayer(UDP):
         if options.dport is None or options.dport == p[UDP].dport:
-            p[IP].chksum = 0
+            del p[IP].chksum
             p[IP].flags = 0
-            p[UDP].chksum = 0
+            if options.udp_checksum:
+                del p[UDP].chksum
+            else:
+                p[UDP].chksum = 0
             if options.reverse:
                 p[UDP].sport, p[UDP].dport = p[UDP].dport, p[UDP].sport
                 p[IP].src, p[IP].dst = p[IP].dst, p[IP].src
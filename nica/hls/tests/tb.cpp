@@ -77,7 +77,7 @@ void packet_handler(u_char *user, const struct pcap_pkthdr *h, const u_char *byt
         goto end;
 
     for (unsigned word = 0; word < ALIGN(h->len, b); word += b) {
-        mlx::axi4s input(0, 0xffffffff, false);
+        mlx::axi4s input(0, mlx::keep_all(), false);
         for (unsigned byte = 0; byte < b && word + byte < h->len; ++byte)
             input.data(input.data.width - 1 - 8 * byte, input.data.width - 8 - 8 * byte) = bytes[word + byte];
         if ((word + b) >= h->len) {
@@ -0,0 +1,51 @@
+//
+// Copyright (c) 2016-2018 Haggai Eran, Gabi Malka, Lior Zeno, Maroun Tork
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation and/or
+// other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#pragma once
+
+#include <ap_int.h>
+
+/* Toeplitz hash, as used for RSS: every set bit of the input XORs a 32-bit
+ * window of the key into the result. Being carry-free, it reduces to an XOR
+ * tree that fits a single pipeline stage regardless of the input width. The
+ * key must be at least 31 bits longer than the input. */
+template <int Width, int KeyWidth>
+ap_uint<32> toeplitz_hash(const ap_uint<Width>& d, const ap_uint<KeyWidth>& key)
+{
+#pragma HLS inline
+    static_assert(KeyWidth >= Width + 31, "Toeplitz key is too short for the input");
+    ap_uint<32> h = 0;
+
+    for (int i = 0; i < Width; ++i) {
+#pragma HLS unroll
+        if (d[Width - 1 - i])
+            h ^= ap_uint<32>(key(KeyWidth - 1 - i, KeyWidth - 32 - i));
+    }
+
+    return h;
+}
+
+/* The first 160 bits of the Microsoft RSS default key */
+#define TOEPLITZ_RSS_KEY "0x6d5a56da255b0ec24167253d43a38fb0d0ca2bcb"
@@ -25,6 +25,7 @@
 
 #include <udp.h>
 #include <hls_helper.h>
+#include "toeplitz.hpp"
 #include <boost/preprocessor/iteration/local.hpp>
 
 using namespace hls_helpers;
@@ -42,7 +43,13 @@ namespace udp {
    0x1c - ip.saddr[1:0] ip.daddr[3:2]
    0x20 - ip.daddr[1:0] udp.source-port
    0x24 - udp.dest-port udp.len
-   0x28 - udp.checksum data[2 bytes] */
+   0x28 - udp.checksum data[2 bytes]
+
+   VLAN tags between eth.src and the ethertype push the rest of the packet
+   forward by 4 bytes each. IP options follow ip.daddr and push the UDP header
+   and data forward by (ip.ihl - 5) * 4 bytes. An IPv6 header (ethertype
+   0x86dd) is 20 bytes longer than the fixed IPv4 header, and is followed
+   directly by the UDP header; extension headers are not supported. */
 
 header_parser::header_parser(const header_buffer& buf) :
     eth(buf.hdr(width - 1, udp_header::width + ip_header::width)),
@@ -68,6 +75,7 @@ steering::steering() :
     hdr_dup_to_checks("hdr_dup_to_checks"),
     hdr_dup_to_flow_table("hdr_dup_to_flow_table"),
     matched("matched"),
+    policed("policed"),
     dropper(true) /* empty_packets_have_data */
 {
     HEADER_BUFFER(buf, 0, -1, -1, true);
@@ -85,9 +93,11 @@ void steering::hdr_checks(const config& config)
 
     /* TODO check that all fields are under TKEEP */
     c.disabled = !config.enable;
-    c.not_ipv4 = hdr.eth.proto != ETH_P_IP;
-    c.bad_length = hdr.ip.tot_len < sizeof(iphdr) + sizeof(udphdr);
+    c.not_ipv4 = hdr.eth.proto != ETH_P_IP && hdr.eth.proto != ETH_P_IPV6;
+    c.bad_length = hdr.ip.ihl < sizeof(iphdr) / 4 ||
+                   hdr.ip.tot_len < hdr.ip.ihl * 4 + sizeof(udphdr);
     c.not_udp = hdr.ip.protocol != IPPROTO_UDP;
+    c.length = hdr.ip.tot_len;
 
     checks_to_actions.write(c);
     checks_to_stats.write_nb(c);
@@ -97,18 +107,30 @@ void steering::checks_to_action(const config& cfg, result_stream& result_out)
 {
 #pragma HLS pipeline enable_flush ii=1
     if (checks_to_actions.empty() || ft_to_action.empty() ||
-        ft_results.full() || result_out.full())
+        ft_results.full() || result_out.full() || ft_counter_updates.full()) {
+        ft.policers_update();
         return;
+    }
 
     checks c = checks_to_actions.read();
     c.ft_result = ft_to_action.read();
+    flow_table_action exceed_action;
 
-    if (c.disabled || c.not_ipv4 || c.bad_length || c.not_udp)
+    if (c.disabled || c.not_ipv4 || c.bad_length || c.not_udp) {
         c.ft_result.v.action = FT_PASSTHROUGH;
+        ft.policers_update();
+    } else {
+        ft_counter_updates.write(flow_counter_update(c.ft_result.flow_id, c.length,
+                                                     c.ft_result.vm_id));
+        if (ft.police(c.ft_result.flow_id, c.length, exceed_action)) {
+            c.ft_result.v.action = exceed_action;
+            policed.write_nb(exceed_action);
+        }
+    }
 
     ft_results.write(c.ft_result);
-    /* If the action is to the ikernel, pass it out to the crossbar */
-    if (c.ft_result.v.action == FT_IKERNEL)
+    /* If the action is to an ikernel, pass it out to the crossbar */
+    if (c.ft_result.v.action == FT_IKERNEL || c.ft_result.v.action == FT_REPLICA_GROUP)
         result_out.write(c.ft_result);
 }
 
@@ -149,7 +171,7 @@ void steering::update_stats_actions(bool_stream& pass_raw, hds_stats* s)
         return;
 
     flow_table_result ft = ft_results.read();
-    matched.write(ft.v.action == FT_IKERNEL);
+    matched.write(ft.v.action == FT_IKERNEL || ft.v.action == FT_REPLICA_GROUP);
     pass_raw.write(ft.v.action == FT_PASSTHROUGH);
 
     switch (ft.v.action) {
@@ -160,15 +182,37 @@ void steering::update_stats_actions(bool_stream& pass_raw, hds_stats* s)
         ++stats.ft_action_drop;
         break;
     case FT_IKERNEL:
+    case FT_REPLICA_GROUP:
         ++stats.ft_action_ikernel;
         break;
     }
 }
 
+void steering::update_stats_policers(hds_stats* s)
+{
+#pragma HLS pipeline enable_flush ii=1
+    s->policer_drop = stats.policer_drop;
+    s->policer_passthrough = stats.policer_passthrough;
+
+    if (policed.empty())
+        return;
+
+    switch (policed.read()) {
+    case FT_DROP:
+        ++stats.policer_drop;
+        break;
+    case FT_PASSTHROUGH:
+        ++stats.policer_passthrough;
+        break;
+    default:
+        break;
+    }
+}
+
 void steering::steer(header_stream& hdr_in, hls_ik::data_stream& data_in, bool_stream& pass_raw,
                      header_stream& hdr_out, hls_ik::data_stream& data_out,
-                     result_stream& result_out,
-                     config* config, hds_stats* s)
+                     result_stream& result_out, hls_ik::memory_t& ft_mem,
+                     config* config, hds_stats* s, flow_table_stats* ft_stats)
 {
 #pragma HLS inline
     DO_PRAGMA(HLS STREAM variable=hdr_dup_to_dropper depth=16);
@@ -178,6 +222,7 @@ void steering::steer(header_stream& hdr_in, hls_ik::data_stream& data_in, bool_s
     DO_PRAGMA(HLS STREAM variable=matched depth=FIFO_PACKETS);
     DO_PRAGMA(HLS STREAM variable=checks_to_actions depth=FIFO_FLOW_TABLE_PACKETS);
     DO_PRAGMA(HLS STREAM variable=ft_to_action depth=FIFO_FLOW_TABLE_PACKETS);
+    DO_PRAGMA(HLS STREAM variable=ft_counter_updates depth=FIFO_FLOW_TABLE_PACKETS);
 
     DO_PRAGMA_SYN(HLS data_pack variable=hdr_dup_to_dropper);
     DO_PRAGMA_SYN(HLS data_pack variable=hdr_dup_to_checks);
@@ -186,52 +231,185 @@ void steering::steer(header_stream& hdr_in, hls_ik::data_stream& data_in, bool_s
     DO_PRAGMA_SYN(HLS data_pack variable=checks_to_actions);
     DO_PRAGMA_SYN(HLS data_pack variable=ft_to_action);
     DO_PRAGMA_SYN(HLS data_pack variable=ft_results);
+    DO_PRAGMA_SYN(HLS data_pack variable=ft_counter_updates);
 
     hdr_dup.dup3(hdr_in, hdr_dup_to_dropper, hdr_dup_to_checks, hdr_dup_to_flow_table);
     hdr_checks(*config);
-    ft.ft_step(hdr_dup_to_flow_table, ft_to_action, config->flow_table_gateway);
+    ft.ft_step(hdr_dup_to_flow_table, ft_to_action, ft_counter_updates,
+               config->flow_table_gateway, ft_mem, ft_stats);
     checks_to_action(*config, result_out);
     update_stats_checks(s);
     update_stats_actions(pass_raw, s);
+    update_stats_policers(s);
     dropper.udp_dropper_step(matched, hdr_dup_to_dropper, data_in, hdr_out,
                              data_out);
 }
 
+/* VLAN tags and IP options move the headers that follow them. The tags are
+ * stripped and recorded in the header buffer, and so are up to 40 bytes of IP
+ * options (IHL > 5). IPv6 headers are translated to IPv4 ones, keeping the
+ * high bits of the addresses aside. The payload is realigned to the start of
+ * the data words.
+ * With 256-bit words the headers span up to three words:
+
+   word 0: eth addresses, VLAN tags, ethertype, most of the fixed IP header
+   word 1: rest of the IP header, options, udp header, payload
+   word 2: rest of the options, udp header, payload (headers >= 64 bytes)
+
+   With 512-bit words they span one or two words, and the third is zero. */
+void header_data_split::write_header(header_stream& header,
+                                     const ap_uint<3 * MLX_AXI4_WIDTH_BITS>& words)
+{
+#pragma HLS inline
+    const int width = 3 * MLX_AXI4_WIDTH_BITS;
+    /* Ethernet addresses, before the tags */
+    const int addr_bits = eth_header::width - 16;
+    /* The ethertype and the fixed IP header, following the tags */
+    const int untagged_bits = eth_header::width + ip_header::width;
+    /* The IPv6 header, following the ethertype */
+    const int ipv6_bits = 320;
+
+    ap_uint<width> untagged = words << (tags_length * 8);
+    ap_uint<width> shifted = untagged << ((ipv6 ? 20 : options_length) * 8);
+    ap_uint<ip_header::width> ip = untagged(width - eth_header::width - 1,
+                                            width - untagged_bits);
+    ap_uint<ipv6_bits> ip6 = untagged(width - eth_header::width - 1,
+                                      width - eth_header::width - ipv6_bits);
+
+    HEADER_BUFFER(buf, 0, meta.id, meta.user, false);
+    if (ipv6) {
+        ip_header hdr(0);
+        hdr.version = ip6(319, 316);
+        hdr.ihl = ipv6_bits / 32;
+        hdr.tos = ip6(315, 308);
+        hdr.tot_len = ip6(287, 272) + ipv6_bits / 8;
+        hdr.protocol = ip6(271, 264);
+        hdr.ttl = ip6(263, 256);
+        hdr.saddr = ip6(159, 128);
+        hdr.daddr = ip6(31, 0);
+        ip = hdr;
+        buf.saddr_high = ip6(255, 160);
+        buf.daddr_high = ip6(127, 32);
+    }
+    buf.hdr = (words(width - 1, width - addr_bits),
+               untagged(width - addr_bits - 1, width - eth_header::width), ip,
+               shifted(width - untagged_bits - 1, width - header_buffer::width));
+    buf.vlan = vlan;
+    buf.ipv6 = ipv6;
+
+    /* One's complement sum of the options, for verifying the IP checksum */
+    ap_uint<21> sum = 0;
+    for (int i = 0; i < 20; ++i) {
+#pragma HLS unroll
+        const int msb = width - untagged_bits - 1 - 16 * i;
+        if (!ipv6 && i < options_length / 2)
+            sum += untagged(msb, msb - 15);
+    }
+    for (int i = 0; i < 2; ++i)
+        sum = sum(15, 0) + sum(20, 16);
+    buf.ip_options_checksum = sum(15, 0);
+
+    header.write(buf);
+}
+
 void header_data_split::split(header_stream& header, hls_ik::data_stream& data)
 {
 #pragma HLS PIPELINE enable_flush
+    const int W = MLX_AXI4_WIDTH_BITS;
     ntl::axi_data cur;
-    /* Where does the header end and data start in the second word, in bits */
-    const int data_start = 512 - header_buffer::width;
+    /* Header length without tags and options, in bytes */
+    const int headers_length = header_buffer::width / 8;
+    const int word_bytes = MLX_AXI4_WIDTH_BITS / 8;
+    ap_uint<7> header_end = headers_length + tags_length +
+                            (ipv6 ? ap_uint<6>(20) : options_length);
+    ap_uint<2 * MLX_AXI4_WIDTH_BITS> window, shifted;
 
     switch (state) {
     case IDLE:
 idle:
-        if (!extract_metadata.out_metadata.empty() && !extract_metadata.out_data.empty()) {
+        if (!extract_metadata.out_metadata.empty() && !extract_metadata.out_data.empty() &&
+            !header.full()) {
             cur = extract_metadata.out_data.read();
-            buffer = cur.data;
+            first = cur.data;
             meta = extract_metadata.out_metadata.read();
-            state = READING_HEADER;
+            {
+                /* Ethertypes and tags following the Ethernet addresses, at
+                 * bytes 12, 16 and 20 */
+                ap_uint<16> type0 = cur.data(W - 97, W - 112), type1 = cur.data(W - 129, W - 144),
+                            type2 = cur.data(W - 161, W - 176), type;
+                /* The IHL nibble of the first IP header byte, after 0, 1 or 2
+                 * tags */
+                ap_uint<4> ihl;
+
+                vlan = hls_ik::vlan_tags();
+                if (type0 == ETH_P_8021Q || type0 == ETH_P_8021AD) {
+                    vlan.count = 1;
+                    vlan.stag = type0 == ETH_P_8021AD;
+                    vlan.outer = cur.data(W - 113, W - 128);
+                    if (type1 == ETH_P_8021Q) {
+                        vlan.count = 2;
+                        vlan.inner = cur.data(W - 145, W - 160);
+                    }
+                }
+                switch (vlan.count) {
+                case 0: type = type0; ihl = cur.data(W - 117, W - 120); break;
+                case 1: type = type1; ihl = cur.data(W - 149, W - 152); break;
+                default: type = type2; ihl = cur.data(W - 181, W - 184); break;
+                }
+                tags_length = vlan.count * 4;
+                /* Malformed IHL values are treated as no options, and
+                 * rejected by the header checks. */
+                options_length = type == ETH_P_IP && ihl > 5 ?
+                    ap_uint<6>((ihl - 5) * 4) : ap_uint<6>(0);
+                ipv6 = type == ETH_P_IPV6;
+            }
+
+            /* With 512-bit words, the headers may end in the first word */
+            header_end = headers_length + tags_length +
+                         (ipv6 ? ap_uint<6>(20) : options_length);
+            if (header_end < word_bytes || cur.last) {
+                write_header(header, (first, ap_uint<2 * MLX_AXI4_WIDTH_BITS>(0)));
+                buffer = cur.data;
+                data_offset = header_end;
+                state = cur.last ? LAST : STREAM;
+            } else {
+                state = READING_HEADER;
+            }
         }
         break;
     case READING_HEADER:
         if (!extract_metadata.out_data.empty() && !header.full()) {
             cur = extract_metadata.out_data.read();
+            buffer = cur.data;
 
-            HEADER_BUFFER(buf,
-                (buffer, cur.data(255, data_start)),
-                meta.id, meta.user, false);
+            if (header_end < 2 * word_bytes || cur.last) {
+                /* The headers end in this word. A truncated packet with
+                 * headers spilling beyond it gets a garbage UDP header. */
+                write_header(header, (first, cur.data, ap_uint<MLX_AXI4_WIDTH_BITS>(0)));
+                data_offset = header_end - word_bytes;
+                state = cur.last ? LAST : STREAM;
+            } else {
+                state = READING_HEADER_END;
+            }
+        }
+        break;
+    case READING_HEADER_END:
+        if (!extract_metadata.out_data.empty() && !header.full()) {
+            cur = extract_metadata.out_data.read();
+            write_header(header, (first, buffer, cur.data));
             buffer = cur.data;
+            data_offset = header_end - 2 * word_bytes;
             state = cur.last ? LAST : STREAM;
-            header.write(buf);
         }
         break;
     case STREAM:
         if (!extract_metadata.out_data.empty() && !data.full()) {
             cur = extract_metadata.out_data.read();
 
-            hls_ik::axi_data buf = hls_ik::axi_data((ap_uint<256>((buffer(data_start - 1, 0),
-                                                    cur.data(255, data_start)))), 0xffffffff, 0);
+            window = (buffer, cur.data);
+            shifted = window << (data_offset * 8);
+            hls_ik::axi_data buf = hls_ik::axi_data(mlx::word(shifted(2 * W - 1, W)),
+                                                    mlx::keep_all(), 0);
             data.write(buf);
             buffer = cur.data;
             state = cur.last ? LAST : STREAM;
@@ -241,9 +419,9 @@ idle:
         if (data.full())
             break;
 
-        ap_uint<data_start> last_part = buffer(data_start - 1, 0);
-        hls_ik::axi_data buf((last_part, ap_uint<256 - data_start>(0)),
-                             hls_ik::axi_data::keep_bytes(32 - data_start / 8), true);
+        ap_uint<MLX_AXI4_WIDTH_BITS> last_part = buffer << (data_offset * 8);
+        hls_ik::axi_data buf(last_part,
+            mlx::last_word_keep_num_bytes_valid(word_bytes - data_offset), true);
         data.write(buf);
         state = IDLE;
         goto idle;
@@ -268,8 +446,6 @@ void length_adjust::find_length(header_stream& hdr_in)
 {
 #pragma HLS pipeline enable_flush
 
-    /* TODO this assumes a fixed size IP header */
-	constexpr int header_length = udp_header::width / 8 + ip_header::width / 8;
     header_buffer buf;
     packet_metadata pkt;
 
@@ -280,9 +456,11 @@ void length_adjust::find_length(header_stream& hdr_in)
     header_parser hdr = buf;
 
     pkt.tot_len = hdr.ip.tot_len;
+    /* The IP header length includes any options */
+    ap_uint<16> header_length = hdr.ip.ihl * 4 + udp_header::width / 8;
     ap_uint<16> data_length = (pkt.tot_len - header_length);
-    pkt.last_word_data = data_length(4, 0);
-    pkt.word_count = data_length(15, 5) + !!pkt.last_word_data;
+    pkt.last_word_data = data_length(MLX_AXI4_OFFSET_BITS - 1, 0);
+    pkt.word_count = (data_length >> MLX_AXI4_OFFSET_BITS) + !!pkt.last_word_data;
     DBG_DECL(pkt.pkt_id = buf.pkt_id);
 
     packets.write(pkt);
@@ -343,7 +521,7 @@ void length_adjust::adjust(header_stream& hdr_in, hls_ik::data_stream& data_in,
     cut_data(data_in, data_out);
 }
 
-void checksum::ipv4_checksum(ip_header hdr)
+void checksum::ipv4_checksum(ip_header hdr, ap_uint<16> options_checksum)
 {
      /* Clear checksum */
     hdr.check = 0;
@@ -357,6 +535,7 @@ void checksum::ipv4_checksum(ip_header hdr)
 bits_per_split; i += 16)
             cur_checksum.ip_checksum[split] += d(i + 15, i);
     }
+    cur_checksum.ip_checksum[0] += options_checksum;
 }
 
 checksum_t header_parser::checksum_from_packet()
@@ -368,8 +547,10 @@ checksum_t header_parser::checksum_from_packet()
     return from_packet;
 }
 
-void checksum::udp_pseudoheader_checksum(const header_parser& hdr)
+void checksum::udp_pseudoheader_checksum(const header_buffer& buf)
 {
+    header_parser hdr = buf;
+
     for (int i = 0; i < num_splits; ++i)
         cur_checksum.udp_checksum[i] = 0;
 
@@ -382,6 +563,13 @@ void checksum::udp_pseudoheader_checksum(const header_parser& hdr)
     cur_checksum.udp_checksum[6 % num_splits] += hdr.udp.source;
     cur_checksum.udp_checksum[7 % num_splits] += hdr.udp.dest;
     cur_checksum.udp_checksum[8 % num_splits] += hdr.udp.length;
+
+    if (buf.ipv6) {
+        for (int i = 0; i < 96; i += 16) {
+            cur_checksum.udp_checksum[(i / 16) % num_splits] += buf.saddr_high(i + 15, i);
+            cur_checksum.udp_checksum[(i / 16 + 6) % num_splits] += buf.daddr_high(i + 15, i);
+        }
+    }
 }
 
 header_parser header_parser::reply() const
@@ -419,8 +607,8 @@ void checksum::checksum_header_and_data(header_stream& hdr_in, hls_ik::data_stre
 #ifndef NDEBUG
             pkt_id = buf.pkt_id;
 #endif
-            ipv4_checksum(hdr.ip);
-            udp_pseudoheader_checksum(hdr);
+            ipv4_checksum(hdr.ip, buf.ip_options_checksum);
+            udp_pseudoheader_checksum(buf);
             if (hdr.udp.empty_packet()) {
                 intermediate_stream.write(cur_checksum);
             } else {
@@ -449,7 +637,7 @@ void checksum::checksum_header_and_data(header_stream& hdr_in, hls_ik::data_stre
 
 void checksum::finish_checksum(stream& checksum)
 {
-#pragma HLS PIPELINE enable_flush ii=3
+#pragma HLS PIPELINE enable_flush ii=1
     if (intermediate_stream.empty() || checksum.full())
         return;
 
@@ -475,12 +663,85 @@ void checksum::finish_checksum(stream& checksum)
 
 }
 
-bool checksum_validate::operator()(checksum_t sum, header_buffer buf)
+checksum_validate::checksum_validate() :
+    checks_to_stats("checks_to_stats"),
+    buf_valid(false)
+{}
+
+void checksum_validate::validate(checksum::stream& checksums, header_stream& hdr_in,
+                                 result_stream& results_in, bool_stream& pass,
+                                 header_stream& hdr_out, result_stream& results_out)
 {
+#pragma HLS pipeline enable_flush ii=1
+    if (!buf_valid) {
+        if (hdr_in.empty())
+            return;
+        buf = hdr_in.read();
+        buf_valid = true;
+    }
+
+    if ((buf.validate_checksums && checksums.empty()) || results_in.empty() ||
+        pass.full() || hdr_out.full() || results_out.full())
+        return;
+
+    buf_valid = false;
+    flow_table_result result = results_in.read();
+    if (!buf.validate_checksums) {
+        pass.write(true);
+        hdr_out.write(buf);
+        results_out.write(result);
+        return;
+    }
+
+    checksum_t sum = checksums.read();
     header_parser hdr = buf;
 
-    return sum.ip_checksum == hdr.ip.check &&
-           (sum.udp_checksum == hdr.udp.checksum || !hdr.udp.checksum);
+    /* A calculated UDP checksum of zero is sent as all ones, and a zero in
+     * the packet means the sender did not calculate it. That is only allowed
+     * over IPv4: IPv6 headers have no checksum of their own, so the UDP
+     * checksum is mandatory there (RFC 8200). */
+    ap_uint<16> udp_checksum = sum.udp_checksum ? sum.udp_checksum : ap_uint<16>(0xffff);
+    checks c;
+    c.bad_ip_checksum = !buf.ipv6 && sum.ip_checksum != hdr.ip.check;
+    c.bad_udp_checksum = (buf.ipv6 || hdr.udp.checksum) && udp_checksum != hdr.udp.checksum;
+
+    bool drop = c.bad_ip_checksum || c.bad_udp_checksum;
+    pass.write(!drop);
+    hdr_out.write(buf);
+    if (!drop)
+        results_out.write(result);
+    else
+        checks_to_stats.write_nb(c);
+}
+
+void checksum_validate::update_stats(hds_stats* s)
+{
+#pragma HLS pipeline enable_flush ii=1
+    s->drop_bad_ip_checksum = stats.drop_bad_ip_checksum;
+    s->drop_bad_udp_checksum = stats.drop_bad_udp_checksum;
+
+    if (checks_to_stats.empty())
+        return;
+
+    checks c = checks_to_stats.read();
+    if (c.bad_ip_checksum) {
+        ++stats.drop_bad_ip_checksum;
+    }
+    if (c.bad_udp_checksum) {
+        ++stats.drop_bad_udp_checksum;
+    }
+}
+
+void checksum_validate::validate_step(checksum::stream& checksums, header_stream& hdr_in,
+                                      result_stream& results_in, bool_stream& pass,
+                                      header_stream& hdr_out, result_stream& results_out,
+                                      hds_stats* s)
+{
+#pragma HLS inline
+    DO_PRAGMA_SYN(HLS data_pack variable=checks_to_stats);
+
+    validate(checksums, hdr_in, results_in, pass, hdr_out, results_out);
+    update_stats(s);
 }
 
 void udp_dropper::udp_dropper_step(bool_stream& pass,
@@ -521,59 +782,379 @@ void udp_dropper::udp_dropper_step(bool_stream& pass,
 
 udp::udp() :
     udp_dropper_instance(false), /* empty_packets_have_data */
+    split_data_checksum(false),
+    split_data_valid(false),
     data_steer_to_length("data_steer_to_length"),
-    header_dup_to_length("header_dup_to_length")
+    data_dup_to_dropper("data_dup_to_dropper"),
+    header_dup_to_length("header_dup_to_length"),
+    header_dup_to_validate("header_dup_to_validate")
 {
 }
 
-void udp::crossbar(header_stream& hdr_in, hls_ik::data_stream& data_in, result_stream& steer_results,
-         BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, header_stream& hdr_out),
-         BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, result_stream& ft_results),
-         BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, hls_ik::data_stream& data_out))
+virtual_output_queue::virtual_output_queue() :
+    hdr("voq_hdr"),
+    results("voq_results"),
+    data("voq_data"),
+    credits("voq_credits"),
+    state(IDLE),
+    words(0)
+{}
+
+void virtual_output_queue::forward(header_stream& hdr_out, result_stream& ft_results,
+                                   hls_ik::data_stream& data_out)
 {
 #pragma HLS pipeline enable_flush ii=1
+    switch (state) {
+    case IDLE: {
+        if (hdr.empty() || results.empty() || hdr_out.full() || ft_results.full())
+            return;
 
-    header_buffer buf;
+        header_buffer buf = hdr.read();
+        hdr_out.write(buf);
+        ft_results.write(results.read());
+        if (header_parser(buf.hdr).udp.empty_packet()) {
+            credits.write(voq_credit{0});
+        } else {
+            words = 0;
+            state = STREAM;
+        }
+        break;
+    }
+    case STREAM: {
+        if (data.empty() || data_out.full())
+            return;
 
-    switch (state) {
-    case IDLE:
-        if (steer_results.empty() || hdr_in.empty()
+        hls_ik::axi_data w = data.read();
+        data_out.write(w);
+        ++words;
+        if (w.last) {
+            credits.write(voq_credit{words});
+            state = IDLE;
+        }
+        break;
+    }
+    }
+}
+
+voq_crossbar::voq_crossbar() :
+    state(IDLE),
+    have_peeked(false),
+    admitted(false),
+    port(0),
+    group_updates("group_updates"),
+    drop_on_full(false),
+    gateway_drop_on_full(false),
+    drop_on_full_updates("drop_on_full_updates"),
+    drops_to_stats("drops_to_stats"),
+    stats()
+{
+    for (int i = 0; i < NUM_IKERNELS; ++i) {
+        voq_words[i] = 0;
+        voq_packets[i] = 0;
+    }
+}
+
+ap_uint<32> voq_crossbar::hash_5tuple(const header_parser& hdr)
+{
+#pragma HLS inline
+    static const ap_uint<160> key(TOEPLITZ_RSS_KEY);
+    ap_uint<96> tuple = (hdr.ip.saddr, hdr.ip.daddr, hdr.udp.source, hdr.udp.dest);
+    return toeplitz_hash(tuple, key);
+}
+
+ap_uint<32> voq_crossbar::hash_payload(const replica_group& group, const hls_ik::axi_data& w)
+{
+#pragma HLS inline
+    static const ap_uint<160> key(TOEPLITZ_RSS_KEY);
+    const int max_bits = XBAR_HASH_MAX_BYTES * 8;
+    ap_uint<MLX_AXI4_WIDTH_BITS + max_bits> shifted =
+        ap_uint<MLX_AXI4_WIDTH_BITS + max_bits>(w.data) << max_bits;
+    shifted <<= group.payload_offset * 8;
+    ap_uint<max_bits> bytes = shifted(MLX_AXI4_WIDTH_BITS + max_bits - 1, MLX_AXI4_WIDTH_BITS);
+
+    /* Hash only the requested bytes that are part of the packet */
+    for (int i = 0; i < XBAR_HASH_MAX_BYTES; ++i) {
+#pragma HLS unroll
+        int byte = group.payload_offset + i;
+        if (i >= group.payload_bytes || byte >= MLX_AXI4_WIDTH_BYTES ||
+            !w.keep[MLX_AXI4_WIDTH_BYTES - 1 - byte])
+            bytes(max_bits - 1 - 8 * i, max_bits - 8 - 8 * i) = 0;
+    }
+
+    return toeplitz_hash(bytes, key);
+}
+
+voq_crossbar::port_t voq_crossbar::select_replica(const replica_group& group, ap_uint<32> hash)
+{
+#pragma HLS inline
+    if (group.count == 0)
+        return NUM_IKERNELS;
+
+    /* Scale the hash to the number of engines without a division */
+    return group.first + ((ap_uint<16>(hash(15, 0)) * group.count) >> 16);
+}
+
+bool voq_crossbar::admit(port_t p)
+{
+#pragma HLS inline
+    port = p;
+    bool room = port < NUM_IKERNELS && voq_packets[port] < VOQ_PACKETS &&
+                voq_words[port] + cur_words <= VOQ_WORDS;
+    /* There is no point in waiting for a port that does not exist */
+    if (!room && !drop_on_full && port < NUM_IKERNELS)
+        return false;
+
+    admitted = room;
+    if (admitted) {
 #define BOOST_PP_LOCAL_MACRO(n) \
-            || (hdr_out ## n).full() \
-            || (ft_results ## n).full()
+        if (port == n) { \
+            voq ## n.hdr.write(cur_buf); \
+            voq ## n.results.write(cur_result); \
+        }
 #define BOOST_PP_LOCAL_LIMITS (0, NUM_IKERNELS - 1)
 %:include BOOST_PP_LOCAL_ITERATE()
-        )
-            return;
+        ++voq_packets[port];
+    } else {
+        drops_to_stats.write_nb(port);
+    }
+    return true;
+}
 
-        current_steering_decision = steer_results.read();
+void voq_crossbar::write_data(const hls_ik::axi_data& w)
+{
+#pragma HLS inline
 #define BOOST_PP_LOCAL_MACRO(n) \
-        if (current_steering_decision.v.engine_id == n) { \
-            buf = hdr_in.read(); \
-            (hdr_out ## n).write(buf); \
-            (ft_results ## n).write(current_steering_decision); \
-        }
+    if (port == n) \
+        voq ## n.data.write(w);
 #define BOOST_PP_LOCAL_LIMITS (0, NUM_IKERNELS - 1)
 %:include BOOST_PP_LOCAL_ITERATE()
+    ++voq_words[port];
+}
 
-        state = header_parser(buf.hdr).udp.empty_packet() ? IDLE : STREAM;
-        break;
+void voq_crossbar::dispatch_packet(port_t p)
+{
+#pragma HLS inline
+    if (!admit(p)) {
+        state = WAIT;
+        return;
+    }
 
-    case STREAM:
+    if (have_peeked) {
+        if (admitted)
+            write_data(peeked);
+        state = peeked.last ? IDLE : STREAM;
+    } else {
+        state = cur_words == 0 ? IDLE : STREAM;
+    }
+}
+
+void voq_crossbar::dispatch(header_stream& hdr_in, hls_ik::data_stream& data_in,
+                            result_stream& steer_results)
+{
+#pragma HLS pipeline enable_flush ii=1
+#pragma HLS array_partition variable=voq_words complete
+#pragma HLS array_partition variable=voq_packets complete
+#pragma HLS array_partition variable=groups complete
+
+    /* Reclaim the space of packets the queues passed on */
 #define BOOST_PP_LOCAL_MACRO(n) \
-        if (current_steering_decision.v.engine_id == n) { \
-            if (data_in.empty() || (data_out ## n).full()) \
-                return; \
-            \
-            hls_ik::axi_data buf = data_in.read(); \
-            (data_out ## n).write(buf); \
-            state = buf.last ? IDLE : STREAM; \
-        }
+    { \
+        voq_credit c; \
+        if (voq ## n.credits.read_nb(c)) { \
+            voq_words[n] -= c.words; \
+            --voq_packets[n]; \
+        } \
+    }
 #define BOOST_PP_LOCAL_LIMITS (0, NUM_IKERNELS - 1)
 %:include BOOST_PP_LOCAL_ITERATE()
 
+    replica_group_update update;
+    if (group_updates.read_nb(update))
+        groups[update.index] = update.group;
+    bool drop_update;
+    if (drop_on_full_updates.read_nb(drop_update))
+        drop_on_full = drop_update;
+
+    switch (state) {
+    case IDLE: {
+        if (steer_results.empty() || hdr_in.empty())
+            return;
+
+        cur_result = steer_results.read();
+        cur_buf = hdr_in.read();
+        header_parser hdr = cur_buf.hdr;
+        cur_words = hdr.udp.empty_packet() ? ap_uint<16>(0) :
+            ap_uint<16>((hdr.udp.length - udp_header::width / 8 + MLX_AXI4_WIDTH_BYTES - 1) >>
+                        MLX_AXI4_OFFSET_BITS);
+        have_peeked = false;
+
+        if (cur_result.v.action != FT_REPLICA_GROUP) {
+            dispatch_packet(cur_result.v.engine_id);
+        } else {
+            const replica_group& group = groups[cur_result.v.engine_id];
+            if (group.hash == XBAR_HASH_PAYLOAD && cur_words != 0)
+                state = PEEK;
+            else
+                dispatch_packet(select_replica(group, hash_5tuple(hdr)));
+        }
+        break;
+    }
+
+    case PEEK: {
+        if (data_in.empty())
+            return;
+
+        peeked = data_in.read();
+        have_peeked = true;
+        dispatch_packet(select_replica(groups[cur_result.v.engine_id],
+                                       hash_payload(groups[cur_result.v.engine_id], peeked)));
+        break;
+    }
+
+    case WAIT:
+        dispatch_packet(port);
+        break;
+
+    case STREAM: {
+        if (data_in.empty())
+            return;
+
+        hls_ik::axi_data w = data_in.read();
+        if (admitted)
+            write_data(w);
+        state = w.last ? IDLE : STREAM;
+        break;
+    }
+    }
+}
+
+void voq_crossbar::update_stats(crossbar_stats* s)
+{
+#pragma HLS pipeline enable_flush ii=1
+#pragma HLS array_partition variable=stats.voq_full complete
+    for (int i = 0; i < NUM_IKERNELS; ++i)
+#pragma HLS unroll
+        s->voq_full[i] = stats.voq_full[i];
+
+    port_t dropped;
+    if (!drops_to_stats.read_nb(dropped) || dropped >= NUM_IKERNELS)
+        return;
+
+    ++stats.voq_full[dropped];
+}
+
+void voq_crossbar::replica_gateway(hls_ik::gateway_registers& g)
+{
+#pragma HLS pipeline enable_flush ii=3
+    gateway.gateway(g, [=](ap_uint<31> addr, int& data) -> int {
+#pragma HLS inline
+        if (addr & hls_ik::GW_WRITE)
+            return reg_write(addr & ~hls_ik::GW_WRITE, data);
+        else
+            return reg_read(addr & ~hls_ik::GW_WRITE, &data);
+    });
+}
+
+int voq_crossbar::reg_write(int address, int value)
+{
+#pragma HLS inline
+    if (address == XBAR_DROP_ON_FULL) {
+        if (drop_on_full_updates.full())
+            return GW_BUSY;
+        gateway_drop_on_full = value != 0;
+        drop_on_full_updates.write(gateway_drop_on_full);
+        return GW_DONE;
+    }
+
+    if (address < XBAR_GROUP_BASE ||
+        address >= XBAR_GROUP_BASE + REPLICA_GROUPS * XBAR_GROUP_STRIDE)
+        return GW_FAIL;
+
+    if (group_updates.full())
+        return GW_BUSY;
+
+    int index = (address - XBAR_GROUP_BASE) / XBAR_GROUP_STRIDE;
+    replica_group& group = gateway_groups[index];
+    switch ((address - XBAR_GROUP_BASE) % XBAR_GROUP_STRIDE) {
+    case XBAR_GROUP_ENGINES:
+        /* Every engine of the group must exist */
+        if ((value & 0xff) + ((value >> 8) & 0xff) > NUM_IKERNELS)
+            return GW_FAIL;
+        group.first = value & 0xff;
+        group.count = (value >> 8) & 0xff;
+        break;
+    case XBAR_GROUP_HASH:
+        if ((value & 0xff) > XBAR_HASH_PAYLOAD || ((value >> 16) & 0xff) > XBAR_HASH_MAX_BYTES)
+            return GW_FAIL;
+        group.hash = value & 0xff;
+        group.payload_offset = (value >> 8) & 0xff;
+        group.payload_bytes = (value >> 16) & 0xff;
         break;
     }
+
+    group_updates.write(replica_group_update{index, group});
+    return GW_DONE;
+}
+
+int voq_crossbar::reg_read(int address, int* value)
+{
+#pragma HLS inline
+    if (address == XBAR_NUM_GROUPS) {
+        *value = REPLICA_GROUPS;
+        return GW_DONE;
+    }
+    if (address == XBAR_DROP_ON_FULL) {
+        *value = gateway_drop_on_full;
+        return GW_DONE;
+    }
+
+    if (address < XBAR_GROUP_BASE ||
+        address >= XBAR_GROUP_BASE + REPLICA_GROUPS * XBAR_GROUP_STRIDE) {
+        *value = -1;
+        return GW_FAIL;
+    }
+
+    const replica_group& group = gateway_groups[(address - XBAR_GROUP_BASE) / XBAR_GROUP_STRIDE];
+    switch ((address - XBAR_GROUP_BASE) % XBAR_GROUP_STRIDE) {
+    case XBAR_GROUP_ENGINES:
+        *value = group.first | group.count << 8;
+        break;
+    case XBAR_GROUP_HASH:
+        *value = group.hash | group.payload_offset << 8 | group.payload_bytes << 16;
+        break;
+    }
+    return GW_DONE;
+}
+
+void voq_crossbar::crossbar_step(header_stream& hdr_in, hls_ik::data_stream& data_in,
+                                 result_stream& steer_results,
+                                 BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, header_stream& hdr_out),
+                                 BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, result_stream& ft_results),
+                                 BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, hls_ik::data_stream& data_out),
+                                 hls_ik::gateway_registers& g, crossbar_stats* s)
+{
+#pragma HLS inline
+#pragma HLS array_partition variable=s->voq_full complete
+#define BOOST_PP_LOCAL_MACRO(n) \
+    DO_PRAGMA_SYN(HLS data_pack variable=voq ## n.hdr); \
+    DO_PRAGMA_SYN(HLS data_pack variable=voq ## n.data); \
+    DO_PRAGMA(HLS STREAM variable=voq ## n.hdr depth=VOQ_PACKETS); \
+    DO_PRAGMA(HLS STREAM variable=voq ## n.results depth=VOQ_PACKETS); \
+    DO_PRAGMA(HLS STREAM variable=voq ## n.data depth=VOQ_WORDS); \
+    DO_PRAGMA(HLS STREAM variable=voq ## n.credits depth=VOQ_PACKETS);
+#define BOOST_PP_LOCAL_LIMITS (0, NUM_IKERNELS - 1)
+%:include BOOST_PP_LOCAL_ITERATE()
+    DO_PRAGMA(HLS STREAM variable=drops_to_stats depth=FIFO_PACKETS);
+    DO_PRAGMA(HLS STREAM variable=group_updates depth=2);
+    DO_PRAGMA(HLS STREAM variable=drop_on_full_updates depth=2);
+
+    replica_gateway(g);
+    dispatch(hdr_in, data_in, steer_results);
+#define BOOST_PP_LOCAL_MACRO(n) \
+    voq ## n.forward(hdr_out ## n, ft_results ## n, data_out ## n);
+#define BOOST_PP_LOCAL_LIMITS (0, NUM_IKERNELS - 1)
+%:include BOOST_PP_LOCAL_ITERATE()
+    update_stats(s);
 }
 
 void udp::udp_step(mlx::stream& in,
@@ -581,6 +1162,7 @@ void udp::udp_step(mlx::stream& in,
                    BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, result_stream& ft_results),
                    BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, hls_ik::data_stream& data_out),
                    bool_stream& bool_pass_raw,
+                   hls_ik::memory_t& ft_mem,
                    config* config, udp_stats* stats)
 {
 #pragma HLS interface ap_none port=config
@@ -588,32 +1170,97 @@ void udp::udp_step(mlx::stream& in,
 
     DO_PRAGMA_SYN(HLS data_pack variable=data_split_to_steer);
     DO_PRAGMA_SYN(HLS data_pack variable=data_steer_to_length);
-    DO_PRAGMA_SYN(HLS data_pack variable=data_length_to_crossbar);
+    DO_PRAGMA_SYN(HLS data_pack variable=data_length_to_dup);
+    DO_PRAGMA_SYN(HLS data_pack variable=data_dup_to_checksum);
+    DO_PRAGMA_SYN(HLS data_pack variable=data_dup_to_dropper);
+    DO_PRAGMA_SYN(HLS data_pack variable=data_dropper_to_crossbar);
     DO_PRAGMA_SYN(HLS data_pack variable=header_split_to_steer);
     DO_PRAGMA_SYN(HLS data_pack variable=header_steer_to_dup);
-    DO_PRAGMA_SYN(HLS data_pack variable=header_dup_to_crossbar);
     DO_PRAGMA_SYN(HLS data_pack variable=header_dup_to_length);
+    DO_PRAGMA_SYN(HLS data_pack variable=header_dup_to_checksum);
+    DO_PRAGMA_SYN(HLS data_pack variable=header_dup_to_validate);
+    DO_PRAGMA_SYN(HLS data_pack variable=header_validate_to_dropper);
+    DO_PRAGMA_SYN(HLS data_pack variable=header_dropper_to_crossbar);
+    DO_PRAGMA_SYN(HLS data_pack variable=validated_results);
+    DO_PRAGMA_SYN(HLS data_pack variable=checksums);
 
     DO_PRAGMA(HLS STREAM variable=header_split_to_steer depth=FIFO_PACKETS);
     DO_PRAGMA(HLS STREAM variable=data_split_to_steer depth=FIFO_WORDS);
     DO_PRAGMA(HLS STREAM variable=data_steer_to_length depth=FIFO_WORDS);
-    DO_PRAGMA(HLS STREAM variable=data_length_to_crossbar depth=FIFO_WORDS);
+    DO_PRAGMA(HLS STREAM variable=data_length_to_dup depth=FIFO_WORDS);
+    /* Holds a whole packet while its checksum is calculated */
+    DO_PRAGMA(HLS STREAM variable=data_dup_to_dropper depth=FIFO_WORDS);
     DO_PRAGMA(HLS STREAM variable=header_steer_to_dup depth=FIFO_PACKETS);
     DO_PRAGMA(HLS STREAM variable=header_dup_to_length depth=FIFO_PACKETS);
-    DO_PRAGMA(HLS STREAM variable=header_dup_to_crossbar depth=FIFO_PACKETS);
+    DO_PRAGMA(HLS STREAM variable=header_dup_to_checksum depth=FIFO_PACKETS);
+    DO_PRAGMA(HLS STREAM variable=header_dup_to_validate depth=FIFO_PACKETS);
+    DO_PRAGMA(HLS STREAM variable=header_dropper_to_crossbar depth=FIFO_PACKETS);
+    DO_PRAGMA(HLS STREAM variable=checksums depth=FIFO_PACKETS);
+    DO_PRAGMA(HLS STREAM variable=validated_results depth=FIFO_PACKETS);
+    DO_PRAGMA(HLS STREAM variable=split_to_data depth=FIFO_PACKETS);
 
     hds.step(in, header_split_to_steer, data_split_to_steer);
     steer.steer(header_split_to_steer, data_split_to_steer, bool_pass_raw,
-                header_steer_to_dup, data_steer_to_length, steer_results, config, &stats->hds);
-    hdr_dup.dup2(header_steer_to_dup,
-        header_dup_to_length,
-        header_dup_to_crossbar);
+                header_steer_to_dup, data_steer_to_length, steer_results, ft_mem,
+                config, &stats->hds, &stats->ft);
+    split_headers(*config);
     length_adjuster.adjust(header_dup_to_length, data_steer_to_length,
-                           data_length_to_crossbar);
-    crossbar(header_dup_to_crossbar, data_length_to_crossbar, steer_results,
-             BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, header_out),
-             BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, ft_results),
-             BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, data_out));
+                           data_length_to_dup);
+    split_data();
+    checksum_calculator.checksum_step(header_dup_to_checksum, data_dup_to_checksum,
+                                      checksums);
+    validator.validate_step(checksums, header_dup_to_validate, steer_results,
+                            validate_to_dropper, header_validate_to_dropper,
+                            validated_results, &stats->hds);
+    udp_dropper_instance.udp_dropper_step(validate_to_dropper,
+        header_validate_to_dropper, data_dup_to_dropper,
+        header_dropper_to_crossbar, data_dropper_to_crossbar);
+    crossbar.crossbar_step(header_dropper_to_crossbar, data_dropper_to_crossbar,
+                           validated_results,
+                           BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, header_out),
+                           BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, ft_results),
+                           BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, data_out),
+                           config->crossbar_gateway, &stats->crossbar);
+}
+
+void udp::split_headers(const config& config)
+{
+#pragma HLS pipeline enable_flush ii=1
+    if (header_steer_to_dup.empty() || header_dup_to_length.full() ||
+        header_dup_to_checksum.full() || header_dup_to_validate.full() ||
+        split_to_data.full())
+        return;
+
+    header_buffer buf = header_steer_to_dup.read();
+    buf.validate_checksums = config.checksum_validate;
+    header_dup_to_length.write(buf);
+    header_dup_to_validate.write(buf);
+    if (buf.validate_checksums)
+        header_dup_to_checksum.write(buf);
+    if (!header_parser(buf).udp.empty_packet())
+        split_to_data.write(buf.validate_checksums);
+}
+
+void udp::split_data()
+{
+#pragma HLS pipeline enable_flush ii=1
+    if (!split_data_valid) {
+        if (split_to_data.empty())
+            return;
+        split_data_checksum = split_to_data.read();
+        split_data_valid = true;
+    }
+
+    if (data_length_to_dup.empty() || data_dup_to_dropper.full() ||
+        data_dup_to_checksum.full())
+        return;
+
+    hls_ik::axi_data word = data_length_to_dup.read();
+    data_dup_to_dropper.write(word);
+    if (split_data_checksum)
+        data_dup_to_checksum.write(word);
+    if (word.last)
+        split_data_valid = false;
 }
 
 udp_builder::udp_builder()
@@ -637,20 +1284,54 @@ header_parser header_to_mlx::metadata_to_header(const hls_ik::metadata& m)
     hdr.udp.dest = pkt.udp_dst;
     hdr.udp.source = pkt.udp_src;
     hdr.udp.length = hdr.udp.width / 8 + m.length;
+    hdr.ip.check = ip_header_checksum(hdr.ip);
 
     return hdr;
 }
 
+ap_uint<16> header_to_mlx::ip_header_checksum(ip_header hdr)
+{
+    hdr.check = 0;
+    ap_uint<ip_header::width> d = hdr;
+    ap_uint<20> sum = 0;
+
+    for (int i = 0; i < ip_header::width; i += 16)
+        sum += d(i + 15, i);
+    for (int i = 0; i < 2; ++i)
+        sum = sum(15, 0) + sum(19, 16);
+
+    return ~ap_uint<16>(sum(15, 0));
+}
+
+ap_uint<16> header_to_mlx::pseudo_header_seed(const hls_ik::metadata& m)
+{
+    hls_ik::packet_metadata pkt = m.get_packet_metadata();
+    ap_uint<22> sum = IPPROTO_UDP + udp_header::width / 8 + m.length;
+
+    /* The low bits of the addresses are summed from the packet */
+    if (pkt.ipv6) {
+        for (int i = 0; i < 96; i += 16)
+            sum += pkt.ip_src_high(i + 15, i) + pkt.ip_dst_high(i + 15, i);
+    }
+    for (int i = 0; i < 2; ++i)
+        sum = sum(15, 0) + sum(21, 16);
+
+    return sum(15, 0);
+}
+
 void header_to_mlx::hdr_to_mlx(udp_builder_metadata_stream& in, hls_ik::data_stream& out,
                                bool_stream& empty_packet,
-                               mlx::metadata_stream& metadata_out, bool_stream& enable_stream)
+                               mlx::metadata_stream& metadata_out, bool_stream& enable_stream,
+                               packet_metadata_stream& pkt_out,
+                               bool udp_checksum, checksum_cmd_stream& checksum_out)
 {
 #pragma HLS pipeline enable_flush
     switch (state)
     {
     case IDLE: {
         if (in.empty() || out.full() || empty_packet.full() ||
-	    metadata_out.full() || enable_stream.full())
+	    metadata_out.full() || enable_stream.full() || pkt_out.full() ||
+            checksum_out.full())
             break;
 
         udp_builder_metadata m = in.read();
@@ -659,30 +1340,307 @@ void header_to_mlx::hdr_to_mlx(udp_builder_metadata_stream& in, hls_ik::data_str
 
         header_parser hdr = metadata_to_header(m);
         header_buffer buf = hdr;
-        ap_uint<256> word = buf.hdr(hdr.width - 1, hdr.width - 256);
+#if MLX_AXI4_WIDTH_BITS < 512
+        mlx::word word = buf.hdr(hdr.width - 1, hdr.width - MLX_AXI4_WIDTH_BITS);
         buffer = buf.hdr(buffer_size - 1, 0);
 
-        hls_ik::axi_data output(word, 0xffffffff, false);
+        hls_ik::axi_data output(word, mlx::keep_all(), false);
+#else
+        /* The whole header fits in a single word */
+        hls_ik::axi_data output((buf.hdr, ap_uint<MLX_AXI4_WIDTH_BITS - header_parser::width>(0)),
+                                hls_ik::axi_data::keep_bytes(header_parser::width / 8), true);
+#endif
         const bool is_udp = m.pkt_type == PKT_TYPE_UDP;
         if (is_udp)
             out.write(output);
 
         empty_packet.write(is_udp && hdr.udp.empty_packet());
         enable_stream.write(is_udp);
-
+        /* Raw packets are sent as they are */
+        pkt_out.write(is_udp ? m.get_packet_metadata() : hls_ik::packet_metadata());
+        /* IPv6 forbids a zero UDP checksum (RFC 8200), so it is always
+         * computed there */
+        checksum_cmd cmd;
+        cmd.enable = is_udp && (udp_checksum || m.get_packet_metadata().ipv6);
+        cmd.seed = pseudo_header_seed(m);
+        checksum_out.write(cmd);
+
+#if MLX_AXI4_WIDTH_BITS < 512
         state = is_udp ? SECOND: IDLE;
+#endif
         break;
     }
     case SECOND:
+#if MLX_AXI4_WIDTH_BITS < 512
         hls_ik::axi_data out_buf(
             (buffer, ap_uint<MLX_AXI4_WIDTH_BITS - buffer_size>(0)),
             hls_ik::axi_data::keep_bytes(buffer_size / 8),
             true);
         out.write(out_buf);
+#endif
+        state = IDLE;
+    }
+}
+
+void checksum_insertion::sum_data(checksum_cmd_stream& cmd_in, hls_ik::data_stream& in)
+{
+#pragma HLS pipeline enable_flush ii=1
+    /* The checksum covers the IP addresses, at bytes 26-33, and everything
+     * from the UDP header on. These are the lanes of the first word from
+     * byte 26 on, and the whole of the following words. */
+    const int first_word_lanes = (MLX_AXI4_WIDTH_BYTES - 26) / 2;
+    hls_ik::axi_data word;
+    ap_uint<MLX_AXI4_WIDTH_BITS> masked_word;
+
+    switch (sum_state) {
+    case IDLE:
+        if (cmd_in.empty() || in.empty() || buffer.full() || enables.full() ||
+            intermediate_stream.full())
+            break;
+
+        {
+            checksum_cmd cmd = cmd_in.read();
+            word = in.read();
+            buffer.write(word);
+            enables.write(cmd.enable);
+
+            sum_enable = cmd.enable;
+            for (int i = 0; i < num_splits; ++i)
+                cur_checksum.udp_checksum[i] = 0;
+            cur_checksum.udp_checksum[0] = cmd.seed;
+            masked_word = mask_last_word(word);
+            for (int i = 0; i < first_word_lanes; ++i) {
+#pragma HLS unroll
+                cur_checksum.udp_checksum[i & (num_splits - 1)] += masked_word(16 * i + 15, 16 * i);
+            }
+
+            if (cmd.enable && word.last)
+                intermediate_stream.write(cur_checksum);
+            if (!word.last)
+                sum_state = DATA;
+        }
+        break;
+    case DATA:
+        if (in.empty() || buffer.full() || intermediate_stream.full())
+            break;
+
+        word = in.read();
+        buffer.write(word);
+        masked_word = mask_last_word(word);
+        for (int i = 0; i < MLX_AXI4_WIDTH_BYTES / 2; ++i) {
+#pragma HLS unroll
+            cur_checksum.udp_checksum[i & (num_splits - 1)] += masked_word(16 * i + 15, 16 * i);
+        }
+
+        if (word.last) {
+            if (sum_enable)
+                intermediate_stream.write(cur_checksum);
+            sum_state = IDLE;
+        }
+        break;
+    }
+}
+
+void checksum_insertion::finish_checksum()
+{
+#pragma HLS pipeline enable_flush ii=1
+    if (intermediate_stream.empty() || checksums.full())
+        return;
+
+    intermediate_checksum cur = intermediate_stream.read();
+
+    ap_uint<32> udp_result = 0;
+    for (int i = 0; i < num_splits; ++i)
+        udp_result += cur.udp_checksum[i];
+    for (int i = 0; i < 2; ++i)
+        udp_result = udp_result(15, 0) + udp_result(31, 16);
+
+    ap_uint<16> result = ~udp_result;
+    /* A zero UDP checksum means no checksum, and is sent as all ones */
+    if (result == 0)
+        result = 0xffff;
+
+    checksums.write(result);
+}
+
+void checksum_insertion::insert(hls_ik::data_stream& out)
+{
+#pragma HLS pipeline enable_flush ii=1
+    /* The UDP checksum is at bytes 40-41: in the second word with 256-bit
+     * words, and in the first with 512-bit words */
+    const int checksum_word = 40 / MLX_AXI4_WIDTH_BYTES;
+    const int checksum_msb = MLX_AXI4_WIDTH_BITS - 8 * (40 % MLX_AXI4_WIDTH_BYTES) - 1;
+    hls_ik::axi_data word;
+
+    switch (insert_state) {
+    case INSERT_IDLE:
+        /* Packets without a checksum do not wait to be summed */
+        if (!enable_valid) {
+            if (enables.empty())
+                break;
+            cur_result.enable = enables.read();
+            enable_valid = true;
+        }
+        if ((cur_result.enable && checksums.empty()) || buffer.empty() || out.full())
+            break;
+
+        enable_valid = false;
+        if (cur_result.enable)
+            cur_result.udp_checksum = checksums.read();
+        word = buffer.read();
+        if (checksum_word == 0 && cur_result.enable)
+            word.data(checksum_msb, checksum_msb - 15) = cur_result.udp_checksum;
+        out.write(word);
+        if (!word.last)
+            insert_state = checksum_word == 1 && cur_result.enable ? SECOND : STREAM;
+        break;
+    case SECOND:
+    case STREAM:
+        if (buffer.empty() || out.full())
+            break;
+
+        word = buffer.read();
+        if (insert_state == SECOND)
+            word.data(checksum_msb, checksum_msb - 15) = cur_result.udp_checksum;
+        out.write(word);
+        insert_state = word.last ? INSERT_IDLE : STREAM;
+        break;
+    }
+}
+
+void checksum_insertion::insert_step(checksum_cmd_stream& cmd_in, hls_ik::data_stream& in,
+                                     hls_ik::data_stream& out)
+{
+#pragma HLS inline
+    DO_PRAGMA(HLS STREAM variable=buffer depth=FIFO_WORDS);
+    DO_PRAGMA(HLS STREAM variable=enables depth=FIFO_PACKETS);
+    DO_PRAGMA(HLS STREAM variable=intermediate_stream depth=FIFO_PACKETS);
+    DO_PRAGMA(HLS STREAM variable=checksums depth=FIFO_PACKETS);
+    DO_PRAGMA_SYN(HLS data_pack variable=buffer);
+
+    sum_data(cmd_in, in);
+    finish_checksum();
+    insert(out);
+}
+
+header_expansion::header_expansion() : state(IDLE) {}
+
+void header_expansion::last_word(const ap_uint<MLX_AXI4_WIDTH_BITS>& word,
+                                 const mlx::keep_t& keep,
+                                 hls_ik::data_stream& out)
+{
+#pragma HLS inline
+    ap_uint<MLX_AXI4_OFFSET_BITS + 1> bytes = 0;
+    for (int i = 0; i < MLX_AXI4_WIDTH_BYTES; ++i) {
+#pragma HLS unroll
+        bytes += keep(i, i);
+    }
+
+    /* Bytes shifted out of the last word need an extra word */
+    if (bytes + shift > MLX_AXI4_WIDTH_BYTES) {
+        extra_bytes = bytes + shift - MLX_AXI4_WIDTH_BYTES;
+        out.write(hls_ik::axi_data(word, mlx::keep_all(), false));
+        state = EXTRA;
+    } else {
+        out.write(hls_ik::axi_data(word, mlx::last_word_keep_num_bytes_valid(bytes + shift), true));
         state = IDLE;
     }
 }
 
+void header_expansion::expand(packet_metadata_stream& pkt_in, hls_ik::data_stream& in,
+                              hls_ik::data_stream& out)
+{
+#pragma HLS pipeline enable_flush ii=1
+    const int W = MLX_AXI4_WIDTH_BITS;
+    /* Ethernet addresses, before the tags */
+    const int addr_bits = eth_header::width - 16;
+    /* The ethertype and the IPv6 header without its last two bytes, that
+     * come from the IPv4 header, followed by the rest of the first input
+     * word after the IPv4 header, if there is any */
+    const int ipv6_bits = 16 + 320 - 16;
+    const int l3_bits = ipv6_bits + W - 256;
+    hls_ik::axi_data cur;
+    ap_uint<W> word;
+    ap_uint<2 * W> window;
+
+    switch (state) {
+    case IDLE:
+        if (pkt_in.empty() || in.empty() || out.full())
+            break;
+
+        {
+            hls_ik::packet_metadata pkt = pkt_in.read();
+            const hls_ik::vlan_tags& tags = pkt.vlan;
+            const ap_uint<16> outer_type = tags.stag ? ETH_P_8021AD : ETH_P_8021Q;
+            const ap_uint<16> inner_type = ETH_P_8021Q;
+            /* The headers of the first output words */
+            ap_uint<2 * W> prefix = 0;
+            ap_uint<l3_bits> l3 = 0;
+
+            cur = in.read();
+            shift = tags.count * 4 + pkt.ipv6 * 20;
+
+            prefix(2 * W - 1, 2 * W - addr_bits) = cur.data(W - 1, W - addr_bits);
+            if (tags.count == 1)
+                prefix(2 * W - addr_bits - 1, 2 * W - addr_bits - 32) =
+                    (outer_type, tags.outer);
+            else if (tags.count == 2)
+                prefix(2 * W - addr_bits - 1, 2 * W - addr_bits - 64) =
+                    (outer_type, tags.outer, inner_type, tags.inner);
+
+            if (pkt.ipv6) {
+                /* The IPv4 header written by header_to_mlx */
+                ap_uint<16> tot_len = cur.data(W - 129, W - 144);
+                ap_uint<8> tos = cur.data(W - 121, W - 128), ttl = cur.data(W - 177, W - 184),
+                           protocol = cur.data(W - 185, W - 192);
+
+                l3(l3_bits - 1, l3_bits - ipv6_bits) =
+                    (ap_uint<16>(ETH_P_IPV6), ap_uint<4>(6), tos, ap_uint<20>(0),
+                     ap_uint<16>(tot_len - ip_header::width / 8), protocol, ttl,
+                     pkt.ip_src_high, pkt.ip_src, pkt.ip_dst_high,
+                     ap_uint<16>(pkt.ip_dst(31, 16)));
+#if MLX_AXI4_WIDTH_BITS > 256
+                l3(l3_bits - ipv6_bits - 1, 0) = cur.data(W - 257, 0);
+#endif
+            } else {
+                l3(l3_bits - 1, l3_bits - (W - addr_bits)) = cur.data(W - addr_bits - 1, 0);
+            }
+            window = (l3, ap_uint<2 * W - l3_bits>(0));
+            prefix |= window >> (addr_bits + tags.count * 32);
+
+            word = prefix(2 * W - 1, W);
+            /* The rest of the prefix is the tail of a virtual previous word.
+             * The last two bytes of an IPv6 header follow it. */
+            cur.data = ap_uint<W>(prefix(W - 1, 0)) >> ((MLX_AXI4_WIDTH_BYTES - shift) * 8);
+        }
+        goto output;
+    case STREAM:
+        if (in.empty() || out.full())
+            break;
+
+        cur = in.read();
+        window = (prev, cur.data);
+        word = window >> (shift * 8);
+output:
+        if (cur.last) {
+            last_word(word, cur.keep, out);
+        } else {
+            out.write(hls_ik::axi_data(word, mlx::keep_all(), false));
+            state = STREAM;
+        }
+        prev = cur.data;
+        break;
+    case EXTRA:
+        if (out.full())
+            break;
+
+        out.write(hls_ik::axi_data(prev << ((MLX_AXI4_WIDTH_BYTES - shift) * 8),
+                                   hls_ik::axi_data::keep_bytes(extra_bytes), true));
+        state = IDLE;
+        break;
+    }
+}
+
 ethernet_padding::ethernet_padding() {}
 
 void ethernet_padding::pad(mlx::stream& in, mlx::stream& out)
@@ -691,21 +1649,27 @@ void ethernet_padding::pad(mlx::stream& in, mlx::stream& out)
     if (in.empty() || out.full())
         return;
 
+    /* The beat holding the end of a minimum size frame */
+    const int min_frame = 60;
+    const int pad_beat = min_frame / MLX_AXI4_WIDTH_BYTES;
+
     mlx::axi4s beat = in.read();
-    if (beat.last && beat_count == 1) {
+    if (beat.last && beat_count == pad_beat) {
         beat.data = pad_one(beat.data, beat.keep);
-        beat.keep = beat.keep | 0xfffffff0;
+        beat.keep = beat.keep |
+            mlx::last_word_keep_num_bytes_valid(min_frame % MLX_AXI4_WIDTH_BYTES);
     }
     out.write(beat);
+    /* Saturate, so that jumbo frames do not wrap around to a single beat */
     if (beat.last)
         beat_count = 0;
-    else
+    else if (beat_count < 2)
         ++beat_count;
 }
 
-ap_uint<256> ethernet_padding::pad_one(ap_uint<256> data, ap_uint<32> keep)
+mlx::word ethernet_padding::pad_one(mlx::word data, mlx::keep_t keep)
 {
-    for (int i = 0; i < 32; ++i) {
+    for (int i = 0; i < MLX_AXI4_WIDTH_BYTES; ++i) {
         data(8 * i + 7, 8 * i) = keep(i, i) ? data(8 * i + 7, 8 * i) : 0;
     }
 
@@ -713,20 +1677,30 @@ ap_uint<256> ethernet_padding::pad_one(ap_uint<256> data, ap_uint<32> keep)
 }
 
 void udp_builder::builder_step(udp_builder_metadata_stream& header_in, hls_ik::data_stream& data_in,
-                               mlx::stream &out)
+                               mlx::stream &out, bool udp_checksum)
 {
 #pragma HLS inline
     DO_PRAGMA(HLS STREAM variable=data_hdr_to_reorder depth=16);
     DO_PRAGMA(HLS STREAM variable=raw_reorder_to_reg depth=FIFO_WORDS);
-    DO_PRAGMA(HLS STREAM variable=data_reorder_to_join depth=5);
+    DO_PRAGMA(HLS STREAM variable=data_reorder_to_checksum depth=5);
+    DO_PRAGMA(HLS STREAM variable=data_checksum_to_expand depth=5);
+    DO_PRAGMA(HLS STREAM variable=data_expand_to_join depth=5);
+    DO_PRAGMA(HLS STREAM variable=pkt_hdr_to_expand depth=16);
+    DO_PRAGMA(HLS STREAM variable=checksum_hdr_to_insert depth=16);
 
     DO_PRAGMA_SYN(HLS data_pack variable=data_hdr_to_reorder);
     DO_PRAGMA_SYN(HLS data_pack variable=raw_reorder_to_reg);
+    DO_PRAGMA_SYN(HLS data_pack variable=pkt_hdr_to_expand);
+    DO_PRAGMA_SYN(HLS data_pack variable=checksum_hdr_to_insert);
 
     hdr2mlx.hdr_to_mlx(header_in, data_hdr_to_reorder, empty_packet,
-                       mlx_metadata, enable_stream);
-    merger.reorder(data_hdr_to_reorder, empty_packet, enable_stream, data_in, data_reorder_to_join);
-    join_pkt_metadata(mlx_metadata, data_reorder_to_join, raw_reorder_to_reg);
+                       mlx_metadata, enable_stream, pkt_hdr_to_expand,
+                       udp_checksum, checksum_hdr_to_insert);
+    merger.reorder(data_hdr_to_reorder, empty_packet, enable_stream, data_in, data_reorder_to_checksum);
+    checksum_insert.insert_step(checksum_hdr_to_insert, data_reorder_to_checksum,
+                                data_checksum_to_expand);
+    hdr_expand.expand(pkt_hdr_to_expand, data_checksum_to_expand, data_expand_to_join);
+    join_pkt_metadata(mlx_metadata, data_expand_to_join, raw_reorder_to_reg);
     link.link(raw_reorder_to_reg, out);
 }
 
@@ -738,10 +1712,12 @@ void udp_top(mlx::stream& in,
              result_stream& ft_results,
              hls_ik::data_stream& data_out,
              udp::bool_stream& bool_pass_raw,
+             hls_ik::memory_t& ft_mem,
              udp::config* cfg, udp::udp_stats* stats)
 {
 #pragma HLS interface axis port=in
 #pragma HLS interface axis port=data_out
+    NTL_MEMORY_INTERFACE_PRAGMA(ft_mem)
 #pragma HLS INTERFACE s_axilite port=cfg->enable offset=0x10
     GATEWAY_OFFSET(cfg->flow_table_gateway, 0x18, 0x20, 0x30)
     GATEWAY_OFFSET(cfg->arbiter_gateway, 0x58, 0x60, 0x70)
@@ -749,5 +1725,5 @@ void udp_top(mlx::stream& in,
 
     static udp::udp u;
 
-    u.udp_step(in, header_out, ft_results, data_out, bool_pass_raw, cfg, stats);
+    u.udp_step(in, header_out, ft_results, data_out, bool_pass_raw, ft_mem, cfg, stats);
 }
@@ -26,6 +26,7 @@
 #define UDP_H
 
 #include <boost/preprocessor/repetition/enum_params.hpp>
+#include <boost/preprocessor/iteration/local.hpp>
 
 #include <linux/if_ether.h>
 #include <linux/ip.h>
@@ -180,6 +181,20 @@ namespace udp {
         mlx::user_t user;
 	bool drop; /* Mark the packet to be dropped */
         bool generated; /* Mark generated packets */
+        /* One's complement sum of the IP options stripped from hdr, needed
+         * to verify the IP header checksum. */
+        ap_uint<16> ip_options_checksum;
+        /* VLAN tags stripped from hdr */
+        hls_ik::vlan_tags vlan;
+        /* IPv6 packet. hdr holds an IPv4 header translated from the IPv6
+         * one, with the low 32 bits of the addresses in saddr and daddr,
+         * and the rest here. */
+        bool ipv6;
+        ap_uint<96> saddr_high;
+        ap_uint<96> daddr_high;
+        /* Checksums of the packet are calculated and validated. Latched
+         * from config.checksum_validate as the packet enters the checks. */
+        bool validate_checksums;
     };
 
 #define HEADER_BUFFER(__name, __hdr, __pkt_id, __user, __generated) \
@@ -187,7 +202,13 @@ namespace udp {
     __name.hdr = __hdr; \
     __name.pkt_id = __pkt_id; \
     __name.user = __user; \
-    __name.generated = __generated;
+    __name.generated = __generated; \
+    __name.ip_options_checksum = 0; \
+    __name.vlan = hls_ik::vlan_tags(); \
+    __name.ipv6 = false; \
+    __name.saddr_high = 0; \
+    __name.daddr_high = 0; \
+    __name.validate_checksums = false;
 
     typedef hls::stream<header_buffer> header_stream;
 
@@ -198,10 +219,19 @@ namespace udp {
 
     struct config {
         bool enable;
+        /** Fill in the UDP checksum of generated IPv4 packets. IPv6 packets
+         * always get one. This delays each packet until all of it has been
+         * summed. */
+        bool udp_checksum;
+        /** Drop packets steered to an ikernel with a wrong IP or UDP
+         * checksum. */
+        bool checksum_validate;
         /** Gateway to access flow table */
         hls_ik::gateway_registers flow_table_gateway;
         /** Gateway to access the arbiter */
         hls_ik::gateway_registers arbiter_gateway;
+        /** Gateway to access the crossbar's replica groups */
+        hls_ik::gateway_registers crossbar_gateway;
     };
 
     struct config_h2n {
@@ -224,6 +254,11 @@ namespace udp {
         packet_counters ft_action_passthrough,
                         ft_action_drop,
                         ft_action_ikernel;
+        packet_counters drop_bad_ip_checksum,
+                        drop_bad_udp_checksum;
+        /* Packets that exceeded their flow's policer, by exceed action */
+        packet_counters policer_drop,
+                        policer_passthrough;
     };
 
     class udp_dropper {
@@ -253,9 +288,27 @@ namespace udp {
         void split(header_stream& header, hls_ik::data_stream& data);
 
     private:
-        enum { IDLE, READING_HEADER, STREAM, LAST } state;
+        /* Assemble the header buffer from the words holding the packet
+         * headers, skipping the VLAN tags and the IP options, and
+         * translating IPv6 headers */
+        void write_header(header_stream& header,
+                          const ap_uint<3 * MLX_AXI4_WIDTH_BITS>& words);
+
+        enum { IDLE, READING_HEADER, READING_HEADER_END, STREAM, LAST } state;
         mlx::metadata meta;
+        /* First word of the packet, holding the Ethernet and most of the IP
+         * header */
+        ap_uint<MLX_AXI4_WIDTH_BITS> first;
         ap_uint<MLX_AXI4_WIDTH_BITS> buffer;
+        /* VLAN tags, and their length in bytes (up to 8) */
+        hls_ik::vlan_tags vlan;
+        ap_uint<4> tags_length;
+        /* Length of the IP options in bytes (up to 40) */
+        ap_uint<6> options_length;
+        /* IPv6 packet, whose header is 20 bytes longer than IPv4's */
+        bool ipv6;
+        /* Where the payload starts in the buffered word, in bytes */
+        mlx::byte_offset_t data_offset;
         mlx::extract_metadata extract_metadata;
     };
 
@@ -267,13 +320,14 @@ namespace udp {
         steering();
         void steer(header_stream& hdr_in, hls_ik::data_stream& data_in, bool_stream& pass_raw,
                    header_stream& hdr_out, hls_ik::data_stream& data_out,
-                   result_stream& result_out,
-                   config* config, hds_stats* s);
+                   result_stream& result_out, hls_ik::memory_t& ft_mem,
+                   config* config, hds_stats* s, flow_table_stats* ft_stats);
     private:
         void hdr_checks(const config& config);
         void checks_to_action(const config& config, result_stream& result_out);
         void update_stats_checks(hds_stats* s);
         void update_stats_actions(bool_stream& pass_raw, hds_stats* s);
+        void update_stats_policers(hds_stats* s);
 
         hds_stats stats;
 
@@ -282,6 +336,7 @@ namespace udp {
             bool not_ipv4;
             bool bad_length;
             bool not_udp;
+            ap_uint<16> length;
             flow_table_result ft_result;
         };
 
@@ -292,6 +347,9 @@ namespace udp {
         udp_dropper dropper;
         hls_helpers::duplicator<2, header_buffer> hdr_dup;
         result_stream ft_to_action, ft_results;
+        counter_update_stream ft_counter_updates;
+        /* Exceed actions of policed packets, for the statistics */
+        hls::stream<flow_table_action> policed;
         flow_table ft;
     };
 
@@ -312,7 +370,7 @@ namespace udp {
         struct packet_metadata {
             ap_uint<11> word_count;
             ap_uint<16> tot_len;
-            ap_uint<5> last_word_data;
+            mlx::byte_offset_t last_word_data;
             mlx::pkt_id_t pkt_id;
         };
         hls::stream<packet_metadata> packets;
@@ -341,10 +399,12 @@ namespace udp {
 		void checksum_header_and_data(header_stream& hdr_in, hls_ik::data_stream& data_in);
 		void finish_checksum(stream& checksum);
 
-        /* First part of the IPv4 checksum */
-        void ipv4_checksum(ip_header hdr);
-        /* Pseudo header calculation */
-        void udp_pseudoheader_checksum(const header_parser& hdr);
+        /* First part of the IPv4 checksum, including the sum of the IP
+         * options that are not part of the header buffer */
+        void ipv4_checksum(ip_header hdr, ap_uint<16> options_checksum);
+        /* Pseudo header calculation, including the high bits of IPv6
+         * addresses */
+        void udp_pseudoheader_checksum(const header_buffer& buf);
 
 		enum { IDLE, DATA } state;
         DBG_DECL(mlx::pkt_id_t pkt_id);
@@ -352,17 +412,192 @@ namespace udp {
         hls::stream<intermediate_checksum> intermediate_stream;
 	};
 
+    /* Compare the checksums of packets steered to an ikernel with the ones
+     * in their headers, and drop the packets that do not match. Packets that
+     * entered while validation was disabled have no checksum, and pass
+     * without waiting for one. Passes the header of every packet on to a
+     * dropper, but only the flow table results of the packets that pass. */
 	class checksum_validate {
 	public:
-        typedef checksum_t first_argument_type;
-        typedef header_buffer second_argument_type;
-        typedef bool result_type;
-		bool operator()(checksum_t sum, header_buffer buf);
+        checksum_validate();
+        void validate_step(checksum::stream& checksums, header_stream& hdr_in,
+                           result_stream& results_in, bool_stream& pass,
+                           header_stream& hdr_out, result_stream& results_out,
+                           hds_stats* s);
+
+	private:
+        void validate(checksum::stream& checksums, header_stream& hdr_in,
+                      result_stream& results_in, bool_stream& pass,
+                      header_stream& hdr_out, result_stream& results_out);
+        void update_stats(hds_stats* s);
+
+        struct checks {
+            bool bad_ip_checksum;
+            bool bad_udp_checksum;
+        };
+
+        hls::stream<checks> checks_to_stats;
+        hds_stats stats;
+        /* Header waiting for its checksum */
+        header_buffer buf;
+        bool buf_valid;
 	};
-	typedef hls_helpers::binary_stream<checksum_validate> checksum_validator;
+
+/* Capacity of the virtual output queue of each ikernel */
+#define VOQ_PACKETS FIFO_PACKETS
+#define VOQ_WORDS FIFO_WORDS
+
+/* Replica groups spread the packets of FT_REPLICA_GROUP flow table results,
+ * whose engine field holds the group number, across several instances of
+ * the same ikernel. The crossbar picks the engine by a hash of the packet's
+ * 5-tuple, or of some of its first payload bytes, so packets with the same
+ * key always reach the same instance in order. Each group has the
+ * XBAR_GROUP_* registers at offsets starting from XBAR_GROUP_BASE with stride
+ * XBAR_GROUP_STRIDE in the crossbar gateway. */
+#define REPLICA_GROUPS (1 << LOG_NUM_ENGINES)
+#define XBAR_NUM_GROUPS 0x0
+/* When set, a packet whose ikernel's queue is full is dropped, so that a slow
+ * ikernel only loses its own traffic instead of holding back the packets to
+ * the others. Cleared by default: the dispatcher waits for room and no
+ * packets are lost. */
+#define XBAR_DROP_ON_FULL 0x1
+#define XBAR_GROUP_BASE 0x10
+#define XBAR_GROUP_STRIDE 0x2
+/* The group's engines: the first engine in bits 7:0, and the number of
+ * engines in bits 15:8. Packets to a group with no engines are dropped.
+ * Groups that extend past the last engine are rejected. */
+#define XBAR_GROUP_ENGINES 0x0
+/* The hash: XBAR_HASH_5TUPLE, or XBAR_HASH_PAYLOAD with the offset of the
+ * first hashed byte in bits 15:8 and the number of bytes (up to
+ * XBAR_HASH_MAX_BYTES) in bits 23:16. Only bytes of the first data word are
+ * hashed. */
+#define XBAR_GROUP_HASH 0x1
+
+#define XBAR_HASH_5TUPLE 0
+#define XBAR_HASH_PAYLOAD 1
+#define XBAR_HASH_MAX_BYTES 16
+
+    struct replica_group {
+        ap_uint<8> first;
+        ap_uint<8> count;
+        ap_uint<1> hash;
+        ap_uint<8> payload_offset;
+        ap_uint<8> payload_bytes;
+
+        replica_group() : first(0), count(0), hash(XBAR_HASH_5TUPLE),
+            payload_offset(0), payload_bytes(0) {}
+    };
+
+    struct replica_group_update {
+        ap_uint<LOG_NUM_ENGINES> index;
+        replica_group group;
+    };
+
+    struct crossbar_stats {
+        /* Packets dropped because their ikernel's queue was full, with
+         * XBAR_DROP_ON_FULL set */
+        packet_counters voq_full[NUM_IKERNELS];
+    };
+
+    /* Space of a packet that left a virtual output queue */
+    struct voq_credit {
+        ap_uint<16> words;
+    };
+    typedef hls::stream<voq_credit> voq_credit_stream;
+
+    /* The queue of packets waiting for a single ikernel, and the process
+     * that passes them on as the ikernel accepts them */
+    class virtual_output_queue {
+    public:
+        virtual_output_queue();
+        void forward(header_stream& hdr_out, result_stream& ft_results,
+                     hls_ik::data_stream& data_out);
+
+        header_stream hdr;
+        result_stream results;
+        hls_ik::data_stream data;
+        /* Returned to the dispatcher for every packet forwarded */
+        voq_credit_stream credits;
+
+    private:
+        enum { IDLE, STREAM } state;
+        ap_uint<16> words;
+    };
+
+    /* Steers packets to the ikernels through per-ikernel virtual output
+     * queues. The dispatcher tracks the occupancy of each queue, and waits
+     * for room in the queue of the current packet, or drops the packet when
+     * XBAR_DROP_ON_FULL is set. */
+    class voq_crossbar {
+    public:
+        voq_crossbar();
+        void crossbar_step(header_stream& hdr_in, hls_ik::data_stream& data_in,
+                           result_stream& steer_results,
+                           BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, header_stream& hdr_out),
+                           BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, result_stream& ft_results),
+                           BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, hls_ik::data_stream& data_out),
+                           hls_ik::gateway_registers& g, crossbar_stats* s);
+
+        void dispatch(header_stream& hdr_in, hls_ik::data_stream& data_in,
+                      result_stream& steer_results);
+        void update_stats(crossbar_stats* s);
+        void replica_gateway(hls_ik::gateway_registers& g);
+
+        int reg_write(int address, int value);
+        int reg_read(int address, int* value);
+        void gateway_update() {}
+
+#define BOOST_PP_LOCAL_MACRO(i) \
+        virtual_output_queue voq ## i;
+#define BOOST_PP_LOCAL_LIMITS (0, NUM_IKERNELS - 1)
+%:include BOOST_PP_LOCAL_ITERATE()
+
+    private:
+        typedef ap_uint<8> port_t;
+
+        /* Write the current packet's header and result to the queue of the
+         * given port if it has room for the packet. Returns false when the
+         * packet has to wait for room. */
+        bool admit(port_t p);
+        /* Admit the current packet and move on to its data, or wait */
+        void dispatch_packet(port_t p);
+        void write_data(const hls_ik::axi_data& w);
+        static port_t select_replica(const replica_group& group, ap_uint<32> hash);
+        static ap_uint<32> hash_5tuple(const header_parser& hdr);
+        static ap_uint<32> hash_payload(const replica_group& group, const hls_ik::axi_data& w);
+
+        /* PEEK waits for the first data word of a packet to a group that
+         * hashes its payload, and WAIT for room in the packet's queue */
+        enum { IDLE, PEEK, WAIT, STREAM } state;
+        header_buffer cur_buf;
+        flow_table_result cur_result;
+        ap_uint<16> cur_words;
+        /* The first data word, when read to pick the port */
+        hls_ik::axi_data peeked;
+        bool have_peeked;
+        /* Whether the current packet is written to a queue */
+        bool admitted;
+        port_t port;
+        /* Occupancy of each queue */
+        ap_uint<16> voq_words[NUM_IKERNELS];
+        ap_uint<8> voq_packets[NUM_IKERNELS];
+
+        replica_group groups[REPLICA_GROUPS];
+        /* Copy of the groups for the gateway to read */
+        replica_group gateway_groups[REPLICA_GROUPS];
+        hls::stream<replica_group_update> group_updates;
+        bool drop_on_full, gateway_drop_on_full;
+        hls::stream<bool> drop_on_full_updates;
+        ntl::gateway_impl<int> gateway;
+
+        hls::stream<port_t> drops_to_stats;
+        crossbar_stats stats;
+    };
 
     struct udp_stats {
         hds_stats hds;
+        flow_table_stats ft;
+        crossbar_stats crossbar;
     };
 
 	/* A basic UDP unit for parsing Ethernet, IP and UDP headers, detecting
@@ -375,47 +610,71 @@ namespace udp {
                       BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, result_stream& ft_results),
                       BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, hls_ik::data_stream& data_out),
                       bool_stream& bool_pass_raw,
+                      hls_ik::memory_t& ft_mem,
                       config* config, udp_stats* stats);
 	private:
 		header_data_split hds;
 		steering steer;
 		length_adjust length_adjuster;
 		checksum checksum_calculator;
-		checksum_validator validator;
-		hls_helpers::duplicator<2, header_buffer> hdr_dup;
+		checksum_validate validator;
 		udp_dropper udp_dropper_instance;
+		voq_crossbar crossbar;
 
-		/* Crossbar state */
-		enum { IDLE, STREAM } state;
-        flow_table_result current_steering_decision;
-        void crossbar(header_stream& hdr_in, hls_ik::data_stream& data_in, result_stream& steer_results,
-            BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, header_stream& hdr_out),
-            BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, result_stream& ft_results),
-            BOOST_PP_ENUM_PARAMS(NUM_IKERNELS, hls_ik::data_stream& data_out));
-
-        hls_ik::data_stream data_split_to_steer, data_steer_to_length, data_length_to_crossbar;
+        hls_ik::data_stream data_split_to_steer, data_steer_to_length, data_length_to_dup,
+            data_dup_to_checksum, data_dup_to_dropper, data_dropper_to_crossbar;
         header_stream header_split_to_steer, header_steer_to_dup, header_dup_to_length,
-            header_dup_to_crossbar;
-        result_stream steer_results;
+            header_dup_to_checksum, header_dup_to_validate, header_validate_to_dropper,
+            header_dropper_to_crossbar;
+        result_stream steer_results, validated_results;
+        checksum::stream checksums;
+        bool_stream validate_to_dropper;
+
+        /* Send packets to the checksum calculator only while validation is
+         * enabled, so that the others need not wait for their checksums */
+        void split_headers(const config& config);
+        void split_data();
+        /* Whether the data of each non-empty packet goes to the checksum
+         * calculator */
+        bool_stream split_to_data;
+        bool split_data_checksum, split_data_valid;
 	};
 
         typedef hls_ik::metadata udp_builder_metadata;
 
     typedef hls::stream<ap_uint<udp_builder_metadata::width> > udp_builder_metadata_stream;
 
-    /* Take a header stream and generate two-beat packets with the header only */
+    typedef hls::stream<hls_ik::packet_metadata> packet_metadata_stream;
+
+    /* Per packet command to the checksum insertion: whether to fill in the
+     * UDP checksum, and the sum of the pseudo header fields that are not part
+     * of the packet (the protocol, the UDP length and the high bits of IPv6
+     * addresses) */
+    struct checksum_cmd {
+        bool enable;
+        ap_uint<16> seed;
+    };
+    typedef hls::stream<checksum_cmd> checksum_cmd_stream;
+
+    /* Take a header stream and generate packets with the header only: two
+     * beats with 256-bit words, and a single one with 512-bit words */
     class header_to_mlx
     {
     public:
         void hdr_to_mlx(udp_builder_metadata_stream& in, hls_ik::data_stream& out,
                         bool_stream& empty_packet,
                         mlx::metadata_stream& metadata_out,
-			bool_stream& enable_stream);
+			bool_stream& enable_stream, packet_metadata_stream& pkt_out,
+			bool udp_checksum, checksum_cmd_stream& checksum_out);
     protected:
 	static header_parser metadata_to_header(const hls_ik::metadata& m);
+        static ap_uint<16> ip_header_checksum(ip_header hdr);
+        static ap_uint<16> pseudo_header_seed(const hls_ik::metadata& m);
+#if MLX_AXI4_WIDTH_BITS < 512
         enum { buffer_size = header_parser::width - MLX_AXI4_WIDTH_BITS };
         /** Buffer for leftovers from the first header word. */
         ap_uint<buffer_size> buffer;
+#endif
 
         /** Reordering state:
          *  IDLE   waiting for header stream entry.
@@ -431,9 +690,93 @@ namespace udp {
         void pad(mlx::stream& in, mlx::stream& out);
 
     protected:
-        ap_uint<256> pad_one(ap_uint<256> data, ap_uint<32> keep);
+        mlx::word pad_one(mlx::word data, mlx::keep_t keep);
+
+        ap_uint<2> beat_count;
+    };
+
+    /* Fill in the UDP checksum of the packets generated by header_to_mlx.
+     * Like the checksum class, the sum is split into multiple accumulators,
+     * and only added up once per packet. Packets that need a checksum are
+     * held until their last word has been summed; the others pass through
+     * without waiting. */
+    class checksum_insertion {
+    public:
+        checksum_insertion() : sum_state(IDLE), insert_state(INSERT_IDLE), enable_valid(false) {}
+        void insert_step(checksum_cmd_stream& cmd_in, hls_ik::data_stream& in,
+                         hls_ik::data_stream& out);
+
+    private:
+        static const int num_splits = 8;
+
+        struct intermediate_checksum {
+            ap_uint<32> udp_checksum[num_splits];
+        };
+
+        struct checksum_result {
+            bool enable;
+            ap_uint<16> udp_checksum;
+        };
+
+        void sum_data(checksum_cmd_stream& cmd_in, hls_ik::data_stream& in);
+        void finish_checksum();
+        void insert(hls_ik::data_stream& out);
+
+        /** Summing state:
+         *  IDLE   waiting for the first word and the command of a packet.
+         *  DATA   summing the rest of the packet.
+         */
+        enum { IDLE, DATA } sum_state;
+        bool sum_enable;
+        intermediate_checksum cur_checksum;
+        /** Insertion state:
+         *  INSERT_IDLE waiting for the first word and the checksum of a packet.
+         *  SECOND      writing the checksum into the second word, with
+         *              256-bit words.
+         *  STREAM      passing the rest of the packet.
+         */
+        enum { INSERT_IDLE, SECOND, STREAM } insert_state;
+        checksum_result cur_result;
+        /* cur_result.enable holds the next packet's enables entry */
+        bool enable_valid;
+
+        /* Holds a whole packet while it is being summed */
+        hls_ik::data_stream buffer;
+        /* Whether each packet gets a checksum. Only those that do are
+         * summed up and have an entry in checksums. */
+        hls::stream<bool> enables;
+        hls::stream<intermediate_checksum> intermediate_stream;
+        hls::stream<ap_uint<16> > checksums;
+    };
 
-        ap_uint<6> beat_count;
+    /* Expand the IPv4 header generated by header_to_mlx: insert VLAN tags
+     * after the Ethernet addresses and replace the IP header with an IPv6
+     * header for IPv6 packets, shifting the rest of the packet */
+    class header_expansion {
+    public:
+        header_expansion();
+        void expand(packet_metadata_stream& pkt_in, hls_ik::data_stream& in,
+                    hls_ik::data_stream& out);
+
+    private:
+        /* Output the end of the packet, that was shifted out of the last
+         * input word */
+        void last_word(const ap_uint<MLX_AXI4_WIDTH_BITS>& word,
+                       const mlx::keep_t& keep,
+                       hls_ik::data_stream& out);
+
+        /** Expansion state:
+         *  IDLE   waiting for the first word and the metadata of a packet.
+         *  STREAM shifting the rest of the packet.
+         *  EXTRA  sending the bytes left over from the last input word.
+         */
+        enum { IDLE, STREAM, EXTRA } state;
+        /* Number of bytes added to the header (up to 28) */
+        ap_uint<5> shift;
+        /* The previous input word, whose last bytes were shifted out */
+        ap_uint<MLX_AXI4_WIDTH_BITS> prev;
+        /* Number of valid bytes in the extra word */
+        ap_uint<5> extra_bytes;
     };
 
     /* Build the AXI4 Stream of UDP packets back from the split header and data
@@ -445,17 +788,22 @@ namespace udp {
         /** Builds packets from split header and data streams, and re-calculates
          * the checksum. */
         void builder_step(udp_builder_metadata_stream& header_in, hls_ik::data_stream& data_in,
-                          mlx::stream& out);
+                          mlx::stream& out, bool udp_checksum);
     private:
         void out_word(mlx::stream& out, mlx::stream& generated_out, mlx::axi4s word);
         bool full_output(mlx::stream& out, mlx::stream& generated_out);
 
         mlx::stream raw_reorder_to_reg;
         mlx::metadata_stream mlx_metadata;
-        hls_ik::data_stream data_hdr_to_reorder, data_reorder_to_join;
+        hls_ik::data_stream data_hdr_to_reorder, data_reorder_to_checksum,
+            data_checksum_to_expand, data_expand_to_join;
         bool_stream empty_packet, enable_stream;
+        packet_metadata_stream pkt_hdr_to_expand;
+        checksum_cmd_stream checksum_hdr_to_insert;
         header_to_mlx hdr2mlx;
         ntl::push_header<header_parser::width> merger;
+        checksum_insertion checksum_insert;
+        header_expansion hdr_expand;
         mlx::join_packet_metadata join_pkt_metadata;
         link_with_reg<mlx::axi4s, false> link;
     };
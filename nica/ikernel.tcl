@@ -22,6 +22,7 @@ proc create_project {name top dir files tb_files} {
 
     set num_ikernels [get_env "NUM_IKERNELS" 1]
     set num_tc [get_env "NUM_TC" 8]
+    set data_width [get_env "NICA_DATA_WIDTH" 256]
     set memcached_cache_size [get_env "MEMCACHED_CACHE_SIZE" 4096]
     set memcached_key_size [get_env "MEMCACHED_KEY_SIZE" 10]
     set memcached_value_size [get_env "MEMCACHED_VALUE_SIZE" 10]
@@ -38,7 +39,8 @@ proc create_project {name top dir files tb_files} {
                 -I$nica_basedir/../ikernels/hls/tests \
                 -I$gtest_root/include \
                 -Wno-gnu-designator -DNUM_IKERNELS=$num_ikernels \
-                -DNUM_TC=$num_tc"
+                -DNUM_TC=$num_tc \
+                -DMLX_AXI4_WIDTH_BITS=$data_width"
     if {$simulation_build} {
         set cflags "$cflags -DSIMULATION_BUILD=1"
     }